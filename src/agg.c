@@ -0,0 +1,252 @@
+/*
+ * Agg - Streaming Numeric Aggregates.
+ *
+ * See the accompanying header file for more information.
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agg.h"
+
+const double agg_quantiles[AGG_NUM_QUANTILES] = {0.5, 0.9, 0.99};
+
+/*
+ * Compare 2 doubles for sorting.
+ */
+static int
+agg_compare(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Start a P-squared estimator from the first AGG_EXACT values (sorted): the
+ * markers start at the minimum, p/2, p, (1+p)/2 quantiles and the maximum,
+ * moved apart where rounding puts 2 of them at the same position (eg. p and
+ * (1+p)/2 for p = 0.99).
+ */
+static void
+agg_quantile_init(AggQuantile *aq, double p, const double *sorted)
+{
+	double last = AGG_EXACT - 1;
+
+	aq->dn[0] = 0;
+	aq->dn[1] = p / 2;
+	aq->dn[2] = p;
+	aq->dn[3] = (1 + p) / 2;
+	aq->dn[4] = 1;
+
+	for (int i = 0; i < 5; i++) {
+		aq->np[i] = 1 + last * aq->dn[i];
+		aq->n[i] = (int)(aq->np[i] + 0.5);
+	}
+
+	// the positions must be strictly increasing (the maximum is at the end)
+	for (int i = 3; i >= 0; i--) {
+		if (aq->n[i] >= aq->n[i + 1]) {
+			aq->n[i] = aq->n[i + 1] - 1;
+		}
+	}
+
+	for (int i = 0; i < 5; i++) {
+		aq->q[i] = sorted[(int)aq->n[i] - 1];
+	}
+}
+
+/*
+ * Add a value to a started P-squared estimator.
+ */
+static void
+agg_quantile_add(AggQuantile *aq, double x)
+{
+	int k;
+
+	// find the cell the value falls in, extending the extremes
+	if (x < aq->q[0]) {
+		aq->q[0] = x;
+		k = 0;
+	} else if (x >= aq->q[4]) {
+		aq->q[4] = x;
+		k = 3;
+	} else {
+		for (k = 0; k < 3 && x >= aq->q[k + 1]; k++) {
+			// pass
+		}
+	}
+
+	for (int i = k + 1; i < 5; i++) {
+		aq->n[i]++;
+	}
+	for (int i = 0; i < 5; i++) {
+		aq->np[i] += aq->dn[i];
+	}
+
+	// move the middle markers towards their desired positions
+	for (int i = 1; i < 4; i++) {
+		double d = aq->np[i] - aq->n[i];
+		double qp;
+
+		if (!((d >= 1 && aq->n[i + 1] - aq->n[i] > 1) ||
+		    (d <= -1 && aq->n[i - 1] - aq->n[i] < -1))) {
+			continue;
+		}
+		d = d > 0 ? 1 : -1;
+
+		// markers never share a position, but never divide by zero
+		if (aq->n[i + 1] - aq->n[i] < 1 ||
+		    aq->n[i] - aq->n[i - 1] < 1) {
+			continue;
+		}
+
+		// piecewise-parabolic prediction
+		qp = aq->q[i] + d / (aq->n[i + 1] - aq->n[i - 1]) *
+		    ((aq->n[i] - aq->n[i - 1] + d) *
+		    (aq->q[i + 1] - aq->q[i]) / (aq->n[i + 1] - aq->n[i]) +
+		    (aq->n[i + 1] - aq->n[i] - d) *
+		    (aq->q[i] - aq->q[i - 1]) / (aq->n[i] - aq->n[i - 1]));
+
+		// fall back to a linear prediction if it isn't in order
+		if (qp <= aq->q[i - 1] || qp >= aq->q[i + 1]) {
+			int j = i + (int)d;
+			qp = aq->q[i] + d * (aq->q[j] - aq->q[i]) /
+			    (aq->n[j] - aq->n[i]);
+		}
+
+		aq->q[i] = qp;
+		aq->n[i] += d;
+	}
+}
+
+/*
+ * Initialize an AggStats.
+ */
+void
+agg_init(AggStats *a)
+{
+	assert(a != NULL);
+
+	memset(a, 0, sizeof (AggStats));
+	a->min_source = NULL;
+	a->max_source = NULL;
+}
+
+/*
+ * Add a value to an AggStats.
+ */
+void
+agg_add(AggStats *a, double value, const void *source)
+{
+	assert(a != NULL);
+
+	if (a->count == 0 || value < a->min) {
+		a->min = value;
+		a->min_source = source;
+	}
+	if (a->count == 0 || value > a->max) {
+		a->max = value;
+		a->max_source = source;
+	}
+
+	if (a->count < AGG_EXACT) {
+		// keep the first values as they are
+		a->exact[a->count] = value;
+	} else {
+		// switch over to the estimators
+		if (a->count == AGG_EXACT) {
+			qsort(a->exact, AGG_EXACT, sizeof (double),
+			    agg_compare);
+			for (int i = 0; i < AGG_NUM_QUANTILES; i++) {
+				agg_quantile_init(&a->quantiles[i],
+				    agg_quantiles[i], a->exact);
+			}
+		}
+		for (int i = 0; i < AGG_NUM_QUANTILES; i++) {
+			agg_quantile_add(&a->quantiles[i], value);
+		}
+	}
+
+	a->count++;
+	a->mean += (value - a->mean) / (double)a->count;
+}
+
+/*
+ * Estimate a quantile.
+ */
+double
+agg_quantile(const AggStats *a, int i)
+{
+	assert(a != NULL);
+	assert(i >= 0 && i < AGG_NUM_QUANTILES);
+
+	double sorted[AGG_EXACT];
+	size_t idx;
+
+	if (a->count == 0) {
+		return 0;
+	}
+	if (a->count > AGG_EXACT) {
+		return a->quantiles[i].q[2];
+	}
+
+	// nearest rank of the values seen so far
+	memcpy(sorted, a->exact, sizeof (double) * a->count);
+	qsort(sorted, a->count, sizeof (double), agg_compare);
+	idx = (size_t)(agg_quantiles[i] * a->count + 0.999999);
+	idx = idx > 0 ? idx - 1 : 0;
+
+	return sorted[idx];
+}
+
+/*
+ * Parse a decimal number.
+ */
+size_t
+agg_parse_number(const char *s, double *value)
+{
+	assert(s != NULL);
+	assert(value != NULL);
+
+	const char *p = s;
+	double v = 0;
+	double scale = 1;
+	bool negative = false;
+	bool digits = false;
+
+	if (*p == '-' || *p == '+') {
+		negative = *p == '-';
+		p++;
+	}
+
+	while (*p >= '0' && *p <= '9') {
+		v = v * 10 + (*p - '0');
+		digits = true;
+		p++;
+	}
+
+	if (*p == '.' && p[1] >= '0' && p[1] <= '9') {
+		p++;
+		while (*p >= '0' && *p <= '9') {
+			scale /= 10;
+			v += (*p - '0') * scale;
+			digits = true;
+			p++;
+		}
+	}
+
+	if (!digits) {
+		return 0;
+	}
+
+	*value = negative ? -v : v;
+	return p - s;
+}
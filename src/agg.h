@@ -0,0 +1,87 @@
+/*
+ * Agg - Streaming Numeric Aggregates.
+ *
+ * An AggStats summarizes a stream of numbers in a fixed amount of memory: the
+ * count, minimum and maximum (with the source of each, eg. a host), the mean
+ * (kept as a running mean so it doesn't overflow), and a few quantiles
+ * (`agg_quantiles`).  The quantiles are exact for the first AGG_EXACT values,
+ * after which they are estimated with the P-squared algorithm (Jain and
+ * Chlamtac), which tracks 5 markers per quantile (started from the exact
+ * values) and adjusts them with a piecewise-parabolic fit as values arrive.
+ *
+ * Numbers are parsed from text with `agg_parse_number()`, which reads a plain
+ * decimal number ([+-]digits[.digits]) in place without allocating.
+ *
+ * ```
+ * AggStats a;
+ * double v;
+ * agg_init(&a);
+ * if (agg_parse_number("42.5%", &v) > 0) {
+ *	agg_add(&a, v, "web1");
+ * }
+ * printf("max %g from %s, p50 %g\n", a.max, (char *)a.max_source,
+ *     agg_quantile(&a, 0));
+ * ```
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// number of quantiles estimated (see `agg_quantiles`)
+#define AGG_NUM_QUANTILES	3
+
+// number of values kept before switching to estimating the quantiles
+#define AGG_EXACT	64
+
+/*
+ * P-squared estimator for a single quantile.
+ */
+typedef struct agg_quantile {
+	double q[5];		// marker heights
+	double n[5];		// marker positions
+	double np[5];		// desired marker positions
+	double dn[5];		// increments of the desired positions
+} AggQuantile;
+
+/*
+ * Summary of a stream of numbers.
+ */
+typedef struct agg_stats {
+	uint64_t count;		// number of values added
+	double min;		// lowest value
+	double max;		// highest value
+	double mean;		// running mean
+	const void *min_source;	// source of the lowest value
+	const void *max_source;	// source of the highest value
+	double exact[AGG_EXACT];	// the first values (exact quantiles)
+	AggQuantile quantiles[AGG_NUM_QUANTILES];
+} AggStats;
+
+// quantiles estimated for every AggStats (eg. 0.5 is the median)
+extern const double agg_quantiles[AGG_NUM_QUANTILES];
+
+/*
+ * Initialize an empty AggStats.
+ */
+void agg_init(AggStats *a);
+
+/*
+ * Add a value from the given source (only used to report the extremes).
+ */
+void agg_add(AggStats *a, double value, const void *source);
+
+/*
+ * Estimate the `agg_quantiles[i]` quantile of the values added.  Exact for up
+ * to AGG_EXACT values.  Returns 0 if no values have been added.
+ */
+double agg_quantile(const AggStats *a, int i);
+
+/*
+ * Parse a decimal number at the start of the given string.  Returns the number
+ * of characters parsed, or 0 if the string doesn't start with a number.
+ */
+size_t agg_parse_number(const char *s, double *value);
@@ -0,0 +1,558 @@
+/*
+ * ResultCache - On-disk Command Result Cache.
+ *
+ * See the accompanying header file for more information.
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+
+// current file format version
+#define CACHE_VERSION		1
+
+// byte order marker
+#define CACHE_BYTE_ORDER	0x01020304
+
+// number of slots in a newly created index
+#define CACHE_INITIAL_SLOTS	1024
+
+// largest record that will be read back (anything larger is corrupt)
+#define CACHE_MAX_RECORD	(256 * 1024 * 1024) // 256m
+
+/*
+ * Hash a key.  0 is reserved for empty slots.
+ */
+static uint64_t
+cache_hash(const char *key, size_t key_len)
+{
+	uint64_t hash = hash_bytes(key, key_len);
+
+	return hash == 0 ? 1 : hash;
+}
+
+/*
+ * Return the size of an index file with the given number of slots.
+ */
+static size_t
+index_size(uint64_t num_slots)
+{
+	return sizeof (CacheIndexHeader) + num_slots * sizeof (CacheSlot);
+}
+
+/*
+ * Initialize an empty (zero-length) index file with the given number of slots.
+ */
+static int
+index_init(int fd, uint64_t num_slots, uint64_t num_entries)
+{
+	CacheIndexHeader h;
+	ssize_t written;
+
+	memset(&h, 0, sizeof (h));
+	memcpy(h.magic, CACHE_MAGIC, CACHE_MAGIC_LENGTH);
+	h.version = CACHE_VERSION;
+	h.byte_order = CACHE_BYTE_ORDER;
+	h.num_slots = num_slots;
+	h.num_entries = num_entries;
+
+	// extending the file fills the slots with zeroes (empty)
+	if (ftruncate(fd, index_size(num_slots)) == -1) {
+		return -1;
+	}
+	written = pwrite(fd, &h, sizeof (h), 0);
+	if (written == -1) {
+		return -1;
+	}
+	if ((size_t)written != sizeof (h)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * mmap the index file and validate its header.
+ */
+static int
+index_map(ResultCache *c)
+{
+	CacheIndexHeader *h;
+	struct stat st;
+	void *map;
+
+	if (fstat(c->index_fd, &st) == -1) {
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof (*h)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    c->index_fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	h = map;
+	if (memcmp(h->magic, CACHE_MAGIC, CACHE_MAGIC_LENGTH) != 0 ||
+	    h->version != CACHE_VERSION ||
+	    h->byte_order != CACHE_BYTE_ORDER ||
+	    h->num_slots == 0 ||
+	    (h->num_slots & (h->num_slots - 1)) != 0 ||
+	    h->num_slots > (SIZE_MAX - sizeof (*h)) / sizeof (CacheSlot) ||
+	    index_size(h->num_slots) != (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	c->map = map;
+	c->map_size = st.st_size;
+	c->header = h;
+	c->slots = (CacheSlot *)(h + 1);
+
+	return 0;
+}
+
+/*
+ * Unmap and close the index file.
+ */
+static void
+index_close(ResultCache *c)
+{
+	if (c->map != NULL) {
+		munmap(c->map, c->map_size);
+		c->map = NULL;
+		c->header = NULL;
+		c->slots = NULL;
+	}
+	if (c->index_fd >= 0) {
+		close(c->index_fd);
+		c->index_fd = -1;
+	}
+}
+
+/*
+ * Open (creating if needed) and mmap the index file.
+ */
+static int
+index_open(ResultCache *c)
+{
+	struct stat st;
+	int saved_errno;
+
+	c->index_fd = open(c->index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (c->index_fd == -1) {
+		return -1;
+	}
+
+	// initialize a new index (only one process can do this)
+	if (flock(c->index_fd, LOCK_EX) == -1 ||
+	    fstat(c->index_fd, &st) == -1 ||
+	    (st.st_size == 0 &&
+	    index_init(c->index_fd, CACHE_INITIAL_SLOTS, 0) == -1) ||
+	    flock(c->index_fd, LOCK_UN) == -1 ||
+	    index_map(c) == -1) {
+		saved_errno = errno;
+		index_close(c);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the write lock on the index, reopening the index first if it has been
+ * replaced (grown) by another process.
+ */
+static int
+index_lock(ResultCache *c)
+{
+	struct stat path_st;
+	struct stat fd_st;
+
+	while (true) {
+		if (flock(c->index_fd, LOCK_EX) == -1) {
+			return -1;
+		}
+		if (stat(c->index_path, &path_st) == -1 ||
+		    fstat(c->index_fd, &fd_st) == -1) {
+			flock(c->index_fd, LOCK_UN);
+			return -1;
+		}
+		if (path_st.st_dev == fd_st.st_dev &&
+		    path_st.st_ino == fd_st.st_ino) {
+			return 0;
+		}
+
+		// the index was replaced - switch to the new one
+		index_close(c);
+		if (index_open(c) == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Find the slot for the given hash: either the slot already holding it or the
+ * first empty slot.  The index must never be full.
+ */
+static CacheSlot *
+index_find(CacheSlot *slots, uint64_t num_slots, uint64_t hash)
+{
+	uint64_t mask = num_slots - 1;
+
+	for (uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+		if (slots[i].hash == hash || slots[i].hash == 0) {
+			return &slots[i];
+		}
+	}
+}
+
+/*
+ * Rebuild the index with twice the slots and rename it into place.  Must be
+ * called with the index locked - the new index is returned locked.
+ */
+static int
+index_grow(ResultCache *c)
+{
+	char tmp_path[PATH_MAX];
+	ResultCache grown;
+	uint64_t num_slots = c->header->num_slots * 2;
+	int saved_errno;
+
+	if (snprintf(tmp_path, sizeof (tmp_path), "%s.tmp", c->index_path) >=
+	    (int)sizeof (tmp_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	grown.map = NULL;
+	grown.index_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0644);
+	if (grown.index_fd == -1) {
+		return -1;
+	}
+
+	if (flock(grown.index_fd, LOCK_EX) == -1 ||
+	    index_init(grown.index_fd, num_slots,
+	    c->header->num_entries) == -1 ||
+	    index_map(&grown) == -1) {
+		goto fail;
+	}
+
+	// rehash every used slot
+	for (uint64_t i = 0; i < c->header->num_slots; i++) {
+		CacheSlot *slot = &c->slots[i];
+
+		if (slot->hash != 0) {
+			*index_find(grown.slots, num_slots, slot->hash) = *slot;
+		}
+	}
+
+	if (rename(tmp_path, c->index_path) == -1) {
+		goto fail;
+	}
+
+	// closing the old index releases its lock
+	index_close(c);
+	c->index_fd = grown.index_fd;
+	c->map = grown.map;
+	c->map_size = grown.map_size;
+	c->header = grown.header;
+	c->slots = grown.slots;
+
+	return 0;
+
+fail:
+	saved_errno = errno;
+	index_close(&grown);
+	unlink(tmp_path);
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * Open a ResultCache.
+ */
+ResultCache *
+cache_open(const char *dir)
+{
+	ResultCache *c;
+	char path[PATH_MAX];
+	int saved_errno;
+
+	assert(dir != NULL);
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		return NULL;
+	}
+
+	c = malloc(sizeof (ResultCache));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->index_fd = -1;
+	c->data_fd = -1;
+	c->map = NULL;
+	c->header = NULL;
+	c->slots = NULL;
+	c->index_path = NULL;
+
+	if (snprintf(path, sizeof (path), "%s/index", dir) >=
+	    (int)sizeof (path)) {
+		errno = ENAMETOOLONG;
+		goto fail;
+	}
+	if ((c->index_path = strdup(path)) == NULL) {
+		goto fail;
+	}
+	if (index_open(c) == -1) {
+		goto fail;
+	}
+
+	snprintf(path, sizeof (path), "%s/data", dir);
+	c->data_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0644);
+	if (c->data_fd == -1) {
+		goto fail;
+	}
+
+	return c;
+
+fail:
+	saved_errno = errno;
+	cache_close(c);
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Read the record for a slot and check it belongs to the given key.
+ *
+ * Returns 1 if the record matched, 0 if not (or if the record is unreadable),
+ * and -1 on error.
+ */
+static int
+read_record(ResultCache *c, const CacheSlot *slot, const char *key,
+	size_t key_len, CacheEntry *entry)
+{
+	CacheRecord rec;
+	char *buf;
+	size_t len = slot->length;
+	size_t done = 0;
+
+	if (len < sizeof (rec) + key_len || len > CACHE_MAX_RECORD) {
+		return 0;
+	}
+
+	buf = malloc(len);
+	if (buf == NULL) {
+		return -1;
+	}
+
+	while (done < len) {
+		ssize_t n = pread(c->data_fd, buf + done, len - done,
+		    slot->offset + done);
+		if (n <= 0) {
+			free(buf);
+			return 0;
+		}
+		done += n;
+	}
+
+	memcpy(&rec, buf, sizeof (rec));
+	if (rec.key_len != key_len ||
+	    rec.out_len > len || rec.err_len > len ||
+	    sizeof (rec) + key_len + rec.out_len + rec.err_len != len ||
+	    memcmp(buf + sizeof (rec), key, key_len) != 0) {
+		free(buf);
+		return 0;
+	}
+
+	entry->exit_code = rec.exit_code;
+	entry->stored = slot->stored;
+	entry->out = buf + sizeof (rec) + key_len;
+	entry->out_len = rec.out_len;
+	entry->err = entry->out + rec.out_len;
+	entry->err_len = rec.err_len;
+	entry->buf = buf;
+
+	return 1;
+}
+
+/*
+ * Look up a result in the cache.
+ */
+int
+cache_lookup(ResultCache *c, const char *key, size_t key_len, long max_age,
+	CacheEntry *entry)
+{
+	assert(c != NULL);
+	assert(key != NULL);
+	assert(entry != NULL);
+
+	uint64_t hash = cache_hash(key, key_len);
+	uint64_t num_slots = c->header->num_slots;
+	uint64_t mask = num_slots - 1;
+	time_t now = time(NULL);
+
+	for (uint64_t i = hash & mask, n = 0; n < num_slots;
+	    i = (i + 1) & mask, n++) {
+		// copy the slot as another process may be writing to it
+		CacheSlot slot = c->slots[i];
+
+		if (slot.hash == 0) {
+			return 0;
+		}
+		if (slot.hash != hash) {
+			continue;
+		}
+		if (now - slot.stored > max_age) {
+			return 0;
+		}
+
+		return read_record(c, &slot, key, key_len, entry);
+	}
+
+	return 0;
+}
+
+/*
+ * Store a result in the cache.
+ */
+int
+cache_store(ResultCache *c, const char *key, size_t key_len, int exit_code,
+	const char *out, size_t out_len, const char *err, size_t err_len)
+{
+	assert(c != NULL);
+	assert(key != NULL);
+	assert(out != NULL || out_len == 0);
+	assert(err != NULL || err_len == 0);
+
+	uint64_t hash = cache_hash(key, key_len);
+	CacheRecord rec;
+	CacheSlot *slot;
+	struct iovec iov[4];
+	size_t len = sizeof (rec) + key_len + out_len + err_len;
+	ssize_t written;
+	off_t offset;
+	int saved_errno;
+
+	if (key_len > UINT32_MAX || len > CACHE_MAX_RECORD) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	rec.key_len = key_len;
+	rec.exit_code = exit_code;
+	rec.out_len = out_len;
+	rec.err_len = err_len;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof (rec);
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = key_len;
+	iov[2].iov_base = (void *)out;
+	iov[2].iov_len = out_len;
+	iov[3].iov_base = (void *)err;
+	iov[3].iov_len = err_len;
+
+	if (index_lock(c) == -1) {
+		return -1;
+	}
+
+	// keep the index at most half full
+	if ((c->header->num_entries + 1) * 2 > c->header->num_slots &&
+	    index_grow(c) == -1) {
+		goto fail;
+	}
+
+	// append the record
+	offset = lseek(c->data_fd, 0, SEEK_END);
+	if (offset == -1) {
+		goto fail;
+	}
+	written = writev(c->data_fd, iov, 4);
+	if (written == -1) {
+		goto fail;
+	}
+	if ((size_t)written != len) {
+		errno = EIO;
+		goto fail;
+	}
+
+	// point the slot at the record, setting the hash last
+	slot = index_find(c->slots, c->header->num_slots, hash);
+	if (slot->hash == 0) {
+		c->header->num_entries++;
+	}
+	slot->stored = time(NULL);
+	slot->offset = offset;
+	slot->length = len;
+	slot->hash = hash;
+
+	flock(c->index_fd, LOCK_UN);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	flock(c->index_fd, LOCK_UN);
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * Free a CacheEntry buffer.
+ */
+void
+cache_entry_free(CacheEntry *entry)
+{
+	if (entry == NULL) {
+		return;
+	}
+
+	free(entry->buf);
+	entry->buf = NULL;
+	entry->out = NULL;
+	entry->err = NULL;
+}
+
+/*
+ * Close a ResultCache.
+ */
+void
+cache_close(ResultCache *c)
+{
+	if (c == NULL) {
+		return;
+	}
+
+	index_close(c);
+	if (c->data_fd >= 0) {
+		close(c->data_fd);
+	}
+	free(c->index_path);
+	free(c);
+}
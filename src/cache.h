@@ -0,0 +1,151 @@
+/*
+ * ResultCache - On-disk Command Result Cache.
+ *
+ * A ResultCache stores the exit code and output (stdout and stderr) of a
+ * command keyed by an arbitrary string of bytes (sshp uses the full ssh argv,
+ * which includes the host).  A cache is a directory holding two files:
+ *
+ * ```
+ * index                              data
+ * +--------------------+             +-------------------------------+
+ * | CacheIndexHeader   |             | CacheRecord | key | out | err |
+ * +--------------------+      +----> +-------------------------------+
+ * | CacheSlot          | -----+      | CacheRecord | key | out | err |
+ * | CacheSlot (empty)  |             +-------------------------------+
+ * | CacheSlot          | ----------> | ...                           |
+ * | ...                |             +-------------------------------+
+ * +--------------------+
+ * ```
+ *
+ * - `index` is an open-addressing (linear probing) hash table that is `mmap`ed
+ *   shared, so lookups are just a few memory reads.
+ * - `data` is append-only.  Storing a key again appends a new record and
+ *   points its slot at it - records are never modified in place.
+ *
+ * Writers serialize on an exclusive `flock` of the index.  When the index
+ * fills up it is rebuilt with twice the slots and renamed into place; other
+ * processes notice this the next time they store a result.  Old records are
+ * never reclaimed, remove the cache directory to reclaim the space.
+ *
+ * ```
+ * ResultCache *c = cache_open("/tmp/cache");
+ * CacheEntry e;
+ * if (cache_lookup(c, "key", 3, 60, &e) == 1) {
+ *	fwrite(e.out, 1, e.out_len, stdout);
+ *	cache_entry_free(&e);
+ * } else {
+ *	cache_store(c, "key", 3, 0, "hello\n", 6, "", 0);
+ * }
+ * cache_close(c);
+ * ```
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// magic bytes at the start of every cache index file
+#define CACHE_MAGIC		"SSHPIDX\0"
+#define CACHE_MAGIC_LENGTH	8
+
+/*
+ * On-disk index header.
+ */
+typedef struct cache_index_header {
+	char magic[CACHE_MAGIC_LENGTH];	// CACHE_MAGIC
+	uint32_t version;		// file format version
+	uint32_t byte_order;		// 0x01020304 in native byte order
+	uint64_t num_slots;		// number of slots (always a power of 2)
+	uint64_t num_entries;		// number of used slots
+} CacheIndexHeader;
+
+/*
+ * On-disk index slot.
+ */
+typedef struct cache_slot {
+	uint64_t hash;			// hash of the key, 0 = empty
+	int64_t stored;			// unix time the record was stored
+	uint64_t offset;		// data file offset of the record
+	uint64_t length;		// length of the record (with header)
+} CacheSlot;
+
+/*
+ * On-disk data record header (followed by the key, stdout and stderr).
+ */
+typedef struct cache_record {
+	uint32_t key_len;		// length of the key
+	int32_t exit_code;		// exit code of the command
+	uint64_t out_len;		// length of stdout
+	uint64_t err_len;		// length of stderr
+} CacheRecord;
+
+/*
+ * A cached result returned by `cache_lookup()`.  `out` and `err` point into a
+ * single allocated buffer that is freed with `cache_entry_free()`.
+ */
+typedef struct cache_entry {
+	int exit_code;			// exit code of the command
+	time_t stored;			// time the result was stored
+	char *out;			// stdout
+	size_t out_len;			// length of stdout
+	char *err;			// stderr
+	size_t err_len;			// length of stderr
+	char *buf;			// allocated record
+} CacheEntry;
+
+/*
+ * ResultCache Opaque object.
+ *
+ * This type should not be created manually, but instead created with
+ * `cache_open()`.
+ */
+typedef struct result_cache {
+	char *index_path;		// path to the index file
+	int index_fd;			// index file fd (used for locking)
+	int data_fd;			// data file fd (append-only)
+	void *map;			// mmap'd index
+	size_t map_size;		// size of the mmap'd index
+	CacheIndexHeader *header;	// index header
+	CacheSlot *slots;		// index slots
+} ResultCache;
+
+/*
+ * Open the cache in the given directory, creating the directory (but not its
+ * parents) and cache files if needed.
+ *
+ * Returns NULL and sets errno on error (EINVAL if the index is invalid).
+ */
+ResultCache *cache_open(const char *dir);
+
+/*
+ * Look up the given key, ignoring results stored more than `max_age` seconds
+ * ago.
+ *
+ * Returns 1 (and fills in `entry`) if a result was found, 0 if not, and -1
+ * (setting errno) on error.
+ */
+int cache_lookup(ResultCache *c, const char *key, size_t key_len,
+	long max_age, CacheEntry *entry);
+
+/*
+ * Store a result for the given key, replacing any previous result.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int cache_store(ResultCache *c, const char *key, size_t key_len,
+	int exit_code, const char *out, size_t out_len, const char *err,
+	size_t err_len);
+
+/*
+ * Free the buffer held by a CacheEntry.
+ */
+void cache_entry_free(CacheEntry *entry);
+
+/*
+ * Unmap the index, close the cache files and free the ResultCache.
+ */
+void cache_close(ResultCache *c);
@@ -114,6 +114,54 @@ fdwatcher_remove(FdWatcher *fdw, int fd)
 	return ret;
 }
 
+/*
+ * Add a file descriptor to the watchlist for write events.
+ */
+int
+fdwatcher_add_writable(FdWatcher *fdw, int fd, void *ptr)
+{
+	int ret = -1;
+
+#if USE_KQUEUE
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+	ev.udata = ptr;
+
+	ret = kevent(fdw->kq, &ev, 1, NULL, 0, NULL);
+#else
+	struct epoll_event ev;
+
+	ev.events = EPOLLOUT;
+	ev.data.ptr = ptr;
+
+	ret = epoll_ctl(fdw->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+#endif
+
+	return ret;
+}
+
+/*
+ * Remove a file descriptor watched for write events from the watchlist.
+ */
+int
+fdwatcher_remove_writable(FdWatcher *fdw, int fd)
+{
+	int ret = -1;
+
+#if USE_KQUEUE
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+	ret = kevent(fdw->kq, &ev, 1, NULL, 0, NULL);
+#else
+	ret = epoll_ctl(fdw->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+	return ret;
+}
+
 /*
  * Wait for fd events.
  */
@@ -110,6 +110,23 @@ int fdwatcher_add(FdWatcher *fdw, int fd, void *ptr);
  */
 int fdwatcher_remove(FdWatcher *fdw, int fd);
 
+/*
+ * Add a file descriptor with the given user data to the watch list, waiting
+ * for it to become writable instead of readable.  This is useful for watching
+ * non-blocking `connect` calls, which signal completion by becoming writable.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int fdwatcher_add_writable(FdWatcher *fdw, int fd, void *ptr);
+
+/*
+ * Remove a file descriptor added with `fdwatcher_add_writable` from the
+ * watchlist.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int fdwatcher_remove_writable(FdWatcher *fdw, int fd);
+
 /*
  * Wait for events and return when one or more are seen.  `events` and
  * `nevents` are an array of pointers (type agnostic) and the number of
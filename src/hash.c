@@ -0,0 +1,43 @@
+/*
+ * Hash - Non-cryptographic Hashing.
+ *
+ * See the accompanying header file for more information.
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <assert.h>
+
+#include "hash.h"
+
+// 64 bit FNV prime
+#define HASH_PRIME	0x100000001b3
+
+/*
+ * Continue a 64 bit FNV-1a hash.
+ */
+uint64_t
+hash_update(uint64_t hash, const void *buf, size_t len)
+{
+	assert(buf != NULL || len == 0);
+
+	const unsigned char *p = buf;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= HASH_PRIME;
+	}
+
+	return hash;
+}
+
+/*
+ * Compute a 64 bit FNV-1a hash.
+ */
+uint64_t
+hash_bytes(const void *buf, size_t len)
+{
+	return hash_update(HASH_INIT, buf, len);
+}
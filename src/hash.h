@@ -0,0 +1,35 @@
+/*
+ * Hash - Non-cryptographic Hashing.
+ *
+ * 64 bit FNV-1a hashing used for hash tables (both in memory and on disk) and
+ * output digests.  A hash can be computed in one go with `hash_bytes()`, or
+ * incrementally by starting with HASH_INIT and feeding each chunk of data to
+ * `hash_update()`:
+ *
+ * ```
+ * uint64_t hash = HASH_INIT;
+ * hash = hash_update(hash, "hello ", 6);
+ * hash = hash_update(hash, "world", 5);
+ * assert(hash == hash_bytes("hello world", 11));
+ * ```
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// initial value for an incremental hash
+#define HASH_INIT	0xcbf29ce484222325
+
+/*
+ * Hash the given bytes, continuing from the given hash value.
+ */
+uint64_t hash_update(uint64_t hash, const void *buf, size_t len);
+
+/*
+ * Hash the given bytes.
+ */
+uint64_t hash_bytes(const void *buf, size_t len);
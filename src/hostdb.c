@@ -0,0 +1,609 @@
+/*
+ * HostDb - Compiled Hosts Database.
+ *
+ * See the accompanying header file for more information.
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hostdb.h"
+
+// current file format version
+#define HOSTDB_VERSION		1
+
+// byte order marker
+#define HOSTDB_BYTE_ORDER	0x01020304
+
+/*
+ * A single (tag, host) pair used when building the tag index.
+ */
+struct tag_pair {
+	uint32_t off;		// string offset of the tag (not nul-terminated)
+	uint32_t len;		// length of the tag
+	uint32_t host;		// host index
+};
+
+// strings used by tag_pair_compare (qsort has no user data argument)
+static const char *pair_strings = NULL;
+
+/*
+ * Check if the section at `off` with `len` bytes fits in a file of `size`
+ * bytes and is aligned to `align` bytes.
+ */
+static bool
+section_ok(uint64_t off, uint64_t len, size_t size, size_t align)
+{
+	return off % align == 0 && off <= size && len <= size - off;
+}
+
+/*
+ * Check for HostDb magic bytes.
+ */
+bool
+hostdb_check_magic(const char *buf)
+{
+	assert(buf != NULL);
+
+	return memcmp(buf, HOSTDB_MAGIC, HOSTDB_MAGIC_LENGTH) == 0;
+}
+
+/*
+ * Open and mmap a HostDb file.
+ */
+HostDb *
+hostdb_open(const char *path)
+{
+	const HostDbHeader *h;
+	HostDb *db = NULL;
+	struct stat st;
+	void *map;
+	int fd;
+	int saved_errno;
+
+	assert(path != NULL);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		goto fail;
+	}
+	if (!S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof (*h)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+	    0);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	db = malloc(sizeof (HostDb));
+	if (db == NULL) {
+		saved_errno = errno;
+		munmap(map, st.st_size);
+		errno = saved_errno;
+		return NULL;
+	}
+	db->map = map;
+	db->size = st.st_size;
+	db->header = h = map;
+
+	// validate the header and all section boundaries
+	if (!hostdb_check_magic(h->magic) ||
+	    h->version != HOSTDB_VERSION ||
+	    h->byte_order != HOSTDB_BYTE_ORDER ||
+	    h->strings_len == 0 ||
+	    !section_ok(h->strings_off, h->strings_len, db->size, 1) ||
+	    !section_ok(h->names_off, (uint64_t)h->num_hosts * 4, db->size,
+	    4) ||
+	    !section_ok(h->tags_off, (uint64_t)h->num_hosts * 4, db->size,
+	    4) ||
+	    !section_ok(h->ids_off, (uint64_t)h->num_hosts * 4, db->size,
+	    4) ||
+	    !section_ok(h->tag_index_off,
+	    (uint64_t)h->num_tags * sizeof (HostDbTag), db->size, 4) ||
+	    !section_ok(h->tag_hosts_off, (uint64_t)h->num_tag_hosts * 4,
+	    db->size, 4)) {
+		hostdb_close(db);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	db->strings = (char *)map + h->strings_off;
+	db->names = (const uint32_t *)((char *)map + h->names_off);
+	db->tags = (const uint32_t *)((char *)map + h->tags_off);
+	db->ids = (const uint32_t *)((char *)map + h->ids_off);
+	db->tag_index = (const HostDbTag *)((char *)map + h->tag_index_off);
+	db->tag_hosts = (const uint32_t *)((char *)map + h->tag_hosts_off);
+
+	// all strings are terminated by the last byte in the section
+	if (db->strings[h->strings_len - 1] != '\0') {
+		hostdb_close(db);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return db;
+
+fail:
+	saved_errno = errno;
+	if (fd >= 0) {
+		close(fd);
+	}
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Get the number of hosts.
+ */
+uint32_t
+hostdb_num_hosts(HostDb *db)
+{
+	assert(db != NULL);
+
+	return db->header->num_hosts;
+}
+
+/*
+ * Get a hostname.
+ */
+char *
+hostdb_name(HostDb *db, uint32_t idx)
+{
+	assert(db != NULL);
+	assert(idx < db->header->num_hosts);
+
+	uint32_t off = db->names[idx];
+
+	if (off >= db->header->strings_len) {
+		return NULL;
+	}
+
+	return db->strings + off;
+}
+
+/*
+ * Get the tags for a host.
+ */
+char *
+hostdb_tags(HostDb *db, uint32_t idx)
+{
+	assert(db != NULL);
+	assert(idx < db->header->num_hosts);
+
+	uint32_t off = db->tags[idx];
+
+	if (off == HOSTDB_NO_TAGS || off >= db->header->strings_len) {
+		return NULL;
+	}
+
+	return db->strings + off;
+}
+
+/*
+ * Get the id for a host.
+ */
+uint32_t
+hostdb_id(HostDb *db, uint32_t idx)
+{
+	assert(db != NULL);
+	assert(idx < db->header->num_hosts);
+
+	return db->ids[idx];
+}
+
+/*
+ * Binary search the tag index for a tag.
+ */
+int
+hostdb_tag_hosts(HostDb *db, const char *tag, const uint32_t **hosts)
+{
+	assert(db != NULL);
+	assert(tag != NULL);
+	assert(hosts != NULL);
+
+	uint32_t lo = 0;
+	uint32_t hi = db->header->num_tags;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const HostDbTag *t = &db->tag_index[mid];
+		int cmp;
+
+		if (t->name >= db->header->strings_len) {
+			return -1;
+		}
+
+		cmp = strcmp(tag, db->strings + t->name);
+		if (cmp < 0) {
+			hi = mid;
+		} else if (cmp > 0) {
+			lo = mid + 1;
+		} else {
+			if (t->first > db->header->num_tag_hosts ||
+			    t->count > db->header->num_tag_hosts - t->first) {
+				return -1;
+			}
+			*hosts = db->tag_hosts + t->first;
+			return t->count;
+		}
+	}
+
+	*hosts = NULL;
+	return 0;
+}
+
+/*
+ * Unmap and free a HostDb.
+ */
+void
+hostdb_close(HostDb *db)
+{
+	if (db == NULL) {
+		return;
+	}
+
+	munmap(db->map, db->size);
+	free(db);
+}
+
+/*
+ * Create a HostDbWriter.
+ */
+HostDbWriter *
+hostdb_writer_create(void)
+{
+	HostDbWriter *w = calloc(1, sizeof (HostDbWriter));
+
+	return w;
+}
+
+/*
+ * Append a string (of the given length) to the writer strings section.
+ * Returns the offset of the string or -1 on error.
+ */
+static int64_t
+writer_add_string(HostDbWriter *w, const char *s, size_t len)
+{
+	assert(w != NULL);
+	assert(s != NULL);
+
+	size_t off = w->strings_len;
+
+	if (off + len + 1 > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	while (w->strings_len + len + 1 > w->strings_size) {
+		size_t size = w->strings_size == 0 ? 64 * 1024 :
+		    w->strings_size * 2;
+		char *strings = realloc(w->strings, size);
+
+		if (strings == NULL) {
+			return -1;
+		}
+		w->strings = strings;
+		w->strings_size = size;
+	}
+
+	memcpy(w->strings + off, s, len);
+	w->strings[off + len] = '\0';
+	w->strings_len += len + 1;
+
+	return off;
+}
+
+/*
+ * Add a host to a HostDbWriter.
+ */
+int
+hostdb_writer_add(HostDbWriter *w, const char *name, const char *tags,
+	uint32_t id)
+{
+	assert(w != NULL);
+	assert(name != NULL);
+
+	int64_t name_off;
+	int64_t tags_off = HOSTDB_NO_TAGS;
+
+	if (w->num_hosts == w->hosts_size) {
+		size_t size = w->hosts_size == 0 ? 1024 : w->hosts_size * 2;
+		uint32_t *names = realloc(w->names, size * 4);
+		uint32_t *tagsv;
+		uint32_t *ids;
+
+		if (names == NULL) {
+			return -1;
+		}
+		w->names = names;
+		if ((tagsv = realloc(w->tags, size * 4)) == NULL) {
+			return -1;
+		}
+		w->tags = tagsv;
+		if ((ids = realloc(w->ids, size * 4)) == NULL) {
+			return -1;
+		}
+		w->ids = ids;
+		w->hosts_size = size;
+	}
+
+	name_off = writer_add_string(w, name, strlen(name));
+	if (name_off == -1) {
+		return -1;
+	}
+	if (tags != NULL) {
+		tags_off = writer_add_string(w, tags, strlen(tags));
+		if (tags_off == -1) {
+			return -1;
+		}
+	}
+
+	w->names[w->num_hosts] = name_off;
+	w->tags[w->num_hosts] = tags_off;
+	w->ids[w->num_hosts] = id;
+	w->num_hosts++;
+
+	return 0;
+}
+
+/*
+ * qsort comparison function for tag pairs - sort by tag then host.
+ */
+static int
+tag_pair_compare(const void *a, const void *b)
+{
+	const struct tag_pair *p1 = a;
+	const struct tag_pair *p2 = b;
+	uint32_t len = p1->len < p2->len ? p1->len : p2->len;
+	int cmp;
+
+	cmp = memcmp(pair_strings + p1->off, pair_strings + p2->off, len);
+	if (cmp == 0) {
+		cmp = (p1->len > p2->len) - (p1->len < p2->len);
+	}
+	if (cmp == 0) {
+		cmp = (p1->host > p2->host) - (p1->host < p2->host);
+	}
+
+	return cmp;
+}
+
+/*
+ * Write `len` bytes of padding to align the file to 8 bytes.
+ */
+static int
+write_padding(FILE *f, size_t written)
+{
+	static const char zeros[8] = {0};
+	size_t pad = (8 - written % 8) % 8;
+
+	return fwrite(zeros, 1, pad, f) == pad ? (int)pad : -1;
+}
+
+/*
+ * Write a compiled HostDb.
+ */
+int
+hostdb_writer_write(HostDbWriter *w, const char *path)
+{
+	assert(w != NULL);
+	assert(path != NULL);
+
+	HostDbHeader h;
+	HostDbTag *tag_index = NULL;
+	struct tag_pair *pairs = NULL;
+	uint32_t *tag_hosts = NULL;
+	size_t num_pairs = 0;
+	size_t pairs_size = 0;
+	size_t num_tags = 0;
+	size_t path_len = strlen(path);
+	char *tmp_path = NULL;
+	FILE *f = NULL;
+	uint64_t off;
+	int saved_errno;
+
+	// collect a (tag, host) pair for every tag of every host
+	for (size_t i = 0; i < w->num_hosts; i++) {
+		uint32_t t = w->tags[i];
+
+		if (t == HOSTDB_NO_TAGS) {
+			continue;
+		}
+
+		while (w->strings[t] != '\0') {
+			uint32_t len = 0;
+
+			while (w->strings[t + len] != '\0' &&
+			    w->strings[t + len] != ' ') {
+				len++;
+			}
+
+			if (num_pairs == pairs_size) {
+				size_t size = pairs_size == 0 ? 1024 :
+				    pairs_size * 2;
+				struct tag_pair *p = realloc(pairs,
+				    size * sizeof (*pairs));
+
+				if (p == NULL) {
+					goto fail;
+				}
+				pairs = p;
+				pairs_size = size;
+			}
+			pairs[num_pairs].off = t;
+			pairs[num_pairs].len = len;
+			pairs[num_pairs].host = i;
+			num_pairs++;
+
+			t += len;
+			if (w->strings[t] == ' ') {
+				t++;
+			}
+		}
+	}
+
+	pair_strings = w->strings;
+	if (num_pairs > 0) {
+		qsort(pairs, num_pairs, sizeof (*pairs), tag_pair_compare);
+	}
+	pair_strings = NULL;
+
+	// build the tag index from the sorted pairs
+	tag_index = malloc((num_pairs + 1) * sizeof (HostDbTag));
+	tag_hosts = malloc((num_pairs + 1) * sizeof (uint32_t));
+	if (tag_index == NULL || tag_hosts == NULL) {
+		goto fail;
+	}
+	for (size_t i = 0; i < num_pairs; i++) {
+		struct tag_pair *p = &pairs[i];
+		struct tag_pair *prev = i > 0 ? &pairs[i - 1] : NULL;
+
+		if (prev == NULL || prev->len != p->len ||
+		    memcmp(w->strings + prev->off, w->strings + p->off,
+		    p->len) != 0) {
+			char tag[p->len + 1];
+			int64_t name;
+
+			// copy out the tag first as strings may be moved
+			memcpy(tag, w->strings + p->off, p->len);
+			tag[p->len] = '\0';
+			name = writer_add_string(w, tag, p->len);
+			if (name == -1) {
+				goto fail;
+			}
+
+			tag_index[num_tags].name = name;
+			tag_index[num_tags].first = i;
+			tag_index[num_tags].count = 0;
+			num_tags++;
+		}
+
+		tag_hosts[i] = p->host;
+		tag_index[num_tags - 1].count++;
+	}
+
+	// the strings section must not be empty
+	if (w->strings_len == 0 && writer_add_string(w, "", 0) == -1) {
+		goto fail;
+	}
+
+	// lay out the file
+	memset(&h, 0, sizeof (h));
+	memcpy(h.magic, HOSTDB_MAGIC, HOSTDB_MAGIC_LENGTH);
+	h.version = HOSTDB_VERSION;
+	h.byte_order = HOSTDB_BYTE_ORDER;
+	h.num_hosts = w->num_hosts;
+	h.num_tags = num_tags;
+	h.num_tag_hosts = num_pairs;
+	h.strings_len = w->strings_len;
+
+	off = sizeof (h);
+	h.strings_off = off;
+	off += w->strings_len;
+	off += (8 - off % 8) % 8;
+	h.names_off = off;
+	off += w->num_hosts * 4;
+	h.tags_off = off;
+	off += w->num_hosts * 4;
+	h.ids_off = off;
+	off += w->num_hosts * 4;
+	off += (8 - off % 8) % 8;
+	h.tag_index_off = off;
+	off += num_tags * sizeof (HostDbTag);
+	off += (8 - off % 8) % 8;
+	h.tag_hosts_off = off;
+
+	// write to a temporary file and rename it into place
+	tmp_path = malloc(path_len + 5);
+	if (tmp_path == NULL) {
+		goto fail;
+	}
+	snprintf(tmp_path, path_len + 5, "%s.tmp", path);
+
+	f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		goto fail;
+	}
+
+	if (fwrite(&h, sizeof (h), 1, f) != 1 ||
+	    fwrite(w->strings, 1, w->strings_len, f) != w->strings_len ||
+	    write_padding(f, sizeof (h) + w->strings_len) == -1 ||
+	    fwrite(w->names, 4, w->num_hosts, f) != w->num_hosts ||
+	    fwrite(w->tags, 4, w->num_hosts, f) != w->num_hosts ||
+	    fwrite(w->ids, 4, w->num_hosts, f) != w->num_hosts ||
+	    write_padding(f, h.ids_off + w->num_hosts * 4) == -1 ||
+	    fwrite(tag_index, sizeof (HostDbTag), num_tags, f) != num_tags ||
+	    write_padding(f, h.tag_index_off +
+	    num_tags * sizeof (HostDbTag)) == -1 ||
+	    fwrite(tag_hosts, 4, num_pairs, f) != num_pairs) {
+		goto fail;
+	}
+
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto fail;
+	}
+	f = NULL;
+
+	if (rename(tmp_path, path) == -1) {
+		goto fail;
+	}
+
+	free(tmp_path);
+	free(pairs);
+	free(tag_index);
+	free(tag_hosts);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (f != NULL) {
+		fclose(f);
+	}
+	if (tmp_path != NULL) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	free(pairs);
+	free(tag_index);
+	free(tag_hosts);
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * Free a HostDbWriter.
+ */
+void
+hostdb_writer_destroy(HostDbWriter *w)
+{
+	if (w == NULL) {
+		return;
+	}
+
+	free(w->strings);
+	free(w->names);
+	free(w->tags);
+	free(w->ids);
+	free(w);
+}
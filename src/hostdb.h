@@ -0,0 +1,196 @@
+/*
+ * HostDb - Compiled Hosts Database.
+ *
+ * A HostDb is a hosts file that has been compiled (with
+ * `sshp --compile-hosts`) into a compact binary file that can be `mmap`ed and
+ * used directly without any parsing.  The file is laid out as:
+ *
+ * ```
+ * +-------------------+
+ * | HostDbHeader      |  magic, version, counts and section offsets
+ * +-------------------+
+ * | strings           |  nul-terminated strings (hostnames, tags)
+ * +-------------------+
+ * | names[num_hosts]  |  uint32_t string offset of each hostname
+ * | tags[num_hosts]   |  uint32_t string offset of each host's tags
+ * | ids[num_hosts]    |  uint32_t line number of each host in the source file
+ * +-------------------+
+ * | tag_index[]       |  HostDbTag for each unique tag, sorted by name
+ * | tag_hosts[]       |  uint32_t host indices referenced by tag_index
+ * +-------------------+
+ * ```
+ *
+ * All integers are stored in native byte order - a HostDb is meant to be
+ * compiled on (or for) the machine that uses it.  A simple example:
+ *
+ * ```
+ * HostDbWriter *w = hostdb_writer_create();
+ * hostdb_writer_add(w, "web1.example.com", "web east", 1);
+ * hostdb_writer_add(w, "db1.example.com", "db east", 2);
+ * hostdb_writer_write(w, "hosts.sshpdb");
+ * hostdb_writer_destroy(w);
+ *
+ * HostDb *db = hostdb_open("hosts.sshpdb");
+ * const uint32_t *idx;
+ * int n = hostdb_tag_hosts(db, "east", &idx);
+ * for (int i = 0; i < n; i++) {
+ *	printf("%s\n", hostdb_name(db, idx[i]));
+ * }
+ * hostdb_close(db);
+ * ```
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// magic bytes at the start of every HostDb file
+#define HOSTDB_MAGIC		"SSHPDB\0\0"
+#define HOSTDB_MAGIC_LENGTH	8
+
+// value stored in HostDbHeader.tags for hosts without any tags
+#define HOSTDB_NO_TAGS		UINT32_MAX
+
+/*
+ * On-disk header.
+ */
+typedef struct hostdb_header {
+	char magic[HOSTDB_MAGIC_LENGTH];	// HOSTDB_MAGIC
+	uint32_t version;		// file format version
+	uint32_t byte_order;		// 0x01020304 in native byte order
+	uint32_t num_hosts;		// number of hosts
+	uint32_t num_tags;		// number of unique tags
+	uint32_t num_tag_hosts;		// number of entries in tag_hosts
+	uint32_t strings_len;		// length of the strings section
+	uint64_t strings_off;		// file offset of the strings section
+	uint64_t names_off;		// file offset of the names column
+	uint64_t tags_off;		// file offset of the tags column
+	uint64_t ids_off;		// file offset of the ids column
+	uint64_t tag_index_off;		// file offset of the tag index
+	uint64_t tag_hosts_off;		// file offset of the tag host indices
+} HostDbHeader;
+
+/*
+ * On-disk tag index entry.
+ */
+typedef struct hostdb_tag {
+	uint32_t name;			// string offset of the tag name
+	uint32_t first;			// first entry in tag_hosts
+	uint32_t count;			// number of entries in tag_hosts
+} HostDbTag;
+
+/*
+ * HostDb Opaque object.
+ *
+ * This type should not be created manually, but instead created with
+ * `hostdb_open()`.
+ */
+typedef struct hostdb {
+	void *map;			// mmap'd file
+	size_t size;			// size of the mmap'd file
+	const HostDbHeader *header;	// file header
+	char *strings;			// strings section (writable, private)
+	const uint32_t *names;		// names column
+	const uint32_t *tags;		// tags column
+	const uint32_t *ids;		// ids column
+	const HostDbTag *tag_index;	// tag index
+	const uint32_t *tag_hosts;	// tag host indices
+} HostDb;
+
+/*
+ * HostDbWriter Opaque object used to compile a HostDb.
+ */
+typedef struct hostdb_writer {
+	char *strings;			// strings section
+	size_t strings_len;		// bytes used in strings
+	size_t strings_size;		// bytes allocated for strings
+	uint32_t *names;		// names column
+	uint32_t *tags;			// tags column
+	uint32_t *ids;			// ids column
+	size_t num_hosts;		// number of hosts added
+	size_t hosts_size;		// number of hosts allocated
+} HostDbWriter;
+
+/*
+ * Check if the given buffer (of at least HOSTDB_MAGIC_LENGTH bytes) starts
+ * with the HostDb magic bytes.
+ */
+bool hostdb_check_magic(const char *buf);
+
+/*
+ * Open and `mmap` the HostDb at the given path.  The map is private and
+ * writable, so strings returned from the HostDb may be modified in place
+ * without modifying the file.
+ *
+ * Returns NULL and sets errno on error (EINVAL if the file is not a valid
+ * HostDb).
+ */
+HostDb *hostdb_open(const char *path);
+
+/*
+ * Return the number of hosts in the HostDb.
+ */
+uint32_t hostdb_num_hosts(HostDb *db);
+
+/*
+ * Return the hostname for the host at the given index, or NULL if the HostDb
+ * is corrupt.
+ */
+char *hostdb_name(HostDb *db, uint32_t idx);
+
+/*
+ * Return the space-separated tags for the host at the given index, or NULL if
+ * the host has no tags.
+ */
+char *hostdb_tags(HostDb *db, uint32_t idx);
+
+/*
+ * Return the id (line number in the source hosts file) of the host at the
+ * given index.
+ */
+uint32_t hostdb_id(HostDb *db, uint32_t idx);
+
+/*
+ * Look up the given tag in the tag index.  `hosts` will be set to the
+ * (ascending) indices of all hosts with the tag.
+ *
+ * Returns the number of hosts found with the tag (0 if the tag is unknown), or
+ * -1 if the HostDb is corrupt.
+ */
+int hostdb_tag_hosts(HostDb *db, const char *tag, const uint32_t **hosts);
+
+/*
+ * Unmap and free the HostDb.
+ */
+void hostdb_close(HostDb *db);
+
+/*
+ * Create a HostDbWriter.  Returns NULL and sets errno on error.
+ */
+HostDbWriter *hostdb_writer_create(void);
+
+/*
+ * Add a host to the HostDbWriter given its name, space-separated tags (can be
+ * NULL) and id.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int hostdb_writer_add(HostDbWriter *w, const char *name, const char *tags,
+	uint32_t id);
+
+/*
+ * Write the compiled HostDb to the given path.  The file is written to a
+ * temporary file first and renamed into place.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int hostdb_writer_write(HostDbWriter *w, const char *path);
+
+/*
+ * Free a HostDbWriter.
+ */
+void hostdb_writer_destroy(HostDbWriter *w);
@@ -0,0 +1,214 @@
+/*
+ * Snapshot - Per-host Result Digests.
+ *
+ * See the accompanying header file for more information.
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+// current file format version
+#define SNAPSHOT_VERSION	1
+
+// byte order marker
+#define SNAPSHOT_BYTE_ORDER	0x01020304
+
+/*
+ * Find the slot for the given host hash: either the slot already holding it or
+ * the first empty slot.
+ */
+static SnapshotRecord *
+snapshot_find(Snapshot *snap, uint64_t host)
+{
+	size_t mask = snap->num_slots - 1;
+
+	for (size_t i = host & mask; ; i = (i + 1) & mask) {
+		if (snap->slots[i].host == host || snap->slots[i].host == 0) {
+			return &snap->slots[i];
+		}
+	}
+}
+
+/*
+ * Load a snapshot file into a hash table.
+ */
+Snapshot *
+snapshot_load(const char *path)
+{
+	assert(path != NULL);
+
+	SnapshotHeader h;
+	SnapshotRecord rec;
+	Snapshot *snap = NULL;
+	FILE *f;
+	int saved_errno;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return NULL;
+	}
+
+	if (fread(&h, sizeof (h), 1, f) != 1 ||
+	    memcmp(h.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH) != 0 ||
+	    h.version != SNAPSHOT_VERSION ||
+	    h.byte_order != SNAPSHOT_BYTE_ORDER ||
+	    h.num_records > SIZE_MAX / 4 / sizeof (rec)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	snap = malloc(sizeof (Snapshot));
+	if (snap == NULL) {
+		goto fail;
+	}
+
+	// keep the table at most half full
+	snap->num_records = 0;
+	snap->num_slots = 16;
+	while (snap->num_slots < h.num_records * 2) {
+		snap->num_slots *= 2;
+	}
+	snap->slots = calloc(snap->num_slots, sizeof (SnapshotRecord));
+	if (snap->slots == NULL) {
+		goto fail;
+	}
+
+	for (uint64_t i = 0; i < h.num_records; i++) {
+		SnapshotRecord *slot;
+
+		if (fread(&rec, sizeof (rec), 1, f) != 1 || rec.host == 0) {
+			errno = EINVAL;
+			goto fail;
+		}
+
+		slot = snapshot_find(snap, rec.host);
+		if (slot->host == 0) {
+			snap->num_records++;
+		}
+		*slot = rec;
+	}
+
+	// trailing data means the file is corrupt
+	if (fgetc(f) != EOF) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	fclose(f);
+	return snap;
+
+fail:
+	saved_errno = errno;
+	snapshot_destroy(snap);
+	fclose(f);
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Look up a host in a Snapshot.
+ */
+bool
+snapshot_lookup(Snapshot *snap, uint64_t host, uint64_t *digest)
+{
+	assert(snap != NULL);
+	assert(host != 0);
+	assert(digest != NULL);
+
+	SnapshotRecord *slot = snapshot_find(snap, host);
+
+	if (slot->host == 0) {
+		return false;
+	}
+
+	*digest = slot->digest;
+	return true;
+}
+
+/*
+ * Free a Snapshot.
+ */
+void
+snapshot_destroy(Snapshot *snap)
+{
+	if (snap == NULL) {
+		return;
+	}
+
+	free(snap->slots);
+	free(snap);
+}
+
+/*
+ * Write a snapshot file.
+ */
+int
+snapshot_write(const char *path, const SnapshotRecord *records,
+	size_t num_records)
+{
+	assert(path != NULL);
+	assert(records != NULL || num_records == 0);
+
+	SnapshotHeader h;
+	size_t path_len = strlen(path);
+	char *tmp_path;
+	FILE *f;
+	int saved_errno;
+
+	memset(&h, 0, sizeof (h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+	h.version = SNAPSHOT_VERSION;
+	h.byte_order = SNAPSHOT_BYTE_ORDER;
+	h.num_records = num_records;
+
+	// write to a temporary file and rename it into place
+	tmp_path = malloc(path_len + 5);
+	if (tmp_path == NULL) {
+		return -1;
+	}
+	snprintf(tmp_path, path_len + 5, "%s.tmp", path);
+
+	f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		goto fail;
+	}
+
+	if (fwrite(&h, sizeof (h), 1, f) != 1 ||
+	    fwrite(records, sizeof (SnapshotRecord), num_records, f) !=
+	    num_records) {
+		goto fail;
+	}
+
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto fail;
+	}
+	f = NULL;
+
+	if (rename(tmp_path, path) == -1) {
+		goto fail;
+	}
+
+	free(tmp_path);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (f != NULL) {
+		fclose(f);
+	}
+	unlink(tmp_path);
+	free(tmp_path);
+	errno = saved_errno;
+	return -1;
+}
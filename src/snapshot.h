@@ -0,0 +1,102 @@
+/*
+ * Snapshot - Per-host Result Digests.
+ *
+ * A Snapshot records a digest of the result (output and exit code) of every
+ * host from a single run, so a later run can cheaply tell which hosts have a
+ * different result.  Hosts are identified by a hash of their name, so a
+ * snapshot is a flat array of fixed-size records:
+ *
+ * ```
+ * +--------------------------+
+ * | SnapshotHeader           |  magic, version, number of records
+ * +--------------------------+
+ * | SnapshotRecord[]         |  (host hash, result digest) pairs
+ * +--------------------------+
+ * ```
+ *
+ * When loaded, the records are put into an open-addressing hash table keyed by
+ * the host hash, so looking up every host of a run takes linear time.
+ *
+ * ```
+ * SnapshotRecord recs[] = {{hash_bytes("web1", 4), digest}};
+ * snapshot_write("today.snap", recs, 1);
+ *
+ * Snapshot *snap = snapshot_load("today.snap");
+ * uint64_t old;
+ * if (snapshot_lookup(snap, hash_bytes("web1", 4), &old) && old == digest) {
+ *	printf("web1 unchanged\n");
+ * }
+ * snapshot_destroy(snap);
+ * ```
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// magic bytes at the start of every snapshot file
+#define SNAPSHOT_MAGIC		"SSHPSNAP"
+#define SNAPSHOT_MAGIC_LENGTH	8
+
+/*
+ * On-disk header.
+ */
+typedef struct snapshot_header {
+	char magic[SNAPSHOT_MAGIC_LENGTH];	// SNAPSHOT_MAGIC
+	uint32_t version;		// file format version
+	uint32_t byte_order;		// 0x01020304 in native byte order
+	uint64_t num_records;		// number of records
+} SnapshotHeader;
+
+/*
+ * On-disk record (also used as a hash table slot when loaded).
+ */
+typedef struct snapshot_record {
+	uint64_t host;			// hash of the hostname, 0 = empty slot
+	uint64_t digest;		// digest of the host's result
+} SnapshotRecord;
+
+/*
+ * Snapshot Opaque object.
+ *
+ * This type should not be created manually, but instead created with
+ * `snapshot_load()`.
+ */
+typedef struct snapshot {
+	SnapshotRecord *slots;		// hash table, `num_slots` in size
+	size_t num_slots;		// number of slots (always a power of 2)
+	size_t num_records;		// number of hosts in the table
+} Snapshot;
+
+/*
+ * Load the snapshot at the given path.
+ *
+ * Returns NULL and sets errno on error (EINVAL if the file is not a valid
+ * snapshot).
+ */
+Snapshot *snapshot_load(const char *path);
+
+/*
+ * Look up the digest for the given host hash.  Returns false if the host is
+ * not in the snapshot.
+ */
+bool snapshot_lookup(Snapshot *snap, uint64_t host, uint64_t *digest);
+
+/*
+ * Free a Snapshot.
+ */
+void snapshot_destroy(Snapshot *snap);
+
+/*
+ * Write a snapshot of the given records to the given path.  The file is
+ * written to a temporary file first and renamed into place.  Records with a
+ * host hash of 0 are not allowed.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int snapshot_write(const char *path, const SnapshotRecord *records,
+	size_t num_records);
@@ -20,7 +20,8 @@
  * 1. Parse arguments (in function `parse_arguments`).
  * 2. Read hosts file input (in function `parse_hosts`).
  * 3. Start the "Main loop" (in function `main_loop`).
- *   a. Loop the hosts and create subprocesses as required.
+ *   a. Loop the hosts and create subprocesses as required (optionally probing
+ *      the hosts for reachability first, see "Probing" below).
  *     1. Create pipes for child stdio.
  *     2. Add the pipes to FdWatcher to watch for events.
  *   b. Process fd events for any subprocess stdio pipes.
@@ -83,6 +84,24 @@
  * created and added to the end of the linked-list.  This way, the order of the
  * list will match the order of the input file.
  *
+ * A line in the hosts file may optionally contain whitespace-separated tags
+ * after the hostname.  Hosts can be filtered by tag (`--tag`) and sampled
+ * (`--sample` and `--sample-per-tag`) as they are read in.  Sampling uses
+ * reservoir sampling so only the sampled Host objects are ever kept in memory;
+ * once the input is exhausted the reservoir is sorted back into input order
+ * (by `host->id`) to form the linked-list.
+ *
+ * With `--dedupe`, duplicate hostnames are dropped as they are read in (before
+ * sampling), keeping the first one seen.  This is done with a HostSet: an
+ * open-addressing hash set whose keys (normalized hostnames) are stored back
+ * to back in a single arena.
+ *
+ * Filtering, deduplication and sampling are all handled by a HostReader, which
+ * is fed Host objects either by `parse_hosts` (text hosts file) or by
+ * `load_hostdb` (compiled hosts file, see hostdb.h).  Hosts loaded from a
+ * HostDb borrow their name and tags from the mmap'd file instead of copying
+ * them, and `--tag` filters are resolved through the HostDb tag index.
+ *
  * - ChildProcess
  *
  * The ChildProcess type represents a single child process that should be
@@ -92,8 +111,9 @@
  * the following stages:
  *
  * 1. CP_STATE_READY ("ready").
- * 2. CP_STATE_RUNNING ("running").
- * 3. CP_STATE_DONE ("done").
+ * 2. CP_STATE_PROBING ("probing", only with `--probe`).
+ * 3. CP_STATE_RUNNING ("running").
+ * 4. CP_STATE_DONE ("done").
  *
  * - FdEvent
  *
@@ -150,6 +170,112 @@
  *
  * ----------------------------------------------------------------------------
  *
+ * Probing
+ *
+ * With `--probe`, sshp will issue a non-blocking `connect` to the ssh port of
+ * upcoming hosts before spawning ssh for them.  The probe sockets are added to
+ * FdWatcher (watching for writability) alongside the stdio pipes, so probing
+ * happens in the same loop as everything else.  Hosts that accept the
+ * connection are put in a queue to be spawned, and hosts that refuse it (or
+ * don't answer within `--probe-timeout`) are marked as done immediately with
+ * an exit code of 255 (the same code ssh uses for connection errors) without
+ * ever taking up a job slot.
+ *
+ * At most `max_jobs` hosts will be probing or waiting in the queue at any
+ * given time.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Jump Hosts
+ *
+ * With `--jump`, every host is run through one of a pool of jump hosts (with
+ * `ssh -J`), picked by `jump_pick` right before the host is spawned.  Each
+ * JumpHost counts the hosts running through it (capped by `--jump-max`, which
+ * holds back spawning while every jump host is full) and keeps a moving
+ * average of the time its hosts took to print their first output.  Reaped
+ * hosts feed back into their jump host: connection errors in a row take it
+ * out of rotation for a while, so the hosts that follow go to the others.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Result Cache
+ *
+ * With `--cache`, the full command for each host is looked up in a ResultCache
+ * (see cache.h) right before it would be probed or spawned.  A fresh result is
+ * replayed through the normal output path for the current mode (using an
+ * FdEvent without an fd) and the host is marked done without being contacted.
+ * Otherwise the output of the child is captured as it is read, and the result
+ * is stored in the cache once the child has been reaped.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Watch Mode
+ *
+ * With `--watch`, hosts are run again after they finish instead of being left
+ * in the "done" state.  Each finished Host is put at the back of the watch
+ * queue with the time it should next run (`cp->next_run`); since every host
+ * waits the same interval the queue is always in order, so only its head
+ * needs to be checked by `next_host_to_spawn` and `loop_timeout`.
+ *
+ * Output is captured (like with `--cache`) instead of printed as it is read.
+ * Once the host finishes, the digest of its output and exit code is compared
+ * to the last one printed, and only if it has changed is the output replayed
+ * through the normal line or group mode output path.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Sessions
+ *
+ * With `--shell`, a single long-lived child process (a "session", running a
+ * remote shell) is spawned for every host up front, with a third pipe for its
+ * stdin.  Commands are then read from stdin by `shell_loop` and sent to every
+ * session as numbered "steps": each command is wrapped so the remote shell
+ * prints a step marker (a random token, the step number and the exit code) on
+ * stdout and stderr once it has finished.  Writes to the stdin pipes are
+ * non-blocking and watched with FdWatcher when the pipes fill up.
+ *
+ * `read_active_fd` scans session output for the markers with `session_scan`,
+ * passing everything between them on to the current mode as usual, and
+ * finishing the stream (`fd_done`) at each marker.  A step is done on a host
+ * once a marker has been seen on each of its streams, and the next command is
+ * read once every host is done with the step.  Closing the stdin pipes ends
+ * the sessions, which are then reaped like any other child process.
+ *
+ * With `--script`, every step of the script is wrapped and sent to a session
+ * at once (by `script_loop`, starting at most `max_jobs` sessions at a time),
+ * followed by closing its stdin, so steps run back to back without waiting on
+ * sshp.  A failing step makes the remote shell exit, skipping the rest.  Since
+ * stdout and stderr may then be at different steps, each stream keeps track of
+ * the last marker it has read.  In join mode the output of each step is kept
+ * separately (`cp->step_outputs`) and joined per step at the end.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Collapsing
+ *
+ * With `--collapse`, complete lines in line mode are not printed right away but
+ * added to a hash table (`CollapseTable`) keyed on the line and the stream it
+ * was read from, with the line bytes kept in a single arena.  Each entry keeps
+ * the list of hosts that printed it, with a set of (line, host) pairs so a host
+ * repeating a line is only counted once.  When the window ends (checked in
+ * `main_loop`, and always once it is done) every line is printed once, in the
+ * order it was first seen, with a count of hosts instead of a hostname, and
+ * the table is emptied.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Ordered Output
+ *
+ * With `--ordered`, group mode output is printed in the order of the hosts
+ * list.  `ordered_head` is the first host that isn't done yet: its output is
+ * printed as it is read, while the output of every other host is held back
+ * (`ordered_hold`) as chunks tagged with the pipe they were read from - in
+ * memory up to a total of ORDERED_MAX_HELD bytes, then in a temporary file per
+ * host.  Once per loop `ordered_advance` prints the held output (and the exit
+ * message) of the head while it is done, moving on to the next host.
+ *
+ * ----------------------------------------------------------------------------
+ *
  * Signals
  *
  * sshp captures the 3 following signals:
@@ -163,10 +289,20 @@
  * the PIDs and hostnames for any currently running children.
  *
  * SIGTERM and SIGINT both result in the same actions being taken: all running
- * child processes are killed via SIGTERM and the program exits with code 4.
- * There may be a better way to take care of this situation (killing all
- * outstanding children in the event of an early process death) - if so, this
- * code should be updated.
+ * child processes are killed and the program exits with code 4.
+ *
+ * Children are killed by sending them SIGTERM, then SIGKILL to the ones still
+ * around KILL_GRACE later, and are all reaped before sshp exits.  With
+ * `--timeout` the same escalation is driven by the loop: running hosts are
+ * kept in a queue in the order they started (which is also the order they time
+ * out in) and the loop wakes up for the next one due.
+ *
+ * Children normally stay in the process group of sshp, so ssh can prompt on
+ * the terminal (a background group would be stopped by SIGTTIN).  With
+ * `--timeout` every child leads its own process group instead, and the whole
+ * group is signaled so anything it started (like a ProxyCommand) doesn't
+ * linger holding its pipes and connections open - ssh is then run with
+ * `BatchMode=yes` so it never waits on a prompt it can't get.
  *
  * ----------------------------------------------------------------------------
  *
@@ -192,23 +328,47 @@
  * License: MIT
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	// sched_setaffinity
+#endif
+
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <netdb.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "agg.h"
+#include "cache.h"
 #include "fdwatcher.h"
+#include "hash.h"
+#include "hostdb.h"
+#include "snapshot.h"
+#include "topk.h"
 
 // app details
 #define PROG_NAME	"sshp"
@@ -224,10 +384,76 @@
 // maximum number of arguments for a child process
 #define MAX_ARGS	256
 
+// maximum length of a single line in the hosts file (hostname + tags)
+#define MAX_HOSTS_LINE_LENGTH	(4 * 1024) // 4k
+
+// maximum number of `--tag` filters
+#define MAX_TAG_FILTERS	32
+
+// maximum number of `--agg` metrics
+#define MAX_AGGS	8
+
+// number of hosts using the most cpu shown by `--stats`
+#define STATS_TOP	3
+
+// io priority classes (ioprio_set(2) has no libc wrapper or header)
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+
+// maximum number of `--jump` hosts
+#define MAX_JUMPS	16
+
+// connection errors in a row that take a `--jump` host out of rotation, and
+// for how long
+#define JUMP_MAX_FAILURES	3
+#define JUMP_COOLDOWN		(30 * 1000) // 30s
+
+// weight of the latest run in the latency of a `--jump` host
+#define JUMP_LATENCY_WEIGHT	0.25
+
 // max characters to process in line and join mode respectively
 #define DEFAULT_MAX_LINE_LENGTH		(1 * 1024) // 1k
 #define DEFAULT_MAX_OUTPUT_LENGTH	(8 * 1024) // 8k
 
+// reachability probe options
+#define DEFAULT_PROBE_TIMEOUT	(3 * 1000) // 3s
+#define DEFAULT_SSH_PORT	"22"
+
+// exit code used by ssh (and sshp) for connection errors
+#define SSH_CONNECT_ERROR	255
+
+// max bytes of output (per stream) to capture (`--cache` and `--watch`)
+#define CAPTURE_MAX_OUTPUT	(1 * 1024 * 1024) // 1m
+
+// max length of a step marker line read back from a session (`--shell`)
+#define SESSION_MARKER_MAX	64
+
+// counters kept for every line asked for with `--top`
+#define TOP_COUNTERS	8
+
+// time given to children to exit after SIGTERM before SIGKILL, and how often
+// they are checked for while exiting
+#define KILL_GRACE	1000 // ms
+#define KILL_POLL	10 // ms
+
+// max bytes of output held in memory (for all hosts) by `--ordered`
+#define ORDERED_MAX_HELD	(64 * 1024 * 1024) // 64m
+
+// max size of a formatted line timestamp, with colors (`--timestamps`)
+#define TIMESTAMP_MAX	64
+
+// redraw interval, running hosts shown and width of a line (`--dashboard`)
+#define DASHBOARD_INTERVAL	100 // ms
+#define DASHBOARD_OLDEST	5
+#define DASHBOARD_LINES		(3 + DASHBOARD_OLDEST)
+#define DASHBOARD_LINE_MAX	512
+
+// size of the pooled output chunks and max chunks per write (`--block`)
+#define BLOCK_CHUNK_SIZE	(16 * 1024) // 16k
+#define BLOCK_MAX_IOV		64
+
 // pipe ends
 #define PIPE_READ_END	0
 #define PIPE_WRITE_END	1
@@ -260,13 +486,24 @@ enum ProgMode {
 	MODE_JOIN		// join mode, `-j` or `--join`
 };
 
+/*
+ * Line timestamps (`--timestamps`).
+ */
+enum TimestampMode {
+	TIMESTAMP_NONE = 0,	// no timestamps, default
+	TIMESTAMP_WALL,		// local time of day, `wall`
+	TIMESTAMP_RELATIVE	// time since the start of the run, `relative`
+};
+
 /*
  * Pipe types.
  */
 enum PipeType {
 	PIPE_STDOUT = 1,	// stdout pipe
 	PIPE_STDERR,		// stderr pipe
-	PIPE_STDIO		// both stdout and stderr (used in join mode)
+	PIPE_STDIO,		// both stdout and stderr (used in join mode)
+	PIPE_PROBE,		// tcp probe socket (used with `--probe`)
+	PIPE_STDIN		// session input pipe (used with `--shell`)
 };
 
 /*
@@ -274,10 +511,50 @@ enum PipeType {
  */
 enum CpState {
 	CP_STATE_READY = 0,
+	CP_STATE_PROBING,
 	CP_STATE_RUNNING,
 	CP_STATE_DONE
 };
 
+/*
+ * A run of bytes and its length.  Output is kept and compared as spans rather
+ * than C strings so it may contain nul bytes.
+ */
+typedef struct span {
+	char *data;		// bytes, NULL = none
+	size_t len;		// number of bytes in data
+} Span;
+
+/*
+ * A growable buffer of captured child output (used by `--cache` and
+ * `--watch`).
+ */
+typedef struct capture {
+	char *data;		// captured bytes
+	size_t len;		// bytes used in data
+	size_t size;		// bytes allocated for data
+	bool overflow;		// output was too large to capture
+} Capture;
+
+/*
+ * A chunk of output kept until its host is done (`--block`).  Chunks are
+ * taken from and returned to a pool, so they are only allocated for the most
+ * output kept at once.
+ */
+typedef struct block_chunk {
+	struct block_chunk *next;	// next chunk (of the host or the pool)
+	size_t len;			// bytes used in data
+	char data[BLOCK_CHUNK_SIZE];	// output (with color codes)
+} BlockChunk;
+
+/*
+ * Header of a chunk of output held back by `--ordered`, followed by its data.
+ */
+typedef struct held_chunk {
+	enum PipeType type;	// pipe the data was read from
+	size_t len;		// bytes of data
+} HeldChunk;
+
 /*
  * A struct that represents a single child process.
  *
@@ -290,12 +567,76 @@ typedef struct child_process {
 	int stdout_fd;		// stdout fd, -1 = hasn't started, -2 = closed
 	int stderr_fd;		// stderr fd, -1 = hasn't started, -2 = closed
 	int stdio_fd;		// stdio fd,  -1 = hasn't started, -2 = closed
-	char *output;		// output buffer (used by join mode)
+	Span output;		// output (used by join mode)
 	int output_idx;		// output index (used by join mode)
 	int exit_code;		// exit code, -1 = hasn't exited
+	bool signaled;		// killed by a signal (exit code 128 + signal)
 	long started_time;	// monotonic time (in ms) when child forked
 	long finished_time;	// monotonic time (in ms) when child reaped
 	enum CpState state;	// process state, defaults to CP_STATE_READY
+
+	// reachability probe (used by `--probe`)
+	int probe_fd;		// probe socket fd, -1 = not probing
+	int probe_slot;		// index into probe_slots, -1 = not probing
+	long probe_deadline;	// monotonic time (in ms) when probe expires
+	struct addrinfo *probe_addrs;	// resolved addresses to probe
+	struct addrinfo *probe_addr;	// current address being probed
+
+	// result cache (used by `--cache`)
+	char *cache_key;	// cache key, NULL = not looked up
+	size_t cache_key_len;	// length of cache_key
+	Capture cache_out;	// captured stdout (stdio in join mode)
+	Capture cache_err;	// captured stderr
+	bool cached;		// result was replayed from the cache
+
+	// repeated runs (used by `--watch`)
+	uint64_t watch_digest;	// digest of the last printed result
+	bool watched;		// a result has been printed before
+	long next_run;		// monotonic time (in ms) to run again
+
+	// result digest (used by `--snapshot` and `--changed-since`)
+	uint64_t name_hash;	// hash of the full hostname
+	uint64_t digest;	// running digest of the output
+	bool unchanged;		// result matches the `--changed-since` snapshot
+
+	// long-lived session (used by `--shell`)
+	int stdin_fd;		// stdin fd, -1 = hasn't started, -2 = closed
+	struct fd_event *stdin_fdev;	// stdin FdEvent
+	bool input_watched;	// waiting for stdin to become writable
+	const char *input;	// input of the current step (not owned)
+	size_t input_len;	// length of input
+	size_t input_off;	// bytes of input written to stdin
+	int step;		// current step number, 0 = none yet
+	int last_step;		// last step number sent in input
+	int stdout_step;	// last step marker read on stdout (or stdio)
+	int stderr_step;	// last step marker read on stderr
+	bool busy;		// the current step is running
+	int failed_steps;	// number of steps that exited non-zero
+	Span *step_outputs;	// output of each step (`--script` join mode)
+
+	// output held back until earlier hosts are done (used by `--ordered`)
+	Capture held;		// chunks held in memory
+	FILE *spill;		// chunks held on disk, NULL = none
+	pid_t reaped_pid;	// pid reaped (-1 = cached) for the exit message
+
+	// output printed all at once when done (used by `--block`)
+	BlockChunk *block_head;	// first chunk of output, NULL = none
+	BlockChunk *block_tail;	// last chunk of output
+	const char *block_color;	// color of the last output kept
+
+	// live status (used by `--dashboard`)
+	int dashboard_idx;	// index in the running heap, -1 = not in it
+
+	// resources used by the last run (used by `--stats`)
+	struct rusage usage;
+
+	// killing (used by `--timeout`)
+	bool timed_out;		// killed for running longer than `--timeout`
+	long kill_deadline;	// monotonic time (in ms) to SIGKILL, -1 = none
+
+	// jump host pool (used by `--jump`)
+	struct jump_host *jump;	// jump host of the run, NULL = none
+	long first_output_time;	// monotonic time (in ms) of the first output
 } ChildProcess;
 
 /*
@@ -303,6 +644,10 @@ typedef struct child_process {
  */
 typedef struct host {
 	char *name;		// host name
+	char *tags;		// space-separated tags, NULL = no tags
+	int id;			// position of the host in the hosts file
+	bool borrowed;		// name and tags are owned by the HostDb
+	char *trimmed;		// where `-t` cut the name, NULL = not cut
 	ChildProcess *cp;	// child process
 	struct host *next;	// next Host in the list
 } Host;
@@ -313,14 +658,248 @@ typedef struct host {
 typedef struct fd_event {
 	Host *host;		// related Host struct
 	int fd;			// fd number
+	int *cp_fd;		// fd field of the ChildProcess (reset on close)
+	const char *color;	// color of the output
 	char *buffer;		// buffer used by line and join mode
 	int offset;		// buffer offset used as noted above
 	enum PipeType type;	// type of fd this event represents
+	char *marker;		// partial step marker (used by `--shell`)
+	int marker_len;		// bytes in marker
+	bool streaming;		// a line is partly printed (`--stream-lines`)
+	bool paused;		// waiting for another line to end (same)
+	char *held;		// bytes read while pausing, NULL = none
+	int held_len;		// bytes in held
+	struct fd_event *paused_next;	// next paused FdEvent, NULL = none
 } FdEvent;
 
+/*
+ * The functions handling child process output.  They are picked once at
+ * startup (see `output_handlers_init()`) from the mode and the options that
+ * change how output is printed, so reading output doesn't check any of them.
+ */
+typedef struct output_handlers {
+	void (*read)(FdEvent *fdev, char *buf, int bytes);	// bytes read
+	void (*eof)(FdEvent *fdev);	// pipe closed
+	void (*process)(FdEvent *fdev, char *buf, int bytes);	// mode data
+	void (*done)(FdEvent *fdev);	// end of the output in the mode
+	void (*line)(FdEvent *fdev);	// complete line (line mode)
+	void (*write_line)(FdEvent *fdev);	// print a line (line mode)
+	void (*write_line_body)(FdEvent *fdev);	// ...after its timestamp
+	size_t buffer_size;	// bytes buffered per pipe, 0 = none
+} OutputHandlers;
+
+/*
+ * A reservoir of sampled hosts for a single stratum (used by `--sample` and
+ * `--sample-per-tag`).
+ */
+typedef struct sample {
+	char *tag;		// stratum (first tag of the host), NULL = none
+	Host **hosts;		// sampled hosts (up to the sample size)
+	int num_hosts;		// number of hosts in the reservoir
+	long seen;		// number of hosts seen in this stratum
+	struct sample *next;	// next Sample in the list
+} Sample;
+
+/*
+ * A slot in a HostSet table.
+ */
+typedef struct host_set_slot {
+	uint64_t hash;		// hash of the name
+	size_t offset;		// arena offset of the name + 1, 0 = empty
+} HostSetSlot;
+
+/*
+ * An open-addressing (linear probing) hash set of normalized hostnames (used
+ * by `--dedupe`).
+ */
+typedef struct host_set {
+	char *arena;		// nul-terminated names stored back to back
+	size_t arena_len;	// bytes used in the arena
+	size_t arena_size;	// bytes allocated for the arena
+	HostSetSlot *slots;	// hash table, `num_slots` in size
+	size_t num_slots;	// number of slots (always a power of 2)
+	size_t num_names;	// number of names in the set
+} HostSet;
+
+/*
+ * State used while reading in hosts (from a hosts file or a HostDb).
+ */
+typedef struct host_reader {
+	Host *tail;		// last Host added to the list
+	HostSet *seen;		// hostnames seen so far (used by `--dedupe`)
+	int num_hosts;		// number of hosts added to the list
+	int num_dupes;		// number of duplicate hosts skipped
+} HostReader;
+
+/*
+ * A line held back by `--collapse`, along with the hosts that printed it.
+ */
+typedef struct collapsed_line {
+	uint64_t hash;		// hash of the line
+	size_t offset;		// arena offset of the line
+	size_t len;		// length of the line (with the newline)
+	enum PipeType type;	// stream the line was printed on
+	Host **hosts;		// hosts that printed the line
+	int num_hosts;		// number of hosts in hosts
+	int hosts_size;		// number of hosts allocated
+} CollapsedLine;
+
+/*
+ * Lines printed within the current `--collapse` window (in the order they were
+ * first seen), indexed by an open-addressing (linear probing) hash table.
+ */
+typedef struct collapse_table {
+	char *arena;		// nul-terminated lines stored back to back
+	size_t arena_len;	// bytes used in the arena
+	size_t arena_size;	// bytes allocated for the arena
+	CollapsedLine *lines;	// lines in the order they were first seen
+	size_t num_lines;	// number of lines in the window
+	size_t lines_size;	// number of lines allocated
+	size_t *slots;		// index into lines + 1, 0 = empty
+	size_t num_slots;	// number of slots (always a power of 2)
+	struct collapse_member {
+		Host *host;		// the host, NULL = empty
+		size_t line;		// index into lines
+	} *members;		// hosts of each line (open-addressing set)
+	size_t num_members;	// number of members in the set
+	size_t members_size;	// number of members allocated (power of 2)
+	long deadline;		// when the window ends (ms), -1 = none
+} CollapseTable;
+
+/*
+ * A queue of running hosts in the order they started (used by `--timeout`).
+ * As every host gets the same timeout (and grace period once killed) the
+ * queue is also in the order they are due, so only its head is checked.
+ * Hosts that finish are left in the queue and skipped once they reach the
+ * head, which is why each entry remembers the run it was queued for.
+ */
+typedef struct run_queue {
+	struct run_queue_entry {
+		Host *host;		// queued Host
+		long started_time;	// start of the run it was queued for
+	} *entries;
+	size_t size;		// number of entries allocated
+	size_t head;		// index of the first entry
+	size_t len;		// number of entries queued
+} RunQueue;
+
+/*
+ * A jump host (bastion) in the `--jump` pool.  Hosts are assigned to the least
+ * loaded one when they are spawned (see `jump_pick`), and the result of each
+ * run feeds back into its latency and failure count.
+ */
+typedef struct jump_host {
+	const char *spec;	// argument to `ssh -J` (may be a chain)
+	int outstanding;	// hosts running through it
+	int runs;		// hosts run through it
+	int failures;		// connection errors in a row
+	long down_until;	// monotonic time (in ms) it's back in rotation
+	double latency;		// recent time (in ms) to first output, 0 = none
+} JumpHost;
+
+/*
+ * State of the live `--dashboard`.  The running hosts are kept in a min-heap on
+ * their start time so the oldest ones can be shown without a full scan, and
+ * the lines of the last frame are kept so only changed lines are redrawn.
+ */
+typedef struct dashboard {
+	Host **running;		// running hosts, min-heap on started_time
+	int num_running;	// number of hosts in running
+	int num_hosts;		// total number of hosts
+	int done;		// hosts done
+	int failed;		// hosts done with a non-zero exit code
+	int width;		// terminal width
+	long started_time;	// monotonic time (in ms) the run started
+	long next_draw;		// monotonic time (in ms) of the next redraw
+	bool drawn;		// a frame has been drawn
+	char lines[DASHBOARD_LINES][DASHBOARD_LINE_MAX];	// last frame
+} Dashboard;
+
+/*
+ * A unique result in join mode and the hosts that had it.
+ */
+typedef struct join_group {
+	Span output;		// the output (owned by the first host)
+	uint64_t hash;		// hash of the output
+	Host **hosts;		// hosts with the output, in the order of hosts
+	int num_hosts;		// number of hosts
+} JoinGroup;
+
+/*
+ * A hostname split around its last number (used by `--ranges`).
+ */
+typedef struct range_name {
+	const char *name;	// the hostname
+	size_t prefix_len;	// bytes before the number
+	const char *suffix;	// text after the number
+	unsigned long num;	// the number
+	int width;		// digits in the number, 0 = no number
+	int pad;		// width the number is zero-padded to, 0 = none
+} RangeName;
+
+/*
+ * A number extracted from every line of stdout and aggregated (`--agg`).
+ */
+typedef struct agg_metric {
+	const char *spec;	// the argument given to --agg
+	int field;		// field number (1 = first), 0 = use pattern
+	const char *pattern;	// text the number follows
+	AggStats stats;		// aggregates of the numbers seen
+} AggMetric;
+
 // Linked-list of Hosts
 static Host *hosts = NULL;
 
+// Compiled hosts file (if one was given)
+static HostDb *hostdb = NULL;
+
+// Result cache (`--cache`)
+static ResultCache *cache = NULL;
+
+// Snapshot of a previous run to compare against (`--changed-since`)
+static Snapshot *previous_snapshot = NULL;
+
+// Lines held back to be printed once per window (`--collapse`)
+static CollapseTable *collapse = NULL;
+
+// Most frequent lines (`--top`) and the buffer lines are normalized into
+static TopK *top_lines = NULL;
+static char *top_buffer = NULL;
+
+// Numbers aggregated from the output (`--agg`)
+static AggMetric aggs[MAX_AGGS];
+static int num_aggs = 0;
+
+// Local resources used by child processes (`--stats`): cpu time (in seconds)
+// and max rss (in megabytes) of each, and the hosts using the most cpu
+static AggStats stats_user;
+static AggStats stats_sys;
+static AggStats stats_rss;
+static Host *stats_top[STATS_TOP];
+static double stats_top_cpu[STATS_TOP];
+static long stats_started_time = -1;
+
+// Scheduling of child processes (`--ioprio` and `--child-cpus`)
+static int child_ioprio = -1;
+#ifdef __linux__
+static bool child_cpus_set = false;
+static cpu_set_t child_cpus;
+#endif
+
+// Pool of jump hosts to spread hosts over (`--jump`)
+static JumpHost jumps[MAX_JUMPS];
+static int num_jumps = 0;
+
+// Linked-list of sample reservoirs (one per stratum)
+static Sample *samples = NULL;
+
+// Tags that hosts must have to be used (`--tag`)
+static char *tag_filters[MAX_TAG_FILTERS] = {NULL};
+static int num_tag_filters = 0;
+
+// Pseudo-random number generator state (used for sampling)
+static uint64_t rng_state;
+
 // Command to execute
 static char **remote_command = {NULL};
 
@@ -330,9 +909,68 @@ static char *base_ssh_command[MAX_ARGS] = {NULL};
 // FdWatcher instance
 static FdWatcher *fdw = NULL;
 
-// If a newline was printed (used for group mode only)
+// If a newline was printed (used for group mode and `--stream-lines`)
 static bool newline_printed = true;
 
+// The pipe with a partly printed line (`--stream-lines`)
+static FdEvent *stream_fdev = NULL;
+
+// Pipes of other hosts waiting for that line to end, in order (same)
+static FdEvent *paused_head = NULL;
+static FdEvent *paused_tail = NULL;
+
+// The last host to have output printed (used for group mode only)
+static Host *last_group_host = NULL;
+
+// The first host not done yet and the bytes held in memory (`--ordered`)
+static Host *ordered_head = NULL;
+static size_t ordered_held = 0;
+
+// Free output chunks (`--block`)
+static BlockChunk *block_pool = NULL;
+
+// Output handlers for the mode (set by `output_handlers_init()`)
+static OutputHandlers handlers;
+
+// The timestamp printed before lines, updated once per loop (`--timestamps`)
+static char timestamp[TIMESTAMP_MAX];
+static size_t timestamp_len = 0;
+static long timestamp_start = 0;
+static time_t timestamp_second = -1;
+
+// Live status of the run (`--dashboard`)
+static Dashboard *dashboard = NULL;
+
+// Running hosts to time out, and timed out hosts to SIGKILL (`--timeout`)
+static RunQueue timeout_queue = {NULL, 0, 0, 0};
+static RunQueue kill_queue = {NULL, 0, 0, 0};
+
+// Hosts waiting to run again, ordered by `cp->next_run` (`--watch`)
+static Host **watch_queue = NULL;
+static int watch_queue_size = 0;
+static int watch_queue_head = 0;
+static int watch_queue_len = 0;
+
+// In-flight reachability probes and hosts waiting to be spawned (`--probe`)
+static struct fd_event **probe_slots = NULL;
+static int probe_slots_used = 0;
+static Host **probe_queue = NULL;
+static int probe_queue_head = 0;
+static int probe_queue_len = 0;
+
+// Random token and step marker prefix ("\n\036sshp:<token>:") for sessions
+static char session_token[17];
+static char session_prefix[SESSION_MARKER_MAX];
+static int session_prefix_len = 0;
+
+// Hosts running the current step and hosts with a live session (`--shell`)
+static int session_pending = 0;
+static int session_alive = 0;
+
+// Commands to run as the steps of a script (`--script`)
+static char **script_steps = NULL;
+static int num_script_steps = 0;
+
 // If stdout is a tty
 static bool stdout_isatty;
 
@@ -341,6 +979,38 @@ static char *short_options = "+ac:def:ghi:jl:m:no:p:qstvx:";
 static struct option long_options[] = {
 	{"max-line-length", required_argument, NULL, 1000},
 	{"max-output-length", required_argument, NULL, 1001},
+	{"probe", no_argument, NULL, 1002},
+	{"probe-timeout", required_argument, NULL, 1003},
+	{"sample", required_argument, NULL, 1004},
+	{"sample-per-tag", required_argument, NULL, 1005},
+	{"tag", required_argument, NULL, 1006},
+	{"dedupe", no_argument, NULL, 1007},
+	{"compile-hosts", required_argument, NULL, 1008},
+	{"cache", required_argument, NULL, 1009},
+	{"cache-dir", required_argument, NULL, 1010},
+	{"snapshot", required_argument, NULL, 1011},
+	{"changed-since", required_argument, NULL, 1012},
+	{"watch", required_argument, NULL, 1013},
+	{"shell", no_argument, NULL, 1014},
+	{"script", required_argument, NULL, 1015},
+	{"collapse", required_argument, NULL, 1016},
+	{"top", required_argument, NULL, 1017},
+	{"agg", required_argument, NULL, 1018},
+	{"ordered", no_argument, NULL, 1019},
+	{"block", no_argument, NULL, 1020},
+	{"merge-stderr", no_argument, NULL, 1021},
+	{"ranges", no_argument, NULL, 1022},
+	{"dashboard", no_argument, NULL, 1023},
+	{"timestamps", required_argument, NULL, 1024},
+	{"stream-lines", no_argument, NULL, 1025},
+	{"timeout", required_argument, NULL, 1026},
+	{"stats", no_argument, NULL, 1027},
+	{"nice", required_argument, NULL, 1028},
+	{"ioprio", required_argument, NULL, 1029},
+	{"child-cpus", required_argument, NULL, 1030},
+	{"loop-cpus", required_argument, NULL, 1031},
+	{"jump", required_argument, NULL, 1032},
+	{"jump-max", required_argument, NULL, 1033},
 	{"anonymous", no_argument, NULL, 'a'},
 	{"color", required_argument, NULL, 'c'},
 	{"debug", no_argument, NULL, 'd'},
@@ -380,6 +1050,36 @@ static struct opts {
 	bool trim;		// -t, --trim
 	int max_line_length;	// --max-line-length <num>
 	int max_output_length;	// --max-output-length <num>
+	bool probe;		// --probe
+	int probe_timeout;	// --probe-timeout <ms>
+	int sample;		// --sample <num>
+	int sample_per_tag;	// --sample-per-tag <num>
+	bool dedupe;		// --dedupe
+	char *compile_hosts;	// --compile-hosts <file> <output>
+	char *compile_output;	// output file for --compile-hosts
+	int cache_ttl;		// --cache <secs>
+	char *cache_dir;	// --cache-dir <dir>
+	char *snapshot;		// --snapshot <file>
+	char *changed_since;	// --changed-since <file>
+	int watch;		// --watch <secs>
+	bool shell;		// --shell
+	char *script;		// --script <file>
+	int collapse;		// --collapse <ms>
+	int top;		// --top <k>
+	bool ordered;		// --ordered
+	bool block;		// --block
+	bool merge_stderr;	// --merge-stderr
+	bool ranges;		// --ranges
+	bool dashboard;		// --dashboard
+	enum TimestampMode timestamps;	// --timestamps <wall|relative>
+	bool stream_lines;	// --stream-lines
+	int timeout;		// --timeout <ms>
+	bool stats;		// --stats
+	int nice;		// --nice <num>
+	char *ioprio;		// --ioprio <idle|0-7>
+	char *child_cpus;	// --child-cpus <list>
+	char *loop_cpus;	// --loop-cpus <list>
+	int jump_max;		// --jump-max <num>
 
 	// user options (passed directly to ssh)
 	char *identity;		// -i, --ident <file>
@@ -388,6 +1088,7 @@ static struct opts {
 
 	// derived options
 	enum ProgMode mode;	// set by program based on `-j` or `-g`
+	bool session;		// set by program for `--shell` and `--script`
 } opts;
 
 // colors to use when printing if coloring is enabled
@@ -498,6 +1199,79 @@ print_usage(FILE *s)
 	fprintf(s, "Maximum output length (in %sjoin mode%s), ", grn, rst);
 	fprintf(s, "defaults to %s%d%s.\n",
 	    grn, DEFAULT_MAX_OUTPUT_LENGTH, rst);
+	fprintf(s, "%s  --probe                    %s", grn, rst);
+	fprintf(s, "Check the ssh port is reachable before running ssh.\n");
+	fprintf(s, "%s  --probe-timeout <ms>       %s", grn, rst);
+	fprintf(s, "Probe connect timeout, defaults to %s%d%s.\n",
+	    grn, DEFAULT_PROBE_TIMEOUT, rst);
+	fprintf(s, "%s  --sample <num>             %s", grn, rst);
+	fprintf(s, "Run on a random sample of hosts.\n");
+	fprintf(s, "%s  --sample-per-tag <num>     %s", grn, rst);
+	fprintf(s, "Run on a random sample of hosts for each tag.\n");
+	fprintf(s, "%s  --tag <tag>                %s", grn, rst);
+	fprintf(s, "Only run on hosts with the given tag.\n");
+	fprintf(s, "%s  --dedupe                   %s", grn, rst);
+	fprintf(s, "Skip duplicate hosts (ignoring case).\n");
+	fprintf(s, "%s  --compile-hosts <in> <out> %s", grn, rst);
+	fprintf(s, "Compile a hosts file for faster loading and exit.\n");
+	fprintf(s, "%s  --cache <secs>             %s", grn, rst);
+	fprintf(s, "Reuse results cached less than %ssecs%s ago.\n",
+	    grn, rst);
+	fprintf(s, "%s  --cache-dir <dir>          %s", grn, rst);
+	fprintf(s, "Result cache directory, defaults to %s~/.cache/%s%s.\n",
+	    grn, PROG_NAME, rst);
+	fprintf(s, "%s  --snapshot <file>          %s", grn, rst);
+	fprintf(s, "Save a digest of each host's result (in %sjoin mode%s).\n",
+	    grn, rst);
+	fprintf(s, "%s  --changed-since <file>     %s", grn, rst);
+	fprintf(s, "Only show hosts whose result differs from a snapshot.\n");
+	fprintf(s, "%s  --watch <secs>             %s", grn, rst);
+	fprintf(s, "Run again every %ssecs%s, only showing changes.\n",
+	    grn, rst);
+	fprintf(s, "%s  --shell                    %s", grn, rst);
+	fprintf(s, "Run commands read from stdin over one session per host.\n");
+	fprintf(s, "%s  --script <file>            %s", grn, rst);
+	fprintf(s, "Run the commands in %sfile%s over one session per host.\n",
+	    grn, rst);
+	fprintf(s, "%s  --collapse <ms>            %s", grn, rst);
+	fprintf(s, "Print identical lines once per %sms%s with a host count.\n",
+	    grn, rst);
+	fprintf(s, "%s  --top <k>                  %s", grn, rst);
+	fprintf(s, "Only print the %sk%s most frequent lines at the end.\n",
+	    grn, rst);
+	fprintf(s, "%s  --agg <field>              %s", grn, rst);
+	fprintf(s, "Only print aggregates of the numbers in %sfield%s.\n",
+	    grn, rst);
+	fprintf(s, "%s  --ordered                  %s", grn, rst);
+	fprintf(s, "Group output by hostname in the order of the hosts.\n");
+	fprintf(s, "%s  --block                    %s", grn, rst);
+	fprintf(s, "Print all output of a host at once when it is done.\n");
+	fprintf(s, "%s  --merge-stderr             %s", grn, rst);
+	fprintf(s, "Read stdout and stderr from a single pipe per host.\n");
+	fprintf(s, "%s  --ranges                   %s", grn, rst);
+	fprintf(s, "Compress hostnames into ranges in join mode.\n");
+	fprintf(s, "%s  --dashboard                %s", grn, rst);
+	fprintf(s, "Show a live status of the run in join mode.\n");
+	fprintf(s, "%s  --timestamps <mode>        %s", grn, rst);
+	fprintf(s, "Prefix lines with the time, wall or relative.\n");
+	fprintf(s, "%s  --stream-lines             %s", grn, rst);
+	fprintf(s, "Print long lines in chunks instead of cutting them.\n");
+	fprintf(s, "%s  --timeout <ms>             %s", grn, rst);
+	fprintf(s, "Kill commands that run for longer than this.\n");
+	fprintf(s, "%s  --stats                    %s", grn, rst);
+	fprintf(s, "Print the local cpu and memory used by commands.\n");
+	fprintf(s, "%s  --nice <num>               %s", grn, rst);
+	fprintf(s, "Run commands with their niceness raised by num.\n");
+	fprintf(s, "%s  --ioprio <idle|0-7>        %s", grn, rst);
+	fprintf(s, "Run commands with the given io priority (Linux).\n");
+	fprintf(s, "%s  --child-cpus <list>        %s", grn, rst);
+	fprintf(s, "Run commands on the given cpus only (Linux).\n");
+	fprintf(s, "%s  --loop-cpus <list>         %s", grn, rst);
+	fprintf(s, "Run sshp itself on the given cpus only (Linux).\n");
+	fprintf(s, "%s  --jump <host>              %s", grn, rst);
+	fprintf(s, "Spread hosts over this jump host, can be repeated.\n");
+	fprintf(s, "%s  --jump-max <num>           %s", grn, rst);
+	fprintf(s, "Max hosts to run through a jump host at once.\n");
 	fprintf(s, "\n");
 	// ssh options
 	fprintf(s, "%sSSH OPTIONS:%s (passed directly to ssh)\n",
@@ -529,134 +1303,582 @@ pluralize(int num)
 }
 
 /*
- * Convert the given mode to a string.
+ * Count a line printed by a Host towards the most frequent lines (`--top`).
+ * Lines are normalized first: leading and trailing whitespace (including the
+ * newline) is removed and every other run of whitespace becomes one space.
  */
-static const char *
-prog_mode_to_string(enum ProgMode mode)
+static void
+top_add_line(Host *host, const char *line, size_t len)
 {
-	switch (mode) {
-	case MODE_LINE: return "line";
-	case MODE_GROUP: return "group";
-	case MODE_JOIN: return "join";
-	default: errx(3, "unknown ProgMode: %d", mode);
+	assert(top_lines != NULL);
+	assert(top_buffer != NULL);
+	assert(host != NULL);
+	assert(line != NULL);
+
+	size_t out = 0;
+	bool space = false;
+
+	for (size_t i = 0; i < len; i++) {
+		if (isspace((unsigned char)line[i])) {
+			space = out > 0;
+			continue;
+		}
+		if (space) {
+			top_buffer[out++] = ' ';
+			space = false;
+		}
+		top_buffer[out++] = line[i];
 	}
+
+	topk_add(top_lines, top_buffer, out, (uintptr_t)host);
 }
 
 /*
- * Print status - called via SIGUSR1 handler.
+ * Print the most frequent lines counted so far with `--top`.  Counts marked
+ * with a "~" may be overestimated (by at most the number of lines seen when
+ * the line started being counted).
  */
 static void
-print_status(void)
+print_top_lines(void)
 {
-	int num_hosts = 0;
-	int cp_ready = 0;
-	int cp_running = 0;
-	int cp_done = 0;
-
-	// calculate number of hosts in various state
-	for (Host *h = hosts; h != NULL; h = h->next) {
-		assert(h->cp != NULL);
-		switch (h->cp->state) {
-		case CP_STATE_READY: cp_ready++; break;
-		case CP_STATE_RUNNING: cp_running++; break;
-		case CP_STATE_DONE: cp_done++; break;
-		default: errx(3, "unknown cp->state: %d", h->cp->state);
-		}
-		num_hosts++;
-	}
-
-	printf("status: ");
-	printf("%s%d%s running, ", colors.magenta, cp_running, colors.reset);
-	printf("%s%d%s finished, ", colors.magenta, cp_done, colors.reset);
-	printf("%s%d%s remaining ", colors.magenta, cp_ready, colors.reset);
-	printf("(%s%d%s total)\n", colors.magenta, num_hosts, colors.reset);
-
-	// print each child process with their pid
-	if (cp_running > 0) {
-		printf("running processes:\n");
-		for (Host *h = hosts; h != NULL; h = h->next) {
-			assert(h->cp != NULL);
-			if (h->cp->state != CP_STATE_RUNNING) {
-				continue;
-			}
-			printf("--> pid %s%d%s %s%s%s\n",
-			    colors.magenta, h->cp->pid, colors.reset,
-			    colors.cyan, h->name, colors.reset);
-		}
+	assert(top_lines != NULL);
+
+	const TopKEntry **top;
+	size_t n = topk_sorted(top_lines, &top, opts.top);
+
+	printf("top %s%zu%s line%s (%s%llu%s lines read):\n",
+	    colors.magenta, n, colors.reset, pluralize((int)n),
+	    colors.magenta, (unsigned long long)top_lines->total,
+	    colors.reset);
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t sources = topk_sources(top[i]);
+
+		printf("%s%c%8llu%s %s%6llu%s host%s  %s",
+		    colors.magenta, top[i]->error > 0 ? '~' : ' ',
+		    (unsigned long long)top[i]->count, colors.reset,
+		    colors.magenta, (unsigned long long)sources,
+		    colors.reset, pluralize((int)sources),
+		    colors.green);
+		fwrite(top[i]->item, 1, top[i]->len, stdout);
+		printf("%s\n", colors.reset);
 	}
 }
 
 /*
- * Kill all running child processes.
+ * Set up an `--agg` metric: a positive number is a field number, anything
+ * else is the text the number follows.
  */
 static void
-kill_running_processes(void)
+agg_metric_init(AggMetric *m, const char *spec)
 {
-	for (Host *h = hosts; h != NULL; h = h->next) {
-		assert(h->cp != NULL);
-		if (h->cp->state != CP_STATE_RUNNING) {
-			continue;
-		}
-		assert(h->cp->pid > 0);
+	assert(m != NULL);
+	assert(spec != NULL);
 
-		DEBUG("killing pid %s%d%s %s%s%s\n",
-		    colors.magenta, h->cp->pid, colors.reset,
-		    colors.cyan, h->name, colors.reset);
+	m->spec = spec;
+	m->field = 0;
+	m->pattern = NULL;
+	agg_init(&m->stats);
 
-		if (kill(h->cp->pid, SIGTERM) == -1) {
-			warn("send SIGTERM to pid %d", h->cp->pid);
+	if (spec[0] == '\0') {
+		errx(2, "invalid value for `--agg`: '%s'", spec);
+	}
+	if (strspn(spec, "0123456789") == strlen(spec)) {
+		m->field = atoi(spec);
+		if (m->field <= 0) {
+			errx(2, "invalid value for `--agg`: '%s'", spec);
 		}
+	} else {
+		m->pattern = spec;
 	}
 }
 
 /*
- * Simple signal num -> string converter.
+ * Find the number an `--agg` metric refers to in the given line.  Fields are
+ * separated by whitespace and must start with the number (trailing units like
+ * "%" or "G" are ignored); with a pattern, the number may follow the text of
+ * its first occurrence after any whitespace.
  */
-static const char *
-signal_to_str(int signum)
+static bool
+agg_metric_find(const AggMetric *m, const char *line, double *value)
 {
-	switch (signum) {
-	case SIGTERM: return "SIGTERM";
-	case SIGUSR1: return "SIGUSR1";
-	case SIGINT: return "SIGINT";
-	default: return "(unknown signal)";
+	assert(m != NULL);
+	assert(line != NULL);
+	assert(value != NULL);
+
+	const char *p = line;
+
+	if (m->pattern != NULL) {
+		p = strstr(line, m->pattern);
+		if (p == NULL) {
+			return false;
+		}
+		p += strlen(m->pattern);
+		while (*p == ' ' || *p == '\t') {
+			p++;
+		}
+		return agg_parse_number(p, value) > 0;
+	}
+
+	for (int field = 1; ; field++) {
+		// skip to the start of the field
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (*p == '\0') {
+			return false;
+		}
+		if (field == m->field) {
+			return agg_parse_number(p, value) > 0;
+		}
+
+		// skip over the field
+		while (*p != '\0' && !isspace((unsigned char)*p)) {
+			p++;
+		}
 	}
 }
 
 /*
- * Signal handler.
+ * Add the numbers in a line of stdout printed by a Host to every `--agg`
+ * metric that can be found in it.
  */
 static void
-signal_handler(int signum)
+agg_add_line(Host *host, const char *line)
 {
-	printf("\n%s%s%s received\n",
-	    colors.yellow, signal_to_str(signum), colors.reset);
+	assert(host != NULL);
+	assert(line != NULL);
 
-	switch (signum) {
-	case SIGUSR1: print_status(); break;
-	case SIGINT: exit(4);
-	case SIGTERM: exit(4);
-	default: errx(3, "unknown signal handled: %d", signum);
-	}
+	for (int i = 0; i < num_aggs; i++) {
+		double value;
 
-	printf("\n");
+		if (agg_metric_find(&aggs[i], line, &value)) {
+			agg_add(&aggs[i].stats, value, host);
+		}
+	}
 }
 
 /*
- * atexit handler.  Kill any running child processes that are possibly
- * outstanding when exit is called.
+ * Print the aggregates of every `--agg` metric seen so far.
  */
 static void
-atexit_handler(void)
+print_aggs(void)
 {
-	kill_running_processes();
+	for (int i = 0; i < num_aggs; i++) {
+		AggStats *a = &aggs[i].stats;
+
+		printf("agg %s%s%s: %s%llu%s value%s\n",
+		    colors.cyan, aggs[i].spec, colors.reset,
+		    colors.magenta, (unsigned long long)a->count,
+		    colors.reset, pluralize((int)a->count));
+		if (a->count == 0) {
+			continue;
+		}
+
+		printf("    min  %s%g%s (%s%s%s)\n",
+		    colors.magenta, a->min, colors.reset,
+		    colors.cyan, ((const Host *)a->min_source)->name,
+		    colors.reset);
+		printf("    max  %s%g%s (%s%s%s)\n",
+		    colors.magenta, a->max, colors.reset,
+		    colors.cyan, ((const Host *)a->max_source)->name,
+		    colors.reset);
+		printf("    mean %s%g%s\n",
+		    colors.magenta, a->mean, colors.reset);
+		for (int j = 0; j < AGG_NUM_QUANTILES; j++) {
+			char name[16];
+
+			snprintf(name, sizeof (name), "p%g",
+			    agg_quantiles[j] * 100);
+			printf("    %-4s %s%g%s\n", name, colors.magenta,
+			    agg_quantile(a, j), colors.reset);
+		}
+	}
 }
 
 /*
- * Wrapper for malloc that takes an error message as the second argument and
- * exits on failure.
+ * Get the current monotonic time in ms.
  */
-static void *
+static long
+monotonic_time_ms(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t) == -1) {
+		err(3, "clock_gettime");
+	}
+
+	return (t.tv_sec * 1e3) + (t.tv_nsec / 1e6);
+}
+
+/*
+ * Convert a timeval to seconds.
+ */
+static double
+timeval_to_seconds(const struct timeval *tv)
+{
+	assert(tv != NULL);
+
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Count the resources used by a reaped child process (`--stats`).
+ */
+static void
+stats_add(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	const struct rusage *ru = &host->cp->usage;
+	double user = timeval_to_seconds(&ru->ru_utime);
+	double sys = timeval_to_seconds(&ru->ru_stime);
+	double rss = ru->ru_maxrss / 1024.0;
+	double cpu = user + sys;
+	int i;
+
+#ifdef __APPLE__
+	// reported in bytes instead of kilobytes
+	rss /= 1024;
+#endif
+
+	agg_add(&stats_user, user, host);
+	agg_add(&stats_sys, sys, host);
+	agg_add(&stats_rss, rss, host);
+
+	// keep the hosts using the most cpu, most first
+	for (i = STATS_TOP; i > 0 && (stats_top[i - 1] == NULL ||
+	    cpu > stats_top_cpu[i - 1]); i--) {
+		if (i < STATS_TOP) {
+			stats_top[i] = stats_top[i - 1];
+			stats_top_cpu[i] = stats_top_cpu[i - 1];
+		}
+	}
+	if (i < STATS_TOP) {
+		stats_top[i] = host;
+		stats_top_cpu[i] = cpu;
+	}
+}
+
+/*
+ * Print a line of `--stats` for the given values, with the given number of
+ * decimals and unit.
+ */
+static void
+print_stats_line(const char *name, const AggStats *a, int prec,
+	const char *unit)
+{
+	assert(name != NULL);
+	assert(a != NULL);
+	assert(a->count > 0);
+
+	printf("    %-4s mean %s%.*f%s%s", name,
+	    colors.magenta, prec, a->mean, colors.reset, unit);
+	for (int j = 0; j < AGG_NUM_QUANTILES; j++) {
+		printf("  p%g %s%.*f%s%s", agg_quantiles[j] * 100,
+		    colors.magenta, prec, agg_quantile(a, j), colors.reset,
+		    unit);
+	}
+	printf("  max %s%.*f%s%s (%s%s%s)\n",
+	    colors.magenta, prec, a->max, colors.reset, unit,
+	    colors.cyan, ((const Host *)a->max_source)->name, colors.reset);
+}
+
+/*
+ * Print the local resources used by child processes (`--stats`): the total
+ * cpu time used and how many cores that kept busy on average over the run
+ * (to size `-m`), the distribution of user and system cpu time and max rss per
+ * command, and the hosts whose commands used the most cpu.
+ */
+static void
+print_stats(void)
+{
+	uint64_t n = stats_user.count;
+	double user = stats_user.mean * n;
+	double sys = stats_sys.mean * n;
+	double elapsed = (monotonic_time_ms() - stats_started_time) / 1000.0;
+
+	printf("stats: %s%llu%s command%s, %s%.3f%ss cpu "
+	    "(%s%.3f%ss user, %s%.3f%ss sys) over %s%.3f%ss",
+	    colors.magenta, (unsigned long long)n, colors.reset,
+	    pluralize((int)n),
+	    colors.magenta, user + sys, colors.reset,
+	    colors.magenta, user, colors.reset,
+	    colors.magenta, sys, colors.reset,
+	    colors.magenta, elapsed, colors.reset);
+	if (elapsed > 0) {
+		printf(", %s%.2f%s cores",
+		    colors.magenta, (user + sys) / elapsed, colors.reset);
+	}
+	printf("\n");
+
+	if (n == 0) {
+		return;
+	}
+
+	print_stats_line("user", &stats_user, 3, "s");
+	print_stats_line("sys", &stats_sys, 3, "s");
+	print_stats_line("rss", &stats_rss, 1, "m");
+
+	printf("    top ");
+	for (int i = 0; i < STATS_TOP && stats_top[i] != NULL; i++) {
+		printf("%s %s%s%s (%s%.3f%ss)", i > 0 ? "," : "",
+		    colors.cyan, stats_top[i]->name, colors.reset,
+		    colors.magenta, stats_top_cpu[i], colors.reset);
+	}
+	printf("\n");
+}
+
+/*
+ * Check if stdout and stderr of child processes share a single pipe (always
+ * in join mode, or with `--merge-stderr`).
+ */
+static bool
+single_output_pipe(void)
+{
+	return opts.mode == MODE_JOIN || opts.merge_stderr;
+}
+
+/*
+ * Convert the given mode to a string.
+ */
+static const char *
+prog_mode_to_string(enum ProgMode mode)
+{
+	switch (mode) {
+	case MODE_LINE: return "line";
+	case MODE_GROUP: return "group";
+	case MODE_JOIN: return "join";
+	default: errx(3, "unknown ProgMode: %d", mode);
+	}
+}
+
+/*
+ * Print status - called via SIGUSR1 handler.
+ */
+static void
+print_status(void)
+{
+	int num_hosts = 0;
+	int cp_ready = 0;
+	int cp_probing = 0;
+	int cp_running = 0;
+	int cp_done = 0;
+
+	// calculate number of hosts in various state
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		assert(h->cp != NULL);
+		switch (h->cp->state) {
+		case CP_STATE_READY: cp_ready++; break;
+		case CP_STATE_PROBING: cp_probing++; break;
+		case CP_STATE_RUNNING: cp_running++; break;
+		case CP_STATE_DONE: cp_done++; break;
+		default: errx(3, "unknown cp->state: %d", h->cp->state);
+		}
+		num_hosts++;
+	}
+
+	printf("status: ");
+	printf("%s%d%s running, ", colors.magenta, cp_running, colors.reset);
+	if (opts.probe) {
+		printf("%s%d%s probing, ",
+		    colors.magenta, cp_probing, colors.reset);
+	}
+	printf("%s%d%s finished, ", colors.magenta, cp_done, colors.reset);
+	printf("%s%d%s remaining ", colors.magenta, cp_ready, colors.reset);
+	printf("(%s%d%s total)\n", colors.magenta, num_hosts, colors.reset);
+
+	// print each child process with their pid
+	if (cp_running > 0) {
+		printf("running processes:\n");
+		for (Host *h = hosts; h != NULL; h = h->next) {
+			assert(h->cp != NULL);
+			if (h->cp->state != CP_STATE_RUNNING) {
+				continue;
+			}
+			printf("--> pid %s%d%s %s%s%s\n",
+			    colors.magenta, h->cp->pid, colors.reset,
+			    colors.cyan, h->name, colors.reset);
+		}
+	}
+
+	// print lines held back by --collapse with the hosts that printed them
+	if (collapse != NULL && collapse->num_lines > 0) {
+		printf("collapsed lines:\n");
+		for (size_t i = 0; i < collapse->num_lines; i++) {
+			CollapsedLine *cl = &collapse->lines[i];
+
+			printf("--> %s%d%s host%s:%s",
+			    colors.magenta, cl->num_hosts, colors.reset,
+			    pluralize(cl->num_hosts), colors.cyan);
+			for (int j = 0; j < cl->num_hosts; j++) {
+				printf(" %s", cl->hosts[j]->name);
+			}
+			printf("%s\n    %s", colors.reset,
+			    collapse->arena + cl->offset);
+		}
+	}
+
+	// print the most frequent lines so far
+	if (top_lines != NULL) {
+		print_top_lines();
+	}
+
+	// print the aggregates so far
+	if (num_aggs > 0) {
+		print_aggs();
+	}
+
+	// print the load on each jump host
+	if (num_jumps > 0) {
+		long now = monotonic_time_ms();
+
+		printf("jump hosts:\n");
+		for (int i = 0; i < num_jumps; i++) {
+			JumpHost *j = &jumps[i];
+
+			printf("--> %s%s%s %s%d%s running, %s%d%s run, "
+			    "%s%.0f%s ms%s\n",
+			    colors.green, j->spec, colors.reset,
+			    colors.magenta, j->outstanding, colors.reset,
+			    colors.magenta, j->runs, colors.reset,
+			    colors.magenta, j->latency, colors.reset,
+			    j->down_until > now ? " (out of rotation)" : "");
+		}
+	}
+}
+
+/*
+ * Send a signal to a running child process.  With `--timeout` each child leads
+ * its own process group (see `spawn_child_process`), and the whole group is
+ * signaled so anything it started - like a ProxyCommand - gets it too.
+ */
+static void
+kill_child_process(Host *host, int signum)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(host->cp->pid > 0);
+
+	DEBUG("sending %s to pid %s%d%s %s%s%s\n",
+	    signum == SIGKILL ? "SIGKILL" : "SIGTERM",
+	    colors.magenta, host->cp->pid, colors.reset,
+	    colors.cyan, host->name, colors.reset);
+
+	pid_t target = opts.timeout > 0 ? -host->cp->pid : host->cp->pid;
+
+	if (kill(target, signum) == -1 && errno != ESRCH) {
+		warn("send signal %d to pid %d", signum, host->cp->pid);
+	}
+}
+
+/*
+ * Kill all running child processes: every child is sent SIGTERM, and SIGKILL
+ * if it hasn't exited within KILL_GRACE.  All of the children are
+ * reaped before returning, so nothing is left running after sshp exits.
+ */
+static void
+kill_running_processes(void)
+{
+	struct timespec poll = {0, KILL_POLL * 1000000L};
+	int running = 0;
+	long deadline;
+
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		assert(h->cp != NULL);
+		if (h->cp->state != CP_STATE_RUNNING) {
+			continue;
+		}
+		assert(h->cp->pid > 0);
+
+		kill_child_process(h, SIGTERM);
+		running++;
+	}
+
+	deadline = monotonic_time_ms() + KILL_GRACE;
+	while (running > 0) {
+		bool force = monotonic_time_ms() >= deadline;
+
+		for (Host *h = hosts; h != NULL; h = h->next) {
+			pid_t pid;
+
+			if (h->cp->state != CP_STATE_RUNNING) {
+				continue;
+			}
+
+			// out of time, wait for the group to be killed
+			if (force) {
+				kill_child_process(h, SIGKILL);
+			}
+
+			pid = waitpid(h->cp->pid, NULL, force ? 0 : WNOHANG);
+			if (pid == 0) {
+				continue;
+			}
+			if (pid == -1 && errno == EINTR) {
+				continue;
+			}
+
+			h->cp->pid = -2;
+			h->cp->state = CP_STATE_DONE;
+			running--;
+		}
+
+		if (running > 0) {
+			nanosleep(&poll, NULL);
+		}
+	}
+}
+
+/*
+ * Simple signal num -> string converter.
+ */
+static const char *
+signal_to_str(int signum)
+{
+	switch (signum) {
+	case SIGTERM: return "SIGTERM";
+	case SIGUSR1: return "SIGUSR1";
+	case SIGINT: return "SIGINT";
+	default: return "(unknown signal)";
+	}
+}
+
+/*
+ * Signal handler.
+ */
+static void
+signal_handler(int signum)
+{
+	printf("\n%s%s%s received\n",
+	    colors.yellow, signal_to_str(signum), colors.reset);
+
+	switch (signum) {
+	case SIGUSR1: print_status(); break;
+	case SIGINT: exit(4);
+	case SIGTERM: exit(4);
+	default: errx(3, "unknown signal handled: %d", signum);
+	}
+
+	printf("\n");
+}
+
+/*
+ * atexit handler.  Kill any running child processes that are possibly
+ * outstanding when exit is called.
+ */
+static void
+atexit_handler(void)
+{
+	kill_running_processes();
+}
+
+/*
+ * Wrapper for malloc that takes an error message as the second argument and
+ * exits on failure.
+ */
+static void *
 safe_malloc(size_t size, const char *msg)
 {
 	void *ptr;
@@ -682,20 +1904,91 @@ child_process_create(void)
 	ChildProcess *cp = safe_malloc(sizeof (ChildProcess),
 	    "child_process_create");
 
+	cp->cache_key = NULL;
+	cp->cache_key_len = 0;
+	cp->cached = false;
+	cp->digest = HASH_INIT;
 	cp->exit_code = -1;
+	cp->signaled = false;
 	cp->finished_time = -1;
-	cp->output = NULL;
+	cp->name_hash = 0;
+	cp->output.data = NULL;
+	cp->output.len = 0;
 	cp->output_idx = -1;
 	cp->pid = -1;
+	cp->probe_addr = NULL;
+	cp->probe_addrs = NULL;
+	cp->probe_deadline = -1;
+	cp->probe_fd = -1;
+	cp->probe_slot = -1;
 	cp->started_time = -1;
 	cp->state = CP_STATE_READY;
 	cp->stderr_fd = -1;
 	cp->stdio_fd = -1;
 	cp->stdout_fd = -1;
+	cp->unchanged = false;
+	cp->next_run = -1;
+	cp->watch_digest = 0;
+	cp->watched = false;
+	cp->stdin_fd = -1;
+	cp->stdin_fdev = NULL;
+	cp->input_watched = false;
+	cp->input = NULL;
+	cp->input_len = 0;
+	cp->input_off = 0;
+	cp->step = 0;
+	cp->last_step = 0;
+	cp->stdout_step = 0;
+	cp->stderr_step = 0;
+	cp->busy = false;
+	cp->failed_steps = 0;
+	cp->step_outputs = NULL;
+	memset(&cp->cache_out, 0, sizeof (cp->cache_out));
+	memset(&cp->cache_err, 0, sizeof (cp->cache_err));
+	memset(&cp->held, 0, sizeof (cp->held));
+	cp->spill = NULL;
+	cp->reaped_pid = -1;
+	cp->block_head = NULL;
+	cp->block_tail = NULL;
+	cp->block_color = NULL;
+	cp->dashboard_idx = -1;
+	cp->timed_out = false;
+	cp->kill_deadline = -1;
+	cp->jump = NULL;
+	cp->first_output_time = -1;
 
 	return cp;
 }
 
+/*
+ * Reset a finished ChildProcess so it can be run again (`--watch`).  The
+ * capture buffers are kept allocated to be reused by the next run.
+ */
+static void
+child_process_reset(ChildProcess *cp)
+{
+	assert(cp != NULL);
+	assert(cp->state == CP_STATE_DONE);
+
+	cp->exit_code = -1;
+	cp->signaled = false;
+	cp->finished_time = -1;
+	cp->pid = -1;
+	cp->started_time = -1;
+	cp->state = CP_STATE_READY;
+	cp->stderr_fd = -1;
+	cp->stdio_fd = -1;
+	cp->stdout_fd = -1;
+	cp->cache_out.len = 0;
+	cp->cache_out.overflow = false;
+	cp->cache_err.len = 0;
+	cp->cache_err.overflow = false;
+	cp->timed_out = false;
+	cp->kill_deadline = -1;
+	cp->jump = NULL;
+	cp->first_output_time = -1;
+}
+
 /*
  * Check if the given Host object has had both of its stdio pipes closed.
  */
@@ -718,27 +2011,53 @@ child_process_destroy(ChildProcess *cp)
 		return;
 	}
 
-	free(cp->output);
+	if (cp->probe_addrs != NULL) {
+		freeaddrinfo(cp->probe_addrs);
+	}
+
+	free(cp->cache_key);
+	free(cp->cache_out.data);
+	free(cp->cache_err.data);
+	free(cp->output.data);
+	free(cp->step_outputs);
+	free(cp->held.data);
+	if (cp->spill != NULL) {
+		fclose(cp->spill);
+	}
+	while (cp->block_head != NULL) {
+		BlockChunk *chunk = cp->block_head;
+		cp->block_head = chunk->next;
+		free(chunk);
+	}
 	free(cp);
 }
 
 /*
- * Allocate and create a new Host object given its hostname.  The hostname will
- * be copied from the given argument.
+ * Allocate and create a new Host object given its hostname, tags (can be NULL)
+ * and position in the hosts file.  The hostname and tags will be copied from
+ * the given arguments.
  */
 static Host *
-host_create(const char *name)
+host_create(const char *name, const char *tags, int id)
 {
 	assert(name != NULL);
 
 	Host *host = safe_malloc(sizeof (Host), "host_create");
 	char *name_dup = strdup(name);
+	char *tags_dup = NULL;
 
 	if (name_dup == NULL) {
 		err(3, "strdup hostname %s", name);
 	}
+	if (tags != NULL && (tags_dup = strdup(tags)) == NULL) {
+		err(3, "strdup tags %s", tags);
+	}
 
 	host->name = name_dup;
+	host->tags = tags_dup;
+	host->id = id;
+	host->borrowed = false;
+	host->trimmed = NULL;
 	host->cp = child_process_create();
 	host->next = NULL;
 
@@ -746,69 +2065,85 @@ host_create(const char *name)
 }
 
 /*
- * Free an allocated Host object.
+ * Allocate and create a new Host object that borrows the given hostname and
+ * tags (can be NULL) from a HostDb instead of copying them.
  */
-static void
-host_destroy(Host *host)
+static Host *
+host_create_borrowed(char *name, char *tags, int id)
 {
-	if (host == NULL) {
-		return;
-	}
+	assert(name != NULL);
 
-	child_process_destroy(host->cp);
+	Host *host = safe_malloc(sizeof (Host), "host_create_borrowed");
 
-	free(host->name);
+	host->name = name;
+	host->tags = tags;
+	host->id = id;
+	host->borrowed = true;
+	host->trimmed = NULL;
+	host->cp = child_process_create();
+	host->next = NULL;
+
+	return host;
+}
+
+/*
+ * Free an allocated Host object.
+ */
+static void
+host_destroy(Host *host)
+{
+	if (host == NULL) {
+		return;
+	}
+
+	child_process_destroy(host->cp);
+
+	if (!host->borrowed) {
+		free(host->name);
+		free(host->tags);
+	}
 	free(host);
 }
 
 /*
- * Create and FdEvent object given a host pointer and pipetype.
+ * Chop off the domain portion of the name of the given Host if `-t` is set.
  */
-static FdEvent *
-fdev_create(Host *host, enum PipeType type)
+static void
+host_trim(Host *host)
 {
 	assert(host != NULL);
-	assert(host->cp != NULL);
 
-	FdEvent *fdev = safe_malloc(sizeof (FdEvent), "FdEvent");
-
-	fdev->host = host;
-	fdev->type = type;
-	fdev->offset = 0;
-	fdev->buffer = NULL;
+	char *dot;
 
-	// initailize stdio buffers
-	switch (opts.mode) {
-	case MODE_LINE:
-		fdev->buffer = safe_malloc(opts.max_line_length + 2,
-		    "fdev->buffer");
-		break;
-	case MODE_JOIN:
-		fdev->buffer = safe_malloc(opts.max_output_length + 1,
-		    "fdev->buffer");
-		break;
-	case MODE_GROUP:
-		// stdio is not buffered in group mode
-		break;
-	default: errx(3, "unknown mode: %d", opts.mode);
+	if (!opts.trim || host->trimmed != NULL) {
+		return;
 	}
 
-	// get fd
-	switch (type) {
-	case PIPE_STDOUT: fdev->fd = host->cp->stdout_fd; break;
-	case PIPE_STDERR: fdev->fd = host->cp->stderr_fd; break;
-	case PIPE_STDIO:  fdev->fd = host->cp->stdio_fd;  break;
-	default: errx(3, "unknown type: %d", type);
+	dot = strchr(host->name, '.');
+	if (dot != NULL) {
+		*dot = '\0';
+		host->trimmed = dot;
 	}
-	assert(fdev->fd >= 0);
+}
 
-	return fdev;
+/*
+ * Restore the full name of a Host that was trimmed with `host_trim`.
+ */
+static void
+host_untrim(Host *host)
+{
+	assert(host != NULL);
+
+	if (host->trimmed != NULL) {
+		*host->trimmed = '.';
+		host->trimmed = NULL;
+	}
 }
 
 /*
  * Given an FdEvent pointer return the event relevant color.
  */
-static char *
+static const char *
 fdev_get_color(FdEvent *fdev)
 {
 	assert(fdev != NULL);
@@ -817,10 +2152,66 @@ fdev_get_color(FdEvent *fdev)
 	case PIPE_STDOUT: return colors.green;
 	case PIPE_STDERR: return colors.red;
 	case PIPE_STDIO: return "";
+	case PIPE_PROBE: return "";
+	case PIPE_STDIN: return "";
 	default: errx(3, "unknown fdev->type: %d", fdev->type);
 	}
 }
 
+/*
+ * Create and FdEvent object given a host pointer and pipetype.
+ */
+static FdEvent *
+fdev_create(Host *host, enum PipeType type)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	FdEvent *fdev = safe_malloc(sizeof (FdEvent), "FdEvent");
+
+	fdev->host = host;
+	fdev->type = type;
+	fdev->offset = 0;
+	fdev->buffer = NULL;
+	fdev->marker = NULL;
+	fdev->marker_len = 0;
+	fdev->streaming = false;
+	fdev->paused = false;
+	fdev->held = NULL;
+	fdev->held_len = 0;
+	fdev->paused_next = NULL;
+
+	// get fd and color
+	switch (type) {
+	case PIPE_STDOUT: fdev->cp_fd = &host->cp->stdout_fd; break;
+	case PIPE_STDERR: fdev->cp_fd = &host->cp->stderr_fd; break;
+	case PIPE_STDIO:  fdev->cp_fd = &host->cp->stdio_fd;  break;
+	case PIPE_PROBE:  fdev->cp_fd = &host->cp->probe_fd;  break;
+	case PIPE_STDIN:  fdev->cp_fd = &host->cp->stdin_fd;  break;
+	default: errx(3, "unknown type: %d", type);
+	}
+	fdev->fd = *fdev->cp_fd;
+	fdev->color = fdev_get_color(fdev);
+
+	// probe sockets and session input never carry any output
+	if (type == PIPE_PROBE || type == PIPE_STDIN) {
+		return fdev;
+	}
+
+	// session output is split into steps by markers
+	if (opts.session) {
+		fdev->marker = safe_malloc(SESSION_MARKER_MAX, "fdev->marker");
+	}
+
+	// initailize stdio buffers (not buffered in group mode)
+	if (handlers.buffer_size > 0) {
+		fdev->buffer = safe_malloc(handlers.buffer_size,
+		    "fdev->buffer");
+	}
+
+	return fdev;
+}
+
 /*
  * Free an allocated FdEvent object.
  */
@@ -831,844 +2222,5203 @@ fdev_destroy(FdEvent *fdev)
 		return;
 	}
 
-	free(fdev->buffer);
-	free(fdev);
+	free(fdev->buffer);
+	free(fdev->marker);
+	free(fdev->held);
+	free(fdev);
+}
+
+/*
+ * Create a pipe with both ends set to non-blocking and cloexec.
+ */
+static void
+make_pipe(int *fd)
+{
+	assert(fd != NULL);
+
+	if (pipe(fd) == -1) {
+		err(3, "pipe");
+	}
+	if (fcntl(fd[PIPE_READ_END], F_SETFL, O_NONBLOCK) == -1) {
+		err(3, "set read end nonblocking");
+	}
+	if (fcntl(fd[PIPE_WRITE_END], F_SETFL, O_NONBLOCK) == -1) {
+		err(3, "set write end nonblocking");
+	}
+	if (fcntl(fd[PIPE_READ_END], F_SETFD, FD_CLOEXEC) == -1) {
+		err(3, "set read end cloexec");
+	}
+	if (fcntl(fd[PIPE_WRITE_END], F_SETFD, FD_CLOEXEC) == -1) {
+		err(3, "set write end cloexec");
+	}
+}
+
+/*
+ * Push an argument to the ssh base command and bounds check it.
+ * The strings passed to this function need to be allocated or constantly
+ * defined.
+ */
+static void
+push_arguments(char *s, ...)
+{
+	assert(s != NULL);
+
+	static int idx = 0;
+	va_list args;
+
+	va_start(args, s);
+	while (s != NULL) {
+		if (idx >= MAX_ARGS - 2) {
+			errx(2, "too many command arguments");
+		}
+		base_ssh_command[idx] = s;
+		idx++;
+		s = va_arg(args, char *);
+	}
+	va_end(args);
+}
+
+/*
+ * Replace the first occurrence of char c with '\0' in a string.
+ * Returns true if a replacement was made and false otherwise.
+ */
+static bool
+lsplit_str(char *s, char c)
+{
+	assert(s != NULL);
+
+	for (int i = 0; s[i] != '\0'; i++) {
+		if (s[i] == c) {
+			s[i] = '\0';
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Given a Span return whether it ends in a newline character.
+ */
+static bool
+ends_in_newline(const Span *s)
+{
+	assert(s != NULL);
+
+	if (s->len == 0) {
+		return false;
+	}
+
+	return s->data[s->len - 1] == '\n';
+}
+
+/*
+ * Write a Span to stdout as it is.
+ */
+static void
+print_span(const Span *s)
+{
+	assert(s != NULL);
+
+	if (s->len > 0 && fwrite(s->data, 1, s->len, stdout) < s->len) {
+		err(3, "write failed");
+	}
+}
+
+/*
+ * Format the timestamp printed before lines (`--timestamps`).  This is done
+ * once per loop iteration rather than per line, as every line read in an
+ * iteration was read at (nearly) the same time.
+ */
+static void
+timestamp_update(void)
+{
+	static char wall[16];
+	long ms;
+
+	if (opts.timestamps == TIMESTAMP_RELATIVE) {
+		ms = monotonic_time_ms() - timestamp_start;
+		timestamp_len = snprintf(timestamp, sizeof (timestamp),
+		    "%s%4ld.%03ld%s ", colors.magenta, ms / 1000, ms % 1000,
+		    colors.reset);
+		return;
+	}
+
+	assert(opts.timestamps == TIMESTAMP_WALL);
+
+	struct timespec t;
+	struct tm tm;
+
+	if (clock_gettime(CLOCK_REALTIME, &t) == -1) {
+		err(3, "clock_gettime");
+	}
+	ms = t.tv_nsec / 1000000;
+
+	// the time of day only changes once a second
+	if (t.tv_sec != timestamp_second) {
+		if (localtime_r(&t.tv_sec, &tm) == NULL) {
+			err(3, "localtime_r");
+		}
+		strftime(wall, sizeof (wall), "%H:%M:%S", &tm);
+		timestamp_second = t.tv_sec;
+	}
+
+	timestamp_len = snprintf(timestamp, sizeof (timestamp),
+	    "%s%s.%03ld%s ", colors.magenta, wall, ms, colors.reset);
+}
+
+/*
+ * Create the Dashboard for a run of the given number of hosts.
+ */
+static Dashboard *
+dashboard_create(int num_hosts)
+{
+	Dashboard *d = safe_malloc(sizeof (Dashboard), "dashboard_create");
+	struct winsize ws;
+
+	d->running = safe_malloc(sizeof (Host *) * (opts.max_jobs + 1),
+	    "dashboard running");
+	d->num_running = 0;
+	d->num_hosts = num_hosts;
+	d->done = 0;
+	d->failed = 0;
+	d->started_time = monotonic_time_ms();
+	d->next_draw = d->started_time;
+	d->drawn = false;
+	memset(d->lines, 0, sizeof (d->lines));
+
+	d->width = 80;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+		d->width = ws.ws_col;
+	}
+
+	return d;
+}
+
+/*
+ * Swap 2 hosts in the running heap, keeping their indexes up to date.
+ */
+static void
+dashboard_swap(Dashboard *d, int a, int b)
+{
+	Host *tmp = d->running[a];
+
+	d->running[a] = d->running[b];
+	d->running[b] = tmp;
+	d->running[a]->cp->dashboard_idx = a;
+	d->running[b]->cp->dashboard_idx = b;
+}
+
+/*
+ * Restore the heap order around the host at the given index.
+ */
+static void
+dashboard_fix(Dashboard *d, int i)
+{
+	// move up
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (d->running[parent]->cp->started_time <=
+		    d->running[i]->cp->started_time) {
+			break;
+		}
+		dashboard_swap(d, i, parent);
+		i = parent;
+	}
+
+	// move down
+	for (;;) {
+		int left = i * 2 + 1;
+		int right = left + 1;
+		int min = i;
+
+		if (left < d->num_running &&
+		    d->running[left]->cp->started_time <
+		    d->running[min]->cp->started_time) {
+			min = left;
+		}
+		if (right < d->num_running &&
+		    d->running[right]->cp->started_time <
+		    d->running[min]->cp->started_time) {
+			min = right;
+		}
+		if (min == i) {
+			return;
+		}
+		dashboard_swap(d, i, min);
+		i = min;
+	}
+}
+
+/*
+ * Add a Host that has just been spawned to the running heap.
+ */
+static void
+dashboard_push(Host *host)
+{
+	assert(dashboard != NULL);
+	assert(host != NULL);
+	assert(host->cp->dashboard_idx == -1);
+	assert(dashboard->num_running <= opts.max_jobs);
+
+	int i = dashboard->num_running++;
+
+	dashboard->running[i] = host;
+	host->cp->dashboard_idx = i;
+	dashboard_fix(dashboard, i);
+}
+
+/*
+ * Count a Host that is done, removing it from the running heap.
+ */
+static void
+dashboard_done(Host *host)
+{
+	assert(dashboard != NULL);
+	assert(host != NULL);
+
+	Dashboard *d = dashboard;
+	int i = host->cp->dashboard_idx;
+
+	if (i >= 0) {
+		int last = --d->num_running;
+
+		if (i != last) {
+			dashboard_swap(d, i, last);
+			dashboard_fix(d, i);
+		}
+		host->cp->dashboard_idx = -1;
+	}
+
+	d->done++;
+	if (host->cp->exit_code != 0) {
+		d->failed++;
+	}
+}
+
+/*
+ * Compare 2 running hosts by their start time for sorting.
+ */
+static int
+dashboard_compare(const void *a, const void *b)
+{
+	const Host *ha = *(Host * const *)a;
+	const Host *hb = *(Host * const *)b;
+
+	return (ha->cp->started_time > hb->cp->started_time) -
+	    (ha->cp->started_time < hb->cp->started_time);
+}
+
+/*
+ * Draw the dashboard: overall progress, throughput and the oldest running
+ * hosts.  Only the lines that changed since the last frame are written (in a
+ * single write), so a frame costs the same however many hosts finished.
+ */
+static void
+dashboard_draw(long now)
+{
+	assert(dashboard != NULL);
+
+	Dashboard *d = dashboard;
+	char lines[DASHBOARD_LINES][DASHBOARD_LINE_MAX];
+	char out[DASHBOARD_LINES * (DASHBOARD_LINE_MAX + 16)];
+	Host *oldest[(1 << DASHBOARD_OLDEST) - 1];
+	int num_oldest = 0;
+	int remaining = d->num_hosts - d->done - d->num_running;
+	double elapsed = (now - d->started_time) / 1000.0;
+	double rate = elapsed > 0 ? d->done / elapsed : 0;
+	size_t len = 0;
+
+	snprintf(lines[0], DASHBOARD_LINE_MAX,
+	    "[%s%s%s] finished %s%d%s/%s%d%s (%s%d%s failed, %s%.1f%%%s), "
+	    "%s%d%s running, %s%d%s remaining",
+	    colors.cyan, PROG_NAME, colors.reset,
+	    colors.magenta, d->done, colors.reset,
+	    colors.magenta, d->num_hosts, colors.reset,
+	    d->failed > 0 ? colors.red : colors.magenta, d->failed,
+	    colors.reset,
+	    colors.magenta, d->done > 0 ? 100.0 * d->failed / d->done : 0.0,
+	    colors.reset,
+	    colors.magenta, d->num_running, colors.reset,
+	    colors.magenta, remaining, colors.reset);
+
+	if (rate > 0 && d->done < d->num_hosts) {
+		snprintf(lines[1], DASHBOARD_LINE_MAX,
+		    "%s%.1f%s hosts/s, %s%.1f%s s elapsed, "
+		    "%s%.1f%s s remaining (eta)",
+		    colors.magenta, rate, colors.reset,
+		    colors.magenta, elapsed, colors.reset,
+		    colors.magenta, (d->num_hosts - d->done) / rate,
+		    colors.reset);
+	} else {
+		snprintf(lines[1], DASHBOARD_LINE_MAX,
+		    "%s%.1f%s hosts/s, %s%.1f%s s elapsed",
+		    colors.magenta, rate, colors.reset,
+		    colors.magenta, elapsed, colors.reset);
+	}
+
+	snprintf(lines[2], DASHBOARD_LINE_MAX, "%s",
+	    d->num_running > 0 ? "oldest running:" : "");
+
+	/*
+	 * the oldest DASHBOARD_OLDEST hosts are all within the first levels of
+	 * the heap, so only those need sorting
+	 */
+	for (int i = 0; i < d->num_running &&
+	    i < (int)(sizeof (oldest) / sizeof (oldest[0])); i++) {
+		oldest[num_oldest++] = d->running[i];
+	}
+	qsort(oldest, num_oldest, sizeof (Host *), dashboard_compare);
+
+	for (int i = 0; i < DASHBOARD_OLDEST; i++) {
+		char *line = lines[3 + i];
+		Host *h;
+
+		if (i >= num_oldest) {
+			line[0] = '\0';
+			continue;
+		}
+
+		h = oldest[i];
+		snprintf(line, DASHBOARD_LINE_MAX,
+		    "--> %s%6.1f%s s %s%.*s%s",
+		    colors.magenta, (now - h->cp->started_time) / 1000.0,
+		    colors.reset, colors.cyan,
+		    d->width > 16 ? d->width - 16 : 1, h->name, colors.reset);
+	}
+
+	// move back up to the first line of the last frame
+	if (d->drawn) {
+		len += snprintf(out + len, sizeof (out) - len, "\033[%dA",
+		    DASHBOARD_LINES);
+	}
+
+	// rewrite the changed lines, skipping over the others
+	for (int i = 0; i < DASHBOARD_LINES; i++) {
+		if (!d->drawn || strcmp(lines[i], d->lines[i]) != 0) {
+			len += snprintf(out + len, sizeof (out) - len,
+			    "\r%s\033[K", lines[i]);
+			memcpy(d->lines[i], lines[i], DASHBOARD_LINE_MAX);
+		}
+		len += snprintf(out + len, sizeof (out) - len, "\n");
+	}
+	assert(len < sizeof (out));
+
+	fflush(stdout);
+	if (write(STDOUT_FILENO, out, len) < (ssize_t)len) {
+		err(3, "write failed");
+	}
+
+	d->drawn = true;
+	d->next_draw = now + DASHBOARD_INTERVAL;
+}
+
+/*
+ * Free the Dashboard.
+ */
+static void
+dashboard_destroy(Dashboard *d)
+{
+	if (d == NULL) {
+		return;
+	}
+
+	free(d->running);
+	free(d);
+}
+
+/*
+ * Print the header for a given host.
+ */
+static void
+print_host_header(Host *host)
+{
+	assert(host != NULL);
+
+	printf("[%s%s%s]", colors.cyan, host->name, colors.reset);
+}
+
+/*
+ * Given a Host object and a buffer of a suitable size, fill the buffer with
+ * the required arguments to exec a child process.
+ */
+static void
+build_ssh_command(Host *host, char **command, int size)
+{
+	assert(host != NULL);
+	assert(command != NULL);
+	assert(size > 0);
+
+	char *jump_array[] = {"-J", NULL, NULL};
+	char *name_array[] = {host->name, NULL};
+	int idx = 0;
+
+	// run through the jump host picked for this run (`--jump`)
+	if (host->cp->jump != NULL) {
+		jump_array[1] = (char *)host->cp->jump->spec;
+	} else {
+		jump_array[0] = NULL;
+	}
+
+	/*
+	 * construct SSH command like:
+	 * base_ssh_command + jump host + host name + remote_command
+	 * as a null terminated array called "command"
+	 */
+	char **items_arr[] = {
+		base_ssh_command,
+		jump_array,
+		name_array,
+		remote_command,
+		NULL
+	};
+	char ***items = items_arr;
+	while (*items != NULL) {
+		char **item = *items;
+		while (*item != NULL) {
+			char *arg = *item;
+			command[idx++] = arg;
+			if (idx >= size) {
+				errx(2, "too many arguments (<= %d)", size);
+			}
+
+			item++;
+		}
+
+		items++;
+	}
+
+	assert(idx < size);
+	assert(command[size - 1] == NULL);
+}
+
+/*
+ * Apply the scheduling options to a child process before it execs: its
+ * niceness (`--nice`), io priority (`--ioprio`) and the cpus it may run on
+ * (`--child-cpus`, or all of the cpus sshp could run on before `--loop-cpus`
+ * as children inherit the affinity of sshp).
+ */
+static void
+child_process_schedule(void)
+{
+	if (opts.nice != 0) {
+		errno = 0;
+		if (nice(opts.nice) == -1 && errno != 0) {
+			err(3, "nice %d", opts.nice);
+		}
+	}
+
+#ifdef __linux__
+	if (child_ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    child_ioprio) == -1) {
+		err(3, "ioprio_set");
+	}
+	if (child_cpus_set && sched_setaffinity(0, sizeof (child_cpus),
+	    &child_cpus) == -1) {
+		err(3, "sched_setaffinity");
+	}
+#endif
+}
+
+/*
+ * Fork and exec a subprocess.  This function is responsible for creating and
+ * initializing the stdio pipes and attaching them to the given Host object.
+ */
+static void
+spawn_child_process(Host *host)
+{
+	assert(host != NULL);
+	assert(host->name != NULL);
+	assert(host->cp != NULL);
+
+	char *command[MAX_ARGS] = {NULL};
+	int stderr_fd[2];
+	int stdin_fd[2];
+	int stdio_fd[2];
+	int stdout_fd[2];
+	pid_t pid;
+
+	// build the ssh command
+	build_ssh_command(host, command, MAX_ARGS);
+
+	// sessions read their commands from a pipe
+	if (opts.session) {
+		make_pipe(stdin_fd);
+	}
+
+	// create the stdio pipes
+	if (single_output_pipe()) {
+		// join mode uses a shared stdout/stderr pipe
+		make_pipe(stdio_fd);
+	} else {
+		// all other modes use a pipe per stream
+		make_pipe(stdout_fd);
+		make_pipe(stderr_fd);
+	}
+
+	// fork the process
+	pid = fork();
+	if (pid == -1) {
+		err(3, "fork");
+	}
+
+	// in child
+	if (pid == 0) {
+		int *err_fd;
+		int *out_fd;
+
+		/*
+		 * lead a process group so it can be killed with its children
+		 * (only with --timeout, as only the foreground process group
+		 * can read from the terminal for ssh prompts)
+		 */
+		if (opts.timeout > 0 && setpgid(0, 0) == -1) {
+			err(3, "setpgid");
+		}
+
+		child_process_schedule();
+
+		if (single_output_pipe()) {
+			out_fd = stdio_fd;
+			err_fd = stdio_fd;
+		} else {
+			out_fd = stdout_fd;
+			err_fd = stderr_fd;
+		}
+
+		if (dup2(out_fd[PIPE_WRITE_END], STDOUT_FILENO) == -1) {
+			err(3, "dup2 stdout");
+		}
+		if (dup2(err_fd[PIPE_WRITE_END], STDERR_FILENO) == -1) {
+			err(3, "dup2 stderr");
+		}
+
+		/*
+		 * the remote shell should block waiting for commands, and
+		 * block instead of failing when its output pipes are full
+		 * (which they also are while paused by --stream-lines)
+		 */
+		if (opts.session) {
+			if (dup2(stdin_fd[PIPE_READ_END], STDIN_FILENO) == -1) {
+				err(3, "dup2 stdin");
+			}
+			if (fcntl(STDIN_FILENO, F_SETFL, 0) == -1) {
+				err(3, "set stdin blocking");
+			}
+		}
+		if ((opts.session || opts.stream_lines) &&
+		    (fcntl(STDOUT_FILENO, F_SETFL, 0) == -1 ||
+		    fcntl(STDERR_FILENO, F_SETFL, 0) == -1)) {
+			err(3, "set stdio blocking");
+		}
+
+		execvp(command[0], command);
+		err(3, "exec");
+	}
+
+	// in parent
+
+	// also set the group here so it exists before any signal is sent
+	if (opts.timeout > 0 && setpgid(pid, pid) == -1 && errno != EACCES) {
+		err(3, "setpgid %d", pid);
+	}
+
+	// close write ends and save read ends
+	if (single_output_pipe()) {
+		close(stdio_fd[PIPE_WRITE_END]);
+		host->cp->stdio_fd = stdio_fd[PIPE_READ_END];
+	} else {
+		close(stdout_fd[PIPE_WRITE_END]);
+		close(stderr_fd[PIPE_WRITE_END]);
+		host->cp->stdout_fd = stdout_fd[PIPE_READ_END];
+		host->cp->stderr_fd = stderr_fd[PIPE_READ_END];
+	}
+	if (opts.session) {
+		close(stdin_fd[PIPE_READ_END]);
+		host->cp->stdin_fd = stdin_fd[PIPE_WRITE_END];
+	}
+
+	// save data
+	host->cp->pid = pid;
+	host->cp->started_time = monotonic_time_ms();
+	host->cp->state = CP_STATE_RUNNING;
+
+	DEBUG("%s%d%s %s%s%s spawned\n",
+	    colors.magenta, host->cp->pid, colors.reset,
+	    colors.cyan, host->name, colors.reset);
+}
+
+/*
+ * Register a specific fd to the fdwatcher..
+ */
+static void
+register_child_process_fd(Host *host, enum PipeType type)
+{
+	FdEvent *fdev = fdev_create(host, type);
+
+	assert(fdev->fd >= 0);
+	fdwatcher_add(fdw, fdev->fd, fdev);
+}
+
+/*
+ * Given a Host object that has had its child process spawned add both of its
+ * pipes fds to the fdwatcher for events.
+ */
+static void
+register_child_process_fds(Host *host)
+{
+	assert(host != NULL);
+
+	if (single_output_pipe()) {
+		register_child_process_fd(host, PIPE_STDIO);
+	} else {
+		register_child_process_fd(host, PIPE_STDOUT);
+		register_child_process_fd(host, PIPE_STDERR);
+	}
+}
+
+/*
+ * Print output read from a Host in group mode, with the host header first if
+ * the last output printed was from a different host.
+ */
+static void
+print_group_data(Host *host, const char *color, const char *buf, int bytes)
+{
+	assert(host != NULL);
+	assert(color != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	// processing a new host from last time
+	if (last_group_host != host) {
+		// print a newline if needed
+		if (!newline_printed) {
+			printf("\n");
+		}
+
+		// print the host name
+		if (!opts.anonymous) {
+			print_host_header(host);
+			printf("\n");
+		}
+	}
+
+	// write the fd data to stdout
+	printf("%s", color);
+	fflush(stdout);
+	if (write(STDOUT_FILENO, buf, bytes) < bytes) {
+		err(3, "write failed");
+	}
+	printf("%s", colors.reset);
+
+	// check if a newline was printed, save the last host
+	newline_printed = buf[bytes - 1] == '\n';
+	last_group_host = host;
+}
+
+/*
+ * Hold back output read from a Host until every host before it is done
+ * (`--ordered`).  Output is held in memory until ORDERED_MAX_HELD bytes are
+ * held for all hosts, after which it is spilled to an (unlinked) temporary
+ * file for the host - and all of its later output too, to keep it in order.
+ */
+static void
+ordered_hold(Host *host, enum PipeType type, const char *buf, size_t len)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(buf != NULL);
+	assert(len <= BUFSIZ);
+
+	ChildProcess *cp = host->cp;
+	HeldChunk chunk = {type, len};
+	Capture *held = &cp->held;
+
+	if (cp->spill == NULL &&
+	    ordered_held + sizeof (chunk) + len <= ORDERED_MAX_HELD) {
+		while (held->len + sizeof (chunk) + len > held->size) {
+			held->size = held->size > 0 ? held->size * 2 : BUFSIZ;
+			held->data = realloc(held->data, held->size);
+			if (held->data == NULL) {
+				err(3, "realloc held output");
+			}
+		}
+		memcpy(held->data + held->len, &chunk, sizeof (chunk));
+		memcpy(held->data + held->len + sizeof (chunk), buf, len);
+		held->len += sizeof (chunk) + len;
+		ordered_held += sizeof (chunk) + len;
+		return;
+	}
+
+	if (cp->spill == NULL) {
+		DEBUG("%s%s%s spilling output to disk\n",
+		    colors.cyan, host->name, colors.reset);
+		cp->spill = tmpfile();
+		if (cp->spill == NULL) {
+			err(3, "tmpfile");
+		}
+	}
+	if (fwrite(&chunk, sizeof (chunk), 1, cp->spill) != 1 ||
+	    fwrite(buf, 1, len, cp->spill) != len) {
+		err(3, "write held output");
+	}
+}
+
+/*
+ * Print (and free) all of the output held back for a Host.
+ */
+static void
+ordered_release(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+	Capture *held = &cp->held;
+	HeldChunk chunk;
+	char buf[BUFSIZ];
+	size_t off = 0;
+
+	// output held in memory comes first
+	while (off < held->len) {
+		memcpy(&chunk, held->data + off, sizeof (chunk));
+		off += sizeof (chunk);
+		print_group_data(host, chunk.type == PIPE_STDERR ?
+		    colors.red : colors.green, held->data + off, chunk.len);
+		off += chunk.len;
+	}
+	ordered_held -= held->len;
+	free(held->data);
+	memset(held, 0, sizeof (*held));
+
+	if (cp->spill == NULL) {
+		return;
+	}
+
+	rewind(cp->spill);
+	while (fread(&chunk, sizeof (chunk), 1, cp->spill) == 1) {
+		assert(chunk.len <= sizeof (buf));
+		if (fread(buf, 1, chunk.len, cp->spill) != chunk.len) {
+			err(3, "read held output");
+		}
+		print_group_data(host, chunk.type == PIPE_STDERR ?
+		    colors.red : colors.green, buf, chunk.len);
+	}
+	if (ferror(cp->spill)) {
+		err(3, "read held output");
+	}
+	fclose(cp->spill);
+	cp->spill = NULL;
+}
+
+/*
+ * Append bytes to the output kept for a Host with `--block`, taking chunks
+ * from the pool as needed.
+ */
+static void
+block_append_bytes(ChildProcess *cp, const char *buf, size_t len)
+{
+	assert(cp != NULL);
+	assert(buf != NULL);
+
+	while (len > 0) {
+		BlockChunk *chunk = cp->block_tail;
+		size_t n;
+
+		// start a new chunk
+		if (chunk == NULL || chunk->len == BLOCK_CHUNK_SIZE) {
+			if (block_pool != NULL) {
+				chunk = block_pool;
+				block_pool = chunk->next;
+			} else {
+				chunk = safe_malloc(sizeof (BlockChunk),
+				    "BlockChunk");
+			}
+			chunk->next = NULL;
+			chunk->len = 0;
+
+			if (cp->block_tail == NULL) {
+				cp->block_head = chunk;
+			} else {
+				cp->block_tail->next = chunk;
+			}
+			cp->block_tail = chunk;
+		}
+
+		n = BLOCK_CHUNK_SIZE - chunk->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(chunk->data + chunk->len, buf, n);
+		chunk->len += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Keep output read from a Host to be printed once it is done (`--block`).
+ * The color codes are kept with the output, only when the color changes.
+ */
+static void
+block_append(Host *host, const char *color, const char *buf, size_t len)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(color != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	if (cp->block_color != color) {
+		block_append_bytes(cp, color, strlen(color));
+		cp->block_color = color;
+	}
+	block_append_bytes(cp, buf, len);
+}
+
+/*
+ * Write all of the given buffers to stdout (using as few `writev` calls as
+ * possible).  The buffers are modified as they are written.
+ */
+static void
+write_all_iov(struct iovec *iov, int iovcnt)
+{
+	assert(iov != NULL);
+
+	while (iovcnt > 0) {
+		ssize_t written = writev(STDOUT_FILENO, iov, iovcnt);
+
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(3, "writev failed");
+		}
+
+		// skip over what was written
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+/*
+ * Print all of the output kept for a Host that is done with `--block`, with
+ * a single host header, and return its chunks to the pool.
+ */
+static void
+block_flush(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+	struct iovec iov[BLOCK_MAX_IOV];
+	char header[512];
+	char footer[32];
+	int iovcnt = 0;
+	bool newline;
+
+	if (cp->block_head == NULL) {
+		return;
+	}
+
+	// end with the color reset and a newline if the output didn't have one
+	newline = cp->block_tail->len > 0 &&
+	    cp->block_tail->data[cp->block_tail->len - 1] == '\n';
+	snprintf(footer, sizeof (footer), "%s%s", colors.reset,
+	    newline ? "" : "\n");
+
+	if (!opts.anonymous) {
+		snprintf(header, sizeof (header), "[%s%s%s]\n",
+		    colors.cyan, host->name, colors.reset);
+		iov[iovcnt].iov_base = header;
+		iov[iovcnt].iov_len = strlen(header);
+		iovcnt++;
+	}
+
+	fflush(stdout);
+	while (cp->block_head != NULL) {
+		BlockChunk *chunk = cp->block_head;
+
+		iov[iovcnt].iov_base = chunk->data;
+		iov[iovcnt].iov_len = chunk->len;
+		iovcnt++;
+
+		cp->block_head = chunk->next;
+		chunk->next = block_pool;
+		block_pool = chunk;
+
+		// the chunks aren't reused until the next block
+		if (iovcnt == BLOCK_MAX_IOV) {
+			write_all_iov(iov, iovcnt);
+			iovcnt = 0;
+		}
+	}
+	iov[iovcnt].iov_base = footer;
+	iov[iovcnt].iov_len = strlen(footer);
+	iovcnt++;
+	write_all_iov(iov, iovcnt);
+
+	cp->block_tail = NULL;
+	cp->block_color = NULL;
+	newline_printed = true;
+}
+
+/*
+ * Mark a Host that failed its reachability probe as done and report it.  The
+ * host is given the same exit code ssh would have used had it failed to
+ * connect.
+ */
+static void
+probe_fail(Host *host, const char *reason)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(reason != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	cp->exit_code = SSH_CONNECT_ERROR;
+	cp->pid = -2;
+	cp->finished_time = monotonic_time_ms();
+	cp->state = CP_STATE_DONE;
+	if (cp->started_time < 0) {
+		cp->started_time = cp->finished_time;
+	}
+
+	// chop off the domain portion of the name if -t
+	host_trim(host);
+
+	if (dashboard != NULL) {
+		dashboard_done(host);
+	}
+
+	DEBUG("%s%s%s unreachable: %s\n",
+	    colors.cyan, host->name, colors.reset, reason);
+
+	// join mode groups unreachable hosts by their failure reason
+	if (opts.mode == MODE_JOIN) {
+		char msg[256];
+
+		snprintf(msg, sizeof (msg), "unreachable: %s\n", reason);
+		cp->output.len = strlen(msg);
+		cp->output.data = strdup(msg);
+		if (cp->output.data == NULL) {
+			err(3, "strdup probe output");
+		}
+		cp->digest = hash_bytes(cp->output.data, cp->output.len);
+		return;
+	}
+
+	if (opts.silent) {
+		return;
+	}
+
+	// printed in order like any other output
+	if (opts.ordered) {
+		char msg[256];
+
+		snprintf(msg, sizeof (msg), "unreachable: %s\n", reason);
+		ordered_hold(host, PIPE_STDERR, msg, strlen(msg));
+		return;
+	}
+
+	if (!newline_printed) {
+		printf("\n");
+		newline_printed = true;
+	}
+
+	if (!opts.anonymous) {
+		print_host_header(host);
+		printf(" ");
+	}
+	printf("%sunreachable: %s%s\n", colors.red, reason, colors.reset);
+
+	last_group_host = NULL;
+}
+
+/*
+ * Push a Host that passed its reachability probe onto the queue of hosts
+ * waiting to be spawned.
+ */
+static void
+probe_queue_push(Host *host)
+{
+	assert(host != NULL);
+	assert(probe_queue_len < opts.max_jobs);
+
+	int idx = (probe_queue_head + probe_queue_len) % opts.max_jobs;
+
+	host->cp->state = CP_STATE_READY;
+	probe_queue[idx] = host;
+	probe_queue_len++;
+}
+
+/*
+ * Pop the next Host to spawn off of the probe queue, or NULL if it is empty.
+ */
+static Host *
+probe_queue_pop(void)
+{
+	Host *host;
+
+	if (probe_queue_len == 0) {
+		return NULL;
+	}
+
+	host = probe_queue[probe_queue_head];
+	probe_queue_head = (probe_queue_head + 1) % opts.max_jobs;
+	probe_queue_len--;
+
+	return host;
+}
+
+/*
+ * Return the number of hosts in the probe window (either probing or waiting
+ * to be spawned).
+ */
+static int
+probe_window_size(void)
+{
+	return probe_slots_used + probe_queue_len;
+}
+
+/*
+ * Close the probe socket (if any) for the given Host and release its slot.
+ */
+static void
+probe_close(Host *host)
+{
+	assert(host != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	if (cp->probe_fd < 0) {
+		return;
+	}
+
+	assert(cp->probe_slot >= 0);
+
+	fdwatcher_remove_writable(fdw, cp->probe_fd);
+	close(cp->probe_fd);
+	cp->probe_fd = -1;
+
+	fdev_destroy(probe_slots[cp->probe_slot]);
+	probe_slots[cp->probe_slot] = NULL;
+	probe_slots_used--;
+	cp->probe_slot = -1;
+}
+
+/*
+ * Try connecting to the remaining addresses for the given Host, starting at
+ * `cp->probe_addr`, until one of them is in flight or accepts immediately.
+ *
+ * Returns true if the host was found unreachable (and is now done).
+ */
+static bool
+probe_connect(Host *host, int error)
+{
+	assert(host != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	for (; cp->probe_addr != NULL;
+	    cp->probe_addr = cp->probe_addr->ai_next) {
+		struct addrinfo *ai = cp->probe_addr;
+		FdEvent *fdev;
+		int fd;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			error = errno;
+			continue;
+		}
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			err(3, "set probe socket nonblocking");
+		}
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+			err(3, "set probe socket cloexec");
+		}
+
+		// connected right away (likely localhost)
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			close(fd);
+			probe_queue_push(host);
+			return false;
+		}
+
+		if (errno != EINPROGRESS) {
+			error = errno;
+			close(fd);
+			continue;
+		}
+
+		// connection in flight - wait for it to become writable
+		cp->probe_fd = fd;
+		for (cp->probe_slot = 0; probe_slots[cp->probe_slot] != NULL;
+		    cp->probe_slot++) {
+			assert(cp->probe_slot < opts.max_jobs);
+		}
+		fdev = fdev_create(host, PIPE_PROBE);
+		assert(fdev->fd >= 0);
+		probe_slots[cp->probe_slot] = fdev;
+		probe_slots_used++;
+
+		if (fdwatcher_add_writable(fdw, fd, fdev) == -1) {
+			err(3, "fdwatcher_add_writable");
+		}
+
+		return false;
+	}
+
+	// all addresses have been exhausted
+	freeaddrinfo(cp->probe_addrs);
+	cp->probe_addrs = NULL;
+	probe_fail(host, strerror(error));
+
+	return true;
+}
+
+/*
+ * Start a reachability probe for the given Host by resolving its name and
+ * connecting to the ssh port.
+ *
+ * Returns true if the host was found unreachable (and is now done).
+ */
+static bool
+probe_start(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(host->cp->state == CP_STATE_READY);
+
+	ChildProcess *cp = host->cp;
+	struct addrinfo hints;
+	char *port = opts.port != NULL ? opts.port : DEFAULT_SSH_PORT;
+	char *name = strrchr(host->name, '@');
+	int ret;
+
+	// skip over "user@" if present
+	name = name != NULL ? name + 1 : host->name;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	cp->state = CP_STATE_PROBING;
+	cp->started_time = monotonic_time_ms();
+	cp->probe_deadline = cp->started_time + opts.probe_timeout;
+
+	/*
+	 * only the connect is non-blocking: resolving the name blocks the loop
+	 * (there is no portable asynchronous getaddrinfo)
+	 */
+	ret = getaddrinfo(name, port, &hints, &cp->probe_addrs);
+	if (ret != 0) {
+		cp->probe_addrs = NULL;
+		probe_fail(host, gai_strerror(ret));
+		return true;
+	}
+
+	cp->probe_addr = cp->probe_addrs;
+	return probe_connect(host, EHOSTUNREACH);
+}
+
+/*
+ * Called when a probe socket becomes writable (its connect has finished).
+ *
+ * Returns true if the host was found unreachable (and is now done).
+ */
+static bool
+probe_check(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->type == PIPE_PROBE);
+
+	Host *host = fdev->host;
+	ChildProcess *cp = host->cp;
+	socklen_t len = sizeof (int);
+	int error = 0;
+
+	if (getsockopt(cp->probe_fd, SOL_SOCKET, SO_ERROR, &error,
+	    &len) == -1) {
+		error = errno;
+	}
+
+	probe_close(host);
+
+	if (error == 0) {
+		freeaddrinfo(cp->probe_addrs);
+		cp->probe_addrs = NULL;
+		probe_queue_push(host);
+		return false;
+	}
+
+	// try the next address
+	cp->probe_addr = cp->probe_addr->ai_next;
+	return probe_connect(host, error);
+}
+
+/*
+ * Fail any probes that have gone past their deadline.
+ *
+ * Returns the number of hosts that were found unreachable.
+ */
+static int
+probe_expire(long now)
+{
+	int failed = 0;
+
+	for (int i = 0; i < opts.max_jobs && probe_slots_used > 0; i++) {
+		FdEvent *fdev = probe_slots[i];
+		Host *host;
+
+		if (fdev == NULL || fdev->host->cp->probe_deadline > now) {
+			continue;
+		}
+
+		host = fdev->host;
+		probe_close(host);
+		freeaddrinfo(host->cp->probe_addrs);
+		host->cp->probe_addrs = NULL;
+		probe_fail(host, "probe timed out");
+		failed++;
+	}
+
+	return failed;
+}
+
+/*
+ * Add a running Host to the end of a RunQueue.
+ */
+static void
+run_queue_push(RunQueue *q, Host *host)
+{
+	assert(q != NULL);
+	assert(host != NULL);
+	assert(host->cp->state == CP_STATE_RUNNING);
+
+	struct run_queue_entry *e;
+
+	// grow the queue, unwrapping the entries that wrapped around
+	if (q->len == q->size) {
+		size_t size = q->size > 0 ? q->size * 2 : 64;
+
+		q->entries = realloc(q->entries,
+		    sizeof (struct run_queue_entry) * size);
+		if (q->entries == NULL) {
+			err(3, "realloc run queue");
+		}
+		for (size_t i = 0; i < q->head; i++) {
+			q->entries[q->size + i] = q->entries[i];
+		}
+		q->size = size;
+	}
+
+	e = &q->entries[(q->head + q->len) % q->size];
+	e->host = host;
+	e->started_time = host->cp->started_time;
+	q->len++;
+}
+
+/*
+ * Get the Host at the head of a RunQueue, dropping the hosts that aren't
+ * running the same run anymore.  Returns NULL if the queue is empty.
+ */
+static Host *
+run_queue_head(RunQueue *q)
+{
+	assert(q != NULL);
+
+	while (q->len > 0) {
+		struct run_queue_entry *e = &q->entries[q->head];
+
+		if (e->host->cp->state == CP_STATE_RUNNING &&
+		    e->host->cp->started_time == e->started_time) {
+			return e->host;
+		}
+
+		q->head = (q->head + 1) % q->size;
+		q->len--;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the Host at the head of a RunQueue.
+ */
+static void
+run_queue_pop(RunQueue *q)
+{
+	assert(q != NULL);
+	assert(q->len > 0);
+
+	q->head = (q->head + 1) % q->size;
+	q->len--;
+}
+
+/*
+ * Get the monotonic time (in ms) a running host is next due to be killed
+ * (`--timeout`), or -1 if none are.
+ */
+static long
+timeout_deadline(void)
+{
+	Host *host;
+	long deadline = -1;
+
+	if ((host = run_queue_head(&timeout_queue)) != NULL) {
+		deadline = host->cp->started_time + opts.timeout;
+	}
+	if ((host = run_queue_head(&kill_queue)) != NULL &&
+	    (deadline == -1 || host->cp->kill_deadline < deadline)) {
+		deadline = host->cp->kill_deadline;
+	}
+
+	return deadline;
+}
+
+/*
+ * Kill the hosts that have run for longer than `--timeout` with SIGTERM, and
+ * the ones that haven't exited KILL_GRACE after that with SIGKILL.  They are
+ * reaped as usual once their pipes close.
+ */
+static void
+timeout_expire(long now)
+{
+	Host *host;
+
+	while ((host = run_queue_head(&timeout_queue)) != NULL &&
+	    host->cp->started_time + opts.timeout <= now) {
+		run_queue_pop(&timeout_queue);
+
+		host->cp->timed_out = true;
+		host->cp->kill_deadline = now + KILL_GRACE;
+		kill_child_process(host, SIGTERM);
+		run_queue_push(&kill_queue, host);
+	}
+
+	while ((host = run_queue_head(&kill_queue)) != NULL &&
+	    host->cp->kill_deadline <= now) {
+		run_queue_pop(&kill_queue);
+
+		kill_child_process(host, SIGKILL);
+	}
+}
+
+/*
+ * Pick the `--jump` host to run the next host through: the one that should
+ * get it through soonest, estimated as its recent latency times the hosts it
+ * would then be running (jump hosts without a latency yet are taken to be
+ * average).  Jump hosts that are out of rotation are only picked if no other
+ * one can be, and ones at `--jump-max` never are.  Returns NULL if every jump
+ * host is at its limit.
+ */
+static JumpHost *
+jump_pick(long now)
+{
+	JumpHost *best = NULL;
+	double best_cost = 0;
+	bool best_down = false;
+	double average = 0;
+	int num_known = 0;
+
+	for (int i = 0; i < num_jumps; i++) {
+		if (jumps[i].latency > 0) {
+			average += jumps[i].latency;
+			num_known++;
+		}
+	}
+	average = num_known > 0 ? average / num_known : 1;
+
+	for (int i = 0; i < num_jumps; i++) {
+		JumpHost *j = &jumps[i];
+		bool down = j->down_until > now;
+		double cost;
+
+		if (opts.jump_max > 0 && j->outstanding >= opts.jump_max) {
+			continue;
+		}
+
+		cost = (j->outstanding + 1) *
+		    (j->latency > 0 ? j->latency : average);
+		if (best == NULL || (best_down && !down) ||
+		    (down == best_down && cost < best_cost)) {
+			best = j;
+			best_cost = cost;
+			best_down = down;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Account for a Host that is about to be spawned through the given jump host.
+ */
+static void
+jump_start(Host *host, JumpHost *j)
+{
+	assert(host != NULL);
+	assert(j != NULL);
+
+	host->cp->jump = j;
+	j->outstanding++;
+	j->runs++;
+
+	DEBUG("%s%s%s via %s%s%s (%s%d%s running)\n",
+	    colors.cyan, host->name, colors.reset,
+	    colors.green, j->spec, colors.reset,
+	    colors.magenta, j->outstanding, colors.reset);
+}
+
+/*
+ * Account for a Host run through a jump host that has been reaped.  A
+ * connection error counts against the jump host, taking it out of rotation for
+ * JUMP_COOLDOWN after JUMP_MAX_FAILURES in a row, so the hosts that follow
+ * fail over to the others.  Otherwise the time to its first output (or exit)
+ * is averaged into the latency of the jump host.
+ */
+static void
+jump_done(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp->jump != NULL);
+	assert(host->cp->jump->outstanding > 0);
+
+	ChildProcess *cp = host->cp;
+	JumpHost *j = cp->jump;
+	long latency;
+
+	j->outstanding--;
+
+	// a host killed for taking too long says nothing about the jump host
+	if (cp->timed_out) {
+		return;
+	}
+
+	if (cp->exit_code == SSH_CONNECT_ERROR) {
+		j->failures++;
+		if (j->failures >= JUMP_MAX_FAILURES) {
+			j->down_until = cp->finished_time + JUMP_COOLDOWN;
+			DEBUG("%s%s%s out of rotation (%s%d%s errors)\n",
+			    colors.green, j->spec, colors.reset,
+			    colors.magenta, j->failures, colors.reset);
+		}
+		return;
+	}
+
+	latency = (cp->first_output_time >= 0 ?
+	    cp->first_output_time : cp->finished_time) - cp->started_time;
+	if (latency < 1) {
+		latency = 1;
+	}
+
+	j->failures = 0;
+	j->down_until = 0;
+	if (j->latency > 0) {
+		j->latency += JUMP_LATENCY_WEIGHT * (latency - j->latency);
+	} else {
+		j->latency = latency;
+	}
+}
+
+/*
+ * Calculate how long (in ms) fdwatcher_wait should wait for events before a
+ * timer needs to be serviced.  `can_spawn` is whether there is a free job slot
+ * for a host waiting to run again in watch mode.
+ */
+static int
+loop_timeout(long now, bool can_spawn)
+{
+	long timeout = FDW_WAIT_TIMEOUT;
+
+	// the next host to run again in watch mode
+	if (can_spawn && watch_queue_len > 0) {
+		timeout = watch_queue[watch_queue_head]->cp->next_run - now;
+		if (timeout < 0) {
+			timeout = 0;
+		}
+	}
+
+	// the next host to kill with --timeout
+	if (opts.timeout > 0) {
+		long deadline = timeout_deadline();
+		long delta = deadline - now;
+
+		if (delta < 0) {
+			delta = 0;
+		}
+		if (deadline >= 0 &&
+		    (timeout == FDW_WAIT_TIMEOUT || delta < timeout)) {
+			timeout = delta;
+		}
+	}
+
+	// the next --dashboard redraw
+	if (dashboard != NULL) {
+		long delta = dashboard->next_draw - now;
+
+		if (delta < 0) {
+			delta = 0;
+		}
+		if (timeout == FDW_WAIT_TIMEOUT || delta < timeout) {
+			timeout = delta;
+		}
+	}
+
+	// the end of the current --collapse window
+	if (collapse != NULL && collapse->deadline >= 0) {
+		long delta = collapse->deadline - now;
+
+		if (delta < 0) {
+			delta = 0;
+		}
+		if (timeout == FDW_WAIT_TIMEOUT || delta < timeout) {
+			timeout = delta;
+		}
+	}
+
+	for (int i = 0; i < opts.max_jobs && probe_slots_used > 0; i++) {
+		FdEvent *fdev = probe_slots[i];
+		long delta;
+
+		if (fdev == NULL) {
+			continue;
+		}
+
+		delta = fdev->host->cp->probe_deadline - now;
+		if (delta < 0) {
+			delta = 0;
+		}
+		if (timeout == FDW_WAIT_TIMEOUT || delta < timeout) {
+			timeout = delta;
+		}
+	}
+
+	return timeout;
+}
+
+/*
+ * Print the exited message for the given Host if opts.exit_codes or opts.debug
+ * is set.  `pid` is the pid that was reaped, or -1 if the result was replayed
+ * from the cache.
+ */
+static void
+print_exit_message(Host *host, pid_t pid)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+	char *code_color = cp->exit_code == 0 ? colors.green : colors.red;
+	long delta = cp->finished_time - cp->started_time;
+
+	if (!opts.exit_codes && !opts.debug) {
+		return;
+	}
+
+	// check if a newline is needed
+	if (!newline_printed) {
+		printf("\n");
+		newline_printed = true;
+	}
+
+	// print the exit status
+	if (opts.debug) {
+		printf("[%s%s%s] ", colors.cyan, PROG_NAME, colors.reset);
+		if (pid > 0) {
+			printf("%s%d%s ", colors.magenta, pid, colors.reset);
+		}
+		printf("%s%s%s exited: %s%d%s ",
+		    colors.cyan, host->name, colors.reset,
+		    code_color, cp->exit_code, colors.reset);
+	} else {
+		assert(opts.exit_codes);
+		printf("[%s%s%s] exited: %s%d%s ",
+		    colors.cyan, host->name, colors.reset,
+		    code_color, cp->exit_code, colors.reset);
+	}
+
+	if (cp->cached) {
+		printf("(%scached%s)\n", colors.magenta, colors.reset);
+	} else if (cp->timed_out) {
+		printf("(%s%ld%s ms, %stimed out%s)\n",
+		    colors.magenta, delta, colors.reset,
+		    colors.red, colors.reset);
+	} else {
+		printf("(%s%ld%s ms)\n", colors.magenta, delta, colors.reset);
+	}
+}
+
+/*
+ * Call waitpid on the subprocess associated with the given Host object.  This
+ * function will reap the process, set the exit code and remove the pid from
+ * the Host object, and optionally print the exited message if opts.exit_codes
+ * or opts.debug is set.
+ */
+static void
+wait_for_child(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+	int status;
+	pid_t pid;
+
+	// reap the child, with the resources it used
+	pid = wait4(cp->pid, &status, 0, &cp->usage);
+
+	if (pid < 0) {
+		err(3, "wait4");
+	}
+	if (opts.stats) {
+		stats_add(host);
+	}
+
+	// set the host as closed (killed children exit like a shell reports)
+	cp->signaled = WIFSIGNALED(status);
+	cp->exit_code = cp->signaled ?
+	    128 + WTERMSIG(status) : WEXITSTATUS(status);
+	cp->pid = -2;
+	cp->finished_time = monotonic_time_ms();
+	cp->state = CP_STATE_DONE;
+
+	if (cp->jump != NULL) {
+		jump_done(host);
+	}
+	if (dashboard != NULL) {
+		dashboard_done(host);
+	}
+
+	// print the output kept with --block first
+	if (opts.block) {
+		block_flush(host);
+	}
+
+	// print the exit message (watch mode only prints it for changes)
+	cp->reaped_pid = pid;
+	if (opts.watch == 0 && !opts.ordered) {
+		print_exit_message(host, pid);
+	}
+}
+
+/*
+ * Print the output held back for the first host not done yet, and for every
+ * host after it that is done (with their exit messages), in the order of the
+ * hosts file.  Later output from the new first host is printed as it is read.
+ */
+static void
+ordered_advance(void)
+{
+	while (ordered_head != NULL) {
+		ordered_release(ordered_head);
+		if (ordered_head->cp->state != CP_STATE_DONE) {
+			return;
+		}
+
+		print_exit_message(ordered_head, ordered_head->cp->reaped_pid);
+		ordered_head = ordered_head->next;
+	}
+}
+
+/*
+ * Create an empty CollapseTable.
+ */
+static CollapseTable *
+collapse_create(void)
+{
+	CollapseTable *c = safe_malloc(sizeof (CollapseTable),
+	    "collapse_create");
+
+	c->arena_size = 4096;
+	c->arena_len = 0;
+	c->arena = safe_malloc(c->arena_size, "collapse arena");
+	c->lines_size = 64;
+	c->num_lines = 0;
+	c->lines = safe_malloc(sizeof (CollapsedLine) * c->lines_size,
+	    "collapse lines");
+	for (size_t i = 0; i < c->lines_size; i++) {
+		c->lines[i].hosts = NULL;
+		c->lines[i].hosts_size = 0;
+	}
+	c->num_slots = 128;
+	c->slots = calloc(c->num_slots, sizeof (size_t));
+	if (c->slots == NULL) {
+		err(3, "calloc collapse slots");
+	}
+	c->members_size = 128;
+	c->num_members = 0;
+	c->members = calloc(c->members_size, sizeof (struct collapse_member));
+	if (c->members == NULL) {
+		err(3, "calloc collapse members");
+	}
+	c->deadline = -1;
+
+	return c;
+}
+
+/*
+ * Double the number of slots in a CollapseTable and reinsert the lines.
+ */
+static void
+collapse_grow(CollapseTable *c)
+{
+	assert(c != NULL);
+
+	free(c->slots);
+	c->num_slots *= 2;
+	c->slots = calloc(c->num_slots, sizeof (size_t));
+	if (c->slots == NULL) {
+		err(3, "calloc collapse slots");
+	}
+
+	for (size_t i = 0; i < c->num_lines; i++) {
+		size_t idx = c->lines[i].hash & (c->num_slots - 1);
+
+		while (c->slots[idx] != 0) {
+			idx = (idx + 1) & (c->num_slots - 1);
+		}
+		c->slots[idx] = i + 1;
+	}
+}
+
+/*
+ * Find the CollapsedLine for the given line (and stream), adding it to the
+ * table if it hasn't been seen yet in this window.
+ */
+static CollapsedLine *
+collapse_find(CollapseTable *c, enum PipeType type, const char *line,
+	size_t len)
+{
+	assert(c != NULL);
+	assert(line != NULL);
+
+	uint64_t hash = hash_update(hash_bytes(line, len), &type,
+	    sizeof (type));
+	size_t idx = hash & (c->num_slots - 1);
+	CollapsedLine *cl;
+
+	// look for the line
+	while (c->slots[idx] != 0) {
+		cl = &c->lines[c->slots[idx] - 1];
+
+		if (cl->hash == hash && cl->type == type && cl->len == len &&
+		    memcmp(c->arena + cl->offset, line, len) == 0) {
+			return cl;
+		}
+
+		idx = (idx + 1) & (c->num_slots - 1);
+	}
+
+	// copy the line into the arena
+	while (c->arena_len + len + 1 > c->arena_size) {
+		c->arena_size *= 2;
+		c->arena = realloc(c->arena, c->arena_size);
+		if (c->arena == NULL) {
+			err(3, "realloc collapse arena");
+		}
+	}
+	memcpy(c->arena + c->arena_len, line, len);
+	c->arena[c->arena_len + len] = '\0';
+
+	// grow the lines (the host lists of old lines are reused)
+	if (c->num_lines == c->lines_size) {
+		c->lines_size *= 2;
+		c->lines = realloc(c->lines,
+		    sizeof (CollapsedLine) * c->lines_size);
+		if (c->lines == NULL) {
+			err(3, "realloc collapse lines");
+		}
+		for (size_t i = c->num_lines; i < c->lines_size; i++) {
+			c->lines[i].hosts = NULL;
+			c->lines[i].hosts_size = 0;
+		}
+	}
+
+	cl = &c->lines[c->num_lines];
+	cl->hash = hash;
+	cl->offset = c->arena_len;
+	cl->len = len;
+	cl->type = type;
+	cl->num_hosts = 0;
+
+	c->slots[idx] = c->num_lines + 1;
+	c->arena_len += len + 1;
+	c->num_lines++;
+
+	// keep the load factor under 1/2
+	if (c->num_lines * 2 > c->num_slots) {
+		collapse_grow(c);
+	}
+
+	return cl;
+}
+
+/*
+ * Add a Host to the set of hosts that printed a line in the current window.
+ * Returns false if the host has printed the line already.
+ */
+static bool
+collapse_member_add(CollapseTable *c, size_t line, Host *host)
+{
+	assert(c != NULL);
+	assert(host != NULL);
+
+	struct collapse_member *m;
+	size_t mask = c->members_size - 1;
+	size_t idx = hash_update(hash_bytes(&host, sizeof (host)), &line,
+	    sizeof (line)) & mask;
+
+	while (c->members[idx].host != NULL) {
+		m = &c->members[idx];
+		if (m->host == host && m->line == line) {
+			return false;
+		}
+		idx = (idx + 1) & mask;
+	}
+
+	c->members[idx].host = host;
+	c->members[idx].line = line;
+	c->num_members++;
+
+	// keep the load factor under 1/2
+	if (c->num_members * 2 > c->members_size) {
+		struct collapse_member *old = c->members;
+		size_t old_size = c->members_size;
+
+		c->members_size *= 2;
+		c->members = calloc(c->members_size,
+		    sizeof (struct collapse_member));
+		if (c->members == NULL) {
+			err(3, "calloc collapse members");
+		}
+		c->num_members = 0;
+		for (size_t i = 0; i < old_size; i++) {
+			if (old[i].host != NULL) {
+				collapse_member_add(c, old[i].line,
+				    old[i].host);
+			}
+		}
+		free(old);
+	}
+
+	return true;
+}
+
+/*
+ * Hold back a line printed by a Host until the end of the current window.
+ */
+static void
+collapse_add(CollapseTable *c, Host *host, enum PipeType type,
+	const char *line, size_t len)
+{
+	assert(c != NULL);
+	assert(host != NULL);
+
+	CollapsedLine *cl = collapse_find(c, type, line, len);
+
+	// start a new window
+	if (c->deadline == -1) {
+		c->deadline = monotonic_time_ms() + opts.collapse;
+	}
+
+	// a host repeating the line is only counted once
+	if (!collapse_member_add(c, cl - c->lines, host)) {
+		return;
+	}
+
+	if (cl->num_hosts == cl->hosts_size) {
+		cl->hosts_size = cl->hosts_size > 0 ? cl->hosts_size * 2 : 4;
+		cl->hosts = realloc(cl->hosts,
+		    sizeof (Host *) * cl->hosts_size);
+		if (cl->hosts == NULL) {
+			err(3, "realloc collapse hosts");
+		}
+	}
+	cl->hosts[cl->num_hosts++] = host;
+}
+
+/*
+ * Print every line held back in the current window (once each, with the
+ * number of hosts that printed it) and start over with an empty table.
+ */
+static void
+collapse_flush(CollapseTable *c)
+{
+	assert(c != NULL);
+
+	for (size_t i = 0; i < c->num_lines; i++) {
+		CollapsedLine *cl = &c->lines[i];
+		char *color = cl->type == PIPE_STDERR ?
+		    colors.red : colors.green;
+		Span line = {c->arena + cl->offset, cl->len};
+
+		assert(cl->num_hosts > 0);
+
+		if (opts.anonymous) {
+			// pass
+		} else if (cl->num_hosts == 1) {
+			print_host_header(cl->hosts[0]);
+			printf(" ");
+		} else {
+			printf("[%s%d hosts%s] ",
+			    colors.magenta, cl->num_hosts, colors.reset);
+		}
+
+		printf("%s", color);
+		print_span(&line);
+		printf("%s", colors.reset);
+	}
+
+	c->num_lines = 0;
+	c->arena_len = 0;
+	c->deadline = -1;
+	memset(c->slots, 0, sizeof (size_t) * c->num_slots);
+	c->num_members = 0;
+	memset(c->members, 0, sizeof (struct collapse_member) *
+	    c->members_size);
+}
+
+/*
+ * Free a CollapseTable.
+ */
+static void
+collapse_destroy(CollapseTable *c)
+{
+	if (c == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < c->lines_size; i++) {
+		free(c->lines[i].hosts);
+	}
+	free(c->lines);
+	free(c->slots);
+	free(c->members);
+	free(c->arena);
+	free(c);
+}
+
+/*
+ * Print a complete line with the host header and the output color.
+ *
+ * (the `write_line` handlers are used for line mode).
+ */
+static void
+write_line_header(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->buffer != NULL);
+
+	Span line = {fdev->buffer, fdev->offset};
+
+	printf("[%s%s%s] %s", colors.cyan, fdev->host->name, colors.reset,
+	    fdev->color);
+	print_span(&line);
+	printf("%s", colors.reset);
+}
+
+/*
+ * Print a complete line with the host header and no colors.
+ */
+static void
+write_line_header_plain(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->buffer != NULL);
+
+	Span line = {fdev->buffer, fdev->offset};
+
+	printf("[%s] ", fdev->host->name);
+	print_span(&line);
+}
+
+/*
+ * Print a complete line without the host header (`--anonymous`).
+ */
+static void
+write_line_anonymous(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->buffer != NULL);
+
+	Span line = {fdev->buffer, fdev->offset};
+
+	printf("%s", fdev->color);
+	print_span(&line);
+	printf("%s", colors.reset);
+}
+
+/*
+ * Print a complete line as it is.
+ */
+static void
+write_line_anonymous_plain(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->buffer != NULL);
+
+	Span line = {fdev->buffer, fdev->offset};
+
+	print_span(&line);
+}
+
+/*
+ * Print a complete line after the current timestamp (`--timestamps`).
+ */
+static void
+write_line_timestamp(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(timestamp_len > 0);
+
+	fwrite(timestamp, 1, timestamp_len, stdout);
+	handlers.write_line_body(fdev);
+}
+
+/*
+ * Handle a complete line by printing it.
+ */
+static void
+line_print(FdEvent *fdev)
+{
+	handlers.write_line(fdev);
+}
+
+/*
+ * Handle a complete line by aggregating its numbers (only stdout, or both
+ * streams with `--merge-stderr`, stderr is printed as usual).
+ */
+static void
+line_agg(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+
+	if (fdev->type == PIPE_STDOUT || fdev->type == PIPE_STDIO) {
+		agg_add_line(fdev->host, fdev->buffer);
+	} else {
+		handlers.write_line(fdev);
+	}
+}
+
+/*
+ * Handle a complete line by only counting it (`--top`).
+ */
+static void
+line_top(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+
+	top_add_line(fdev->host, fdev->buffer, fdev->offset);
+}
+
+/*
+ * Handle a complete line by holding it back to be printed at the end of the
+ * window (`--collapse`).
+ */
+static void
+line_collapse(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+
+	collapse_add(collapse, fdev->host, fdev->type, fdev->buffer,
+	    fdev->offset);
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in line mode.
+ */
+static void
+process_data_line(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->buffer != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	// loop data character-by-character
+	for (int i = 0; i < bytes; i++) {
+		char c = buf[i];
+
+		if (fdev->offset < opts.max_line_length) {
+			// buffer has room for character
+			fdev->buffer[fdev->offset] = c;
+			fdev->offset++;
+		} else if (fdev->offset == opts.max_line_length) {
+			// no more room, call it a newline
+			fdev->buffer[fdev->offset] = '\n';
+			fdev->offset++;
+		}
+
+		// got a newline! print it
+		if (c == '\n') {
+			assert(fdev->offset > 0);
+			assert(fdev->offset < opts.max_line_length + 2);
+
+			fdev->buffer[fdev->offset] = '\0';
+			handlers.line(fdev);
+			fdev->offset = 0;
+		}
+	}
+}
+
+/*
+ * Print the line buffered so far as part of a streamed line: the first chunk
+ * of a line is printed with the host header, later chunks are appended to it
+ * as they fill the buffer, until the chunk with the newline (`end`).
+ *
+ * Other hosts wait for the end of a partly printed line (see `stream_pause`),
+ * but anything else printed in between (the other stream of the same host, or
+ * an exit message) ends the line with a newline first.  The interrupted line
+ * then carries on under a new header.
+ */
+static void
+stream_write(FdEvent *fdev, bool end)
+{
+	assert(fdev != NULL);
+	assert(fdev->buffer != NULL);
+
+	// another host's line is in the way
+	if (stream_fdev != fdev && !newline_printed) {
+		printf("\n");
+		newline_printed = true;
+	}
+
+	if (fdev->streaming && stream_fdev == fdev && !newline_printed) {
+		// carry on with the line
+		Span chunk = {fdev->buffer, fdev->offset};
+
+		printf("%s", fdev->color);
+		print_span(&chunk);
+		printf("%s", colors.reset);
+	} else {
+		handlers.write_line(fdev);
+	}
+
+	fdev->offset = 0;
+	fdev->streaming = !end;
+	newline_printed = end;
+	stream_fdev = end ? NULL : fdev;
+}
+
+/*
+ * Stop reading a pipe until the line streamed by another host has ended, so
+ * the line isn't cut.  The line waiting to be printed stays in the buffer of
+ * the pipe, and the rest of the bytes read are held (at most one read), so no
+ * more than that is kept per pipe - the child blocks once its pipe is full.
+ * Output replayed from the cache has no pipe to stop, and cuts the line.
+ */
+static void
+stream_pause(FdEvent *fdev, const char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->fd >= 0);
+	assert(!fdev->paused);
+	assert(fdev->offset > 0);
+
+	if (bytes > 0) {
+		fdev->held = safe_malloc(bytes, "fdev->held");
+		memcpy(fdev->held, buf, bytes);
+		fdev->held_len = bytes;
+	}
+
+	if (fdwatcher_remove(fdw, fdev->fd) == -1) {
+		err(3, "fdwatcher_remove paused fd");
+	}
+
+	fdev->paused = true;
+	fdev->paused_next = NULL;
+	if (paused_tail != NULL) {
+		paused_tail->paused_next = fdev;
+	} else {
+		paused_head = fdev;
+	}
+	paused_tail = fdev;
+}
+
+/*
+ * Print the lines of the paused pipes (in the order they were paused) now
+ * that no line is being streamed, and read them again.  Stops early if one of
+ * them starts streaming a line of its own.
+ */
+static void
+stream_resume(void)
+{
+	while (paused_head != NULL && stream_fdev == NULL) {
+		FdEvent *fdev = paused_head;
+		char *held = fdev->held;
+		int held_len = fdev->held_len;
+
+		paused_head = fdev->paused_next;
+		if (paused_head == NULL) {
+			paused_tail = NULL;
+		}
+		fdev->paused = false;
+		fdev->paused_next = NULL;
+		fdev->held = NULL;
+		fdev->held_len = 0;
+
+		// the line (or first part of it) waiting in the buffer
+		stream_write(fdev, fdev->buffer[fdev->offset - 1] == '\n');
+
+		if (held != NULL) {
+			handlers.process(fdev, held, held_len);
+			free(held);
+		}
+
+		if (fdwatcher_add(fdw, fdev->fd, fdev) == -1) {
+			err(3, "fdwatcher_add resumed fd");
+		}
+	}
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in line mode with
+ * `--stream-lines`: lines longer than the buffer are printed a buffer at a
+ * time instead of being cut.
+ */
+static void
+process_data_line_stream(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->buffer != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	while (bytes > 0) {
+		char *nl = memchr(buf, '\n', bytes);
+		int len = nl != NULL ? nl - buf + 1 : bytes;
+		int room = opts.max_line_length - fdev->offset;
+		bool end = nl != NULL;
+
+		// the buffer fills up before the end of the line
+		if (len > room) {
+			len = room;
+			end = false;
+		}
+
+		memcpy(fdev->buffer + fdev->offset, buf, len);
+		fdev->offset += len;
+		buf += len;
+		bytes -= len;
+
+		if (end || fdev->offset == opts.max_line_length) {
+			// wait for the line of another host to end first
+			if (stream_fdev != NULL && stream_fdev != fdev &&
+			    stream_fdev->host != fdev->host && fdev->fd >= 0) {
+				stream_pause(fdev, buf, bytes);
+				return;
+			}
+			stream_write(fdev, end);
+		}
+	}
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in group mode.
+ */
+static void
+process_data_group(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	print_group_data(fdev->host, fdev->color, buf, bytes);
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in group mode, keeping
+ * the output to be printed at once when the host is done (`--block`).
+ */
+static void
+process_data_block(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	block_append(fdev->host, fdev->color, buf, bytes);
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in group mode, holding
+ * back the output of hosts after the first one not done yet (`--ordered`).
+ */
+static void
+process_data_ordered(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	if (fdev->host != ordered_head) {
+		ordered_hold(fdev->host, fdev->type, buf, bytes);
+		return;
+	}
+
+	print_group_data(fdev->host, fdev->color, buf, bytes);
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in join mode.
+ */
+static void
+process_data_join(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->buffer != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	// digest all of the output (even if it doesn't fit in the buffer)
+	fdev->host->cp->digest = hash_update(fdev->host->cp->digest, buf,
+	    bytes);
+
+	// keep as much as fits in the buffer, the rest is dropped
+	if (bytes > opts.max_output_length - fdev->offset) {
+		bytes = opts.max_output_length - fdev->offset;
+	}
+	memcpy(fdev->buffer + fdev->offset, buf, bytes);
+	fdev->offset += bytes;
+}
+
+/*
+ * Called by read_active_fd when finishing an fd in line mode.
+ */
+static void
+fd_done_line(FdEvent *fdev)
+{
+	// check for a remaining line
+	if (fdev->offset == 0) {
+		return;
+	}
+
+	// data remaining! put a newline if it didn't have one
+	if (fdev->buffer[fdev->offset - 1] != '\n') {
+		fdev->buffer[fdev->offset] = '\n';
+		fdev->offset++;
+	}
+	assert(fdev->offset < opts.max_line_length + 2);
+
+	fdev->buffer[fdev->offset] = '\0';
+	handlers.line(fdev);
+	fdev->offset = 0;
+}
+
+/*
+ * Called by read_active_fd when finishing an fd in line mode with
+ * `--stream-lines`.
+ */
+static void
+fd_done_line_stream(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+
+	// nothing left, or the line was already ended by other output
+	if (fdev->offset == 0 && (stream_fdev != fdev || newline_printed)) {
+		fdev->streaming = false;
+		if (stream_fdev == fdev) {
+			stream_fdev = NULL;
+		}
+		return;
+	}
+
+	// data remaining! put a newline if it didn't have one
+	if (fdev->offset == 0 || fdev->buffer[fdev->offset - 1] != '\n') {
+		fdev->buffer[fdev->offset] = '\n';
+		fdev->offset++;
+	}
+	assert(fdev->offset < opts.max_line_length + 2);
+
+	stream_write(fdev, true);
+}
+
+/*
+ * Called by read_active_fd when finishing an fd in group mode.
+ */
+static void
+fd_done_group(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+
+	// do nothing
+}
+
+/*
+ * Called by read_active_fd when finishing an fd in join mode.
+ */
+static void
+fd_done_join(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->host->cp != NULL);
+
+	assert(fdev->offset <= opts.max_output_length);
+
+	// hand fdev buffer to host object for later analysis
+	fdev->host->cp->output.data = fdev->buffer;
+	fdev->host->cp->output.len = fdev->offset;
+	fdev->buffer = NULL;
+}
+
+/*
+ * Ignore bytes read (`--silent`, or printed when done in watch mode).
+ */
+static void
+process_data_none(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(buf != NULL);
+	assert(bytes > 0);
+
+	// do nothing
+}
+
+/*
+ * Append child output to a Capture.  Once the capture grows past
+ * CAPTURE_MAX_OUTPUT it is discarded and marked as overflowed.
+ */
+static void
+capture_append(Capture *cap, const char *buf, size_t len)
+{
+	assert(cap != NULL);
+	assert(buf != NULL);
+
+	if (cap->overflow) {
+		return;
+	}
+
+	if (cap->len + len > CAPTURE_MAX_OUTPUT) {
+		free(cap->data);
+		cap->data = NULL;
+		cap->len = 0;
+		cap->size = 0;
+		cap->overflow = true;
+		return;
+	}
+
+	// grow the buffer
+	if (cap->len + len > cap->size) {
+		size_t size = cap->size > 0 ? cap->size : BUFSIZ;
+		char *data;
+
+		while (size < cap->len + len) {
+			size *= 2;
+		}
+		data = realloc(cap->data, size);
+		if (data == NULL) {
+			err(3, "realloc capture");
+		}
+		cap->data = data;
+		cap->size = size;
+	}
+
+	memcpy(cap->data + cap->len, buf, len);
+	cap->len += len;
+}
+
+/*
+ * Pass output read from a session on to the current mode (unless silent).
+ */
+static void
+session_flush(FdEvent *fdev, char *buf, int bytes)
+{
+	if (bytes > 0) {
+		handlers.process(fdev, buf, bytes);
+	}
+}
+
+/*
+ * Keep the joined output of the current step of a session (`--script`).
+ */
+static void
+session_save_output(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	if (cp->step_outputs == NULL || cp->output.data == NULL) {
+		return;
+	}
+
+	assert(cp->step > 0 && cp->step <= cp->last_step);
+	cp->step_outputs[cp->step - 1] = cp->output;
+	cp->output.data = NULL;
+	cp->output.len = 0;
+}
+
+/*
+ * Mark the current step of a session as finished and report it.  If more
+ * steps were sent the session moves on to the next one, unless the step failed
+ * (which ends the session when running a script).
+ */
+static void
+session_step_done(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	cp->finished_time = monotonic_time_ms();
+	if (cp->exit_code != 0) {
+		cp->failed_steps++;
+	}
+
+	session_save_output(host);
+	print_exit_message(host, cp->pid);
+
+	if (cp->step < cp->last_step && cp->exit_code == 0) {
+		cp->step++;
+		cp->exit_code = -1;
+		cp->started_time = cp->finished_time;
+		cp->finished_time = -1;
+		return;
+	}
+
+	cp->busy = false;
+	session_pending--;
+}
+
+/*
+ * Called when a step marker has been read from one of a session's pipes.  When
+ * several steps are sent at once one stream may run ahead of the other, so a
+ * step is only done once its marker has been read on every stream.
+ */
+static void
+session_marker(FdEvent *fdev, int step, int code)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+
+	ChildProcess *cp = fdev->host->cp;
+	int *stream_step = fdev->type == PIPE_STDERR ?
+	    &cp->stderr_step : &cp->stdout_step;
+	int done_step;
+
+	// ignore markers that don't belong to a running step
+	if (!cp->busy || step <= *stream_step || step > cp->last_step) {
+		return;
+	}
+	*stream_step = step;
+
+	// the output of this stream for the step is done
+	handlers.done(fdev);
+	if (opts.mode == MODE_JOIN) {
+		fdev->buffer = safe_malloc(opts.max_output_length + 1,
+		    "fdev->buffer");
+		fdev->offset = 0;
+	}
+
+	done_step = cp->stdout_step;
+	if (!single_output_pipe() && cp->stderr_step < done_step) {
+		done_step = cp->stderr_step;
+	}
+	if (done_step >= cp->step) {
+		cp->exit_code = code;
+		session_step_done(fdev->host);
+	}
+}
+
+/*
+ * Called by read_active_fd when processing read bytes from a session.  The
+ * bytes are scanned for step markers (which may be split across reads), and
+ * everything else is passed on to the current mode.
+ *
+ * A marker is a line of the form "\036sshp:<token>:<step>:<code>" that is
+ * always written after a newline, which is consumed along with it.
+ */
+static void
+session_scan(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->marker != NULL);
+	assert(buf != NULL);
+
+	char out[BUFSIZ + SESSION_MARKER_MAX];
+	int n = 0;
+
+	for (int i = 0; i < bytes; i++) {
+		char c = buf[i];
+		int step;
+		int code;
+
+		// not in a possible marker
+		if (fdev->marker_len == 0 && c != '\n') {
+			out[n++] = c;
+			continue;
+		}
+
+		if (fdev->marker_len < session_prefix_len) {
+			// still matching the prefix
+			if (c == session_prefix[fdev->marker_len]) {
+				fdev->marker[fdev->marker_len++] = c;
+				continue;
+			}
+		} else if (c == '\n') {
+			// end of a marker line
+			fdev->marker[fdev->marker_len] = '\0';
+			if (sscanf(fdev->marker + session_prefix_len, "%d:%d",
+			    &step, &code) == 2) {
+				session_flush(fdev, out, n);
+				n = 0;
+				fdev->marker_len = 0;
+				session_marker(fdev, step, code);
+				continue;
+			}
+		} else if (fdev->marker_len < SESSION_MARKER_MAX - 1 &&
+		    (isdigit((unsigned char)c) || c == ':' || c == '-')) {
+			// step number and exit code
+			fdev->marker[fdev->marker_len++] = c;
+			continue;
+		}
+
+		// not a marker after all, the newline may start a new one
+		memcpy(out + n, fdev->marker, fdev->marker_len);
+		n += fdev->marker_len;
+		fdev->marker_len = 0;
+		if (c == '\n') {
+			fdev->marker[fdev->marker_len++] = c;
+		} else {
+			out[n++] = c;
+		}
+	}
+
+	session_flush(fdev, out, n);
+}
+
+/*
+ * Called by read_active_fd when a session pipe has closed.  A step that was
+ * interrupted keeps the output it had, but output written between steps is
+ * dropped in join mode as it doesn't belong to any step.
+ */
+static void
+session_eof(FdEvent *fdev)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+
+	session_flush(fdev, fdev->marker, fdev->marker_len);
+	fdev->marker_len = 0;
+
+	if (fdev->host->cp->busy || opts.mode != MODE_JOIN) {
+		handlers.done(fdev);
+	}
+}
+
+/*
+ * Called by read_active_fd when processing read bytes in watch mode: the
+ * output is only captured, to be printed when the host is done.
+ */
+static void
+read_watch(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+
+	ChildProcess *cp = fdev->host->cp;
+
+	capture_append(fdev->type == PIPE_STDERR ?
+	    &cp->cache_err : &cp->cache_out, buf, bytes);
+}
+
+/*
+ * Called by read_active_fd when processing read bytes that may need to be
+ * captured for the result cache.
+ */
+static void
+read_cache(FdEvent *fdev, char *buf, int bytes)
+{
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+
+	ChildProcess *cp = fdev->host->cp;
+
+	if (cp->cache_key != NULL) {
+		capture_append(fdev->type == PIPE_STDERR ?
+		    &cp->cache_err : &cp->cache_out, buf, bytes);
+	}
+
+	handlers.process(fdev, buf, bytes);
+}
+
+/*
+ * Pick the output handlers for the mode and options.  Must be called after
+ * the options and colors are set and before any output is read.
+ */
+static void
+output_handlers_init(void)
+{
+	bool plain = colors.reset[0] == '\0';
+
+	// handle the data of the mode
+	switch (opts.mode) {
+	case MODE_LINE:
+		handlers.process = opts.stream_lines ?
+		    process_data_line_stream : process_data_line;
+		handlers.done = opts.stream_lines ?
+		    fd_done_line_stream : fd_done_line;
+		handlers.buffer_size = opts.max_line_length + 2;
+		break;
+	case MODE_GROUP:
+		handlers.process = opts.block ? process_data_block :
+		    opts.ordered ? process_data_ordered : process_data_group;
+		handlers.done = fd_done_group;
+		handlers.buffer_size = 0;
+		break;
+	case MODE_JOIN:
+		handlers.process = process_data_join;
+		handlers.done = fd_done_join;
+		handlers.buffer_size = opts.max_output_length + 1;
+		break;
+	default: errx(3, "unknown mode: %d", opts.mode);
+	}
+
+	// print complete lines (line mode)
+	if (opts.anonymous) {
+		handlers.write_line = plain ? write_line_anonymous_plain :
+		    write_line_anonymous;
+	} else {
+		handlers.write_line = plain ? write_line_header_plain :
+		    write_line_header;
+	}
+	if (opts.timestamps != TIMESTAMP_NONE) {
+		handlers.write_line_body = handlers.write_line;
+		handlers.write_line = write_line_timestamp;
+	}
+	if (num_aggs > 0) {
+		handlers.line = line_agg;
+	} else if (opts.top > 0) {
+		handlers.line = line_top;
+	} else if (opts.collapse > 0) {
+		handlers.line = line_collapse;
+	} else {
+		handlers.line = line_print;
+	}
+
+	// nothing is printed in silent mode
+	if (opts.silent) {
+		handlers.process = process_data_none;
+	}
+
+	/*
+	 * read bytes: sessions are split into steps first, and the output may
+	 * need to be captured for the result cache or watch mode (which only
+	 * prints it once the host is done)
+	 */
+	handlers.eof = handlers.done;
+	if (opts.session) {
+		handlers.read = session_scan;
+		handlers.eof = session_eof;
+	} else if (opts.watch > 0) {
+		handlers.read = read_watch;
+	} else if (opts.cache_ttl > 0) {
+		handlers.read = read_cache;
+	} else {
+		handlers.read = handlers.process;
+	}
+}
+
+/*
+ * Read data from FdEvent until end or would-block
+ */
+static bool
+read_active_fd(FdEvent *fdev)
+{
+	char buf[BUFSIZ];
+	int bytes;
+
+	assert(fdev != NULL);
+	assert(fdev->host != NULL);
+	assert(fdev->fd >= 0);
+	assert(*fdev->cp_fd == fdev->fd);
+
+	// loop while bytes available
+	while ((bytes = read(fdev->fd, buf, BUFSIZ)) > -1) {
+		// done reading!
+		if (bytes == 0) {
+			// remove the fd and close it
+			fdwatcher_remove(fdw, fdev->fd);
+			close(fdev->fd);
+			*fdev->cp_fd = -2;
+
+			handlers.eof(fdev);
+			fdev_destroy(fdev);
+
+			return true;
+		}
+
+		// the time to the first output is the latency of a jump host
+		if (fdev->host->cp->jump != NULL &&
+		    fdev->host->cp->first_output_time < 0) {
+			fdev->host->cp->first_output_time =
+			    monotonic_time_ms();
+		}
+
+		// handle bytes in the mode
+		handlers.read(fdev, buf, bytes);
+
+		// stop reading until the streamed line ends (`--stream-lines`)
+		if (fdev->paused) {
+			return false;
+		}
+	}
+
+	assert(bytes < 0);
+
+	// handle read error
+	if (errno == EWOULDBLOCK) {
+		return false;
+	}
+
+	err(3, "read failed");
+}
+
+/*
+ * Build the result cache key for the given Host: the full command that would
+ * be executed, with each argument nul-terminated.  Join mode captures stdout
+ * and stderr together so its results are kept apart from the other modes.
+ */
+static char *
+build_cache_key(Host *host, size_t *len)
+{
+	assert(host != NULL);
+	assert(len != NULL);
+
+	char *command[MAX_ARGS] = {NULL};
+	char *key;
+	size_t key_len = 2;
+	size_t idx = 2;
+
+	build_ssh_command(host, command, MAX_ARGS);
+
+	for (char **arg = command; *arg != NULL; arg++) {
+		key_len += strlen(*arg) + 1;
+	}
+
+	key = safe_malloc(key_len, "build_cache_key");
+	key[0] = opts.mode == MODE_JOIN ? 'j' : 's';
+	key[1] = '\0';
+	for (char **arg = command; *arg != NULL; arg++) {
+		size_t arg_len = strlen(*arg) + 1;
+
+		memcpy(key + idx, *arg, arg_len);
+		idx += arg_len;
+	}
+	assert(idx == key_len);
+
+	*len = key_len;
+	return key;
+}
+
+/*
+ * Feed previously captured output for a Host through the current mode as if
+ * it had just been read from the given pipe (the FdEvent has no fd).
+ */
+static void
+replay_output(Host *host, enum PipeType type, char *data, size_t len)
+{
+	assert(host != NULL);
+
+	FdEvent *fdev = fdev_create(host, type);
+
+	while (len > 0) {
+		int bytes = len < BUFSIZ ? len : BUFSIZ;
+
+		handlers.process(fdev, data, bytes);
+		data += bytes;
+		len -= bytes;
+	}
+
+	handlers.done(fdev);
+	fdev_destroy(fdev);
+}
+
+/*
+ * Look up the given Host in the result cache.  If a fresh result is found it
+ * is replayed as if the command had just run and the Host is marked as done.
+ * Otherwise the cache key is saved so the output can be captured and stored
+ * once the command finishes.
+ *
+ * Returns true if the result was replayed from the cache.
+ */
+static bool
+cache_replay(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(cache != NULL);
+
+	ChildProcess *cp = host->cp;
+	CacheEntry entry;
+	int ret;
+
+	// already looked up (before probing)
+	if (cp->cache_key != NULL) {
+		return false;
+	}
+
+	cp->cache_key = build_cache_key(host, &cp->cache_key_len);
+	ret = cache_lookup(cache, cp->cache_key, cp->cache_key_len,
+	    opts.cache_ttl, &entry);
+	if (ret == -1) {
+		err(3, "cache_lookup %s", host->name);
+	}
+	if (ret == 0) {
+		return false;
+	}
+
+	free(cp->cache_key);
+	cp->cache_key = NULL;
+	cp->cached = true;
+	cp->started_time = monotonic_time_ms();
+
+	// chop off the domain portion of the name if -t
+	host_trim(host);
+
+	DEBUG("%s%s%s using cached result (%s%ld%s s old)\n",
+	    colors.cyan, host->name, colors.reset,
+	    colors.magenta, (long)(time(NULL) - entry.stored), colors.reset);
+
+	if (opts.mode == MODE_JOIN) {
+		replay_output(host, PIPE_STDIO, entry.out, entry.out_len);
+	} else {
+		replay_output(host, PIPE_STDOUT, entry.out, entry.out_len);
+		replay_output(host, PIPE_STDERR, entry.err, entry.err_len);
+	}
+
+	cp->exit_code = entry.exit_code;
+	cp->pid = -2;
+	cp->finished_time = monotonic_time_ms();
+	cp->state = CP_STATE_DONE;
+	cache_entry_free(&entry);
+
+	if (dashboard != NULL) {
+		dashboard_done(host);
+	}
+	if (opts.block) {
+		block_flush(host);
+	}
+
+	// printed once the host's output is with --ordered
+	if (!opts.ordered) {
+		print_exit_message(host, -1);
+	}
+
+	return true;
+}
+
+/*
+ * Store the result of a finished Host in the result cache.  Connection errors,
+ * killed commands (by a signal or `--timeout`, with cut off output) and output
+ * too large to capture are not cached.
+ */
+static void
+cache_save(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(cache != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	if (cp->cache_key == NULL) {
+		return;
+	}
+
+	if (cp->exit_code != SSH_CONNECT_ERROR &&
+	    !cp->signaled && !cp->timed_out &&
+	    !cp->cache_out.overflow && !cp->cache_err.overflow &&
+	    cache_store(cache, cp->cache_key, cp->cache_key_len,
+	    cp->exit_code, cp->cache_out.data, cp->cache_out.len,
+	    cp->cache_err.data, cp->cache_err.len) == -1) {
+		warn("cache_store %s", host->name);
+	}
+
+	// the captured output is no longer needed
+	free(cp->cache_key);
+	free(cp->cache_out.data);
+	free(cp->cache_err.data);
+	cp->cache_key = NULL;
+	memset(&cp->cache_out, 0, sizeof (cp->cache_out));
+	memset(&cp->cache_err, 0, sizeof (cp->cache_err));
+}
+
+/*
+ * Called when a Host has finished a run in watch mode.  Its result is printed
+ * only if it differs from the last printed result, and the Host is queued up
+ * to run again.
+ */
+static void
+watch_finish(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(watch_queue_len < watch_queue_size);
+
+	ChildProcess *cp = host->cp;
+	bool overflow = cp->cache_out.overflow || cp->cache_err.overflow;
+	uint64_t digest = HASH_INIT;
+	int idx;
+
+	digest = hash_update(digest, &cp->cache_out.len,
+	    sizeof (cp->cache_out.len));
+	digest = hash_update(digest, cp->cache_out.data, cp->cache_out.len);
+	digest = hash_update(digest, cp->cache_err.data, cp->cache_err.len);
+	digest = hash_update(digest, &cp->exit_code, sizeof (cp->exit_code));
+
+	// output that was too large to capture is always treated as changed
+	if (overflow || !cp->watched || digest != cp->watch_digest) {
+		cp->watch_digest = digest;
+		cp->watched = true;
+
+		replay_output(host, PIPE_STDOUT, cp->cache_out.data,
+		    cp->cache_out.len);
+		replay_output(host, PIPE_STDERR, cp->cache_err.data,
+		    cp->cache_err.len);
+
+		if (overflow && !opts.silent) {
+			if (!newline_printed) {
+				printf("\n");
+				newline_printed = true;
+			}
+			if (!opts.anonymous) {
+				print_host_header(host);
+				printf(" ");
+			}
+			printf("%soutput too large to show%s\n",
+			    colors.red, colors.reset);
+			last_group_host = NULL;
+		}
+
+		print_exit_message(host, -1);
+	} else {
+		DEBUG("%s%s%s unchanged\n",
+		    colors.cyan, host->name, colors.reset);
+	}
+
+	// hosts finish in order, so the queue stays ordered by next_run
+	cp->next_run = cp->finished_time + opts.watch * 1000L;
+	idx = (watch_queue_head + watch_queue_len) % watch_queue_size;
+	watch_queue[idx] = host;
+	watch_queue_len++;
+}
+
+/*
+ * Pop the next Host off of the watch queue if it is due to run again, or NULL
+ * if none are.
+ */
+static Host *
+watch_queue_pop(long now)
+{
+	Host *host;
+
+	if (watch_queue_len == 0) {
+		return NULL;
+	}
+
+	host = watch_queue[watch_queue_head];
+	if (host->cp->next_run > now) {
+		return NULL;
+	}
+
+	watch_queue_head = (watch_queue_head + 1) % watch_queue_size;
+	watch_queue_len--;
+
+	// restore the full name for the next run
+	child_process_reset(host->cp);
+	host_untrim(host);
+
+	return host;
+}
+
+/*
+ * Get the default result cache directory: $XDG_CACHE_HOME/sshp or
+ * ~/.cache/sshp.  The parent directory is created if needed.
+ */
+static char *
+default_cache_dir(void)
+{
+	static char dir[PATH_MAX];
+	char *base = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+	int len;
+
+	if (base != NULL && base[0] != '\0') {
+		len = snprintf(dir, sizeof (dir), "%s/%s", base, PROG_NAME);
+	} else if (home != NULL && home[0] != '\0') {
+		len = snprintf(dir, sizeof (dir), "%s/.cache", home);
+		if (len < (int)sizeof (dir) && mkdir(dir, 0755) == -1 &&
+		    errno != EEXIST) {
+			err(2, "mkdir %s", dir);
+		}
+		len = snprintf(dir, sizeof (dir), "%s/.cache/%s", home,
+		    PROG_NAME);
+	} else {
+		errx(2, "$HOME is not set, use `--cache-dir`");
+	}
+
+	if (len >= (int)sizeof (dir)) {
+		errx(2, "cache directory name too long");
+	}
+
+	return dir;
+}
+
+/*
+ * Get the final digest of a finished Host's result (output and exit code).
+ */
+static uint64_t
+host_digest(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(host->cp->state == CP_STATE_DONE);
+
+	return hash_update(host->cp->digest, &host->cp->exit_code,
+	    sizeof (host->cp->exit_code));
+}
+
+/*
+ * Hash the full names of all hosts (before any trimming) to identify them in
+ * snapshots.
+ */
+static void
+hash_host_names(void)
+{
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		uint64_t hash = hash_bytes(h->name, strlen(h->name));
+
+		// 0 is reserved for empty snapshot slots
+		h->cp->name_hash = hash == 0 ? 1 : hash;
+	}
+}
+
+/*
+ * Compare 2 hostname hashes for sorting.
+ */
+static int
+name_hash_compare(const void *a, const void *b)
+{
+	uint64_t ha = *(const uint64_t *)a;
+	uint64_t hb = *(const uint64_t *)b;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/*
+ * Mark the hosts whose result is the same as in the `--changed-since`
+ * snapshot.  Returns the number of unchanged hosts, and sets `num_missing` to
+ * the number of hosts in the snapshot that aren't in this run (only their
+ * hashes are recorded, so they can be counted but not named).
+ */
+static int
+mark_unchanged_hosts(Snapshot *snap, int *num_missing)
+{
+	assert(snap != NULL);
+	assert(num_missing != NULL);
+
+	uint64_t *found;
+	size_t num_found = 0;
+	size_t num_distinct = 0;
+	int num_unchanged = 0;
+	int num_hosts = 0;
+
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		num_hosts++;
+	}
+	found = safe_malloc(sizeof (uint64_t) * (num_hosts + 1),
+	    "mark_unchanged_hosts");
+
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		uint64_t digest;
+
+		if (!snapshot_lookup(snap, h->cp->name_hash, &digest)) {
+			continue;
+		}
+		found[num_found++] = h->cp->name_hash;
+
+		if (digest == host_digest(h)) {
+			h->cp->unchanged = true;
+			num_unchanged++;
+		}
+	}
+
+	// the same host may be listed more than once (without --dedupe)
+	qsort(found, num_found, sizeof (uint64_t), name_hash_compare);
+	for (size_t i = 0; i < num_found; i++) {
+		if (i == 0 || found[i] != found[i - 1]) {
+			num_distinct++;
+		}
+	}
+	free(found);
+
+	*num_missing = snap->num_records - num_distinct;
+	return num_unchanged;
+}
+
+/*
+ * Write the `--snapshot` file for all hosts.
+ */
+static void
+write_snapshot(const char *path, int num_hosts)
+{
+	assert(path != NULL);
+
+	SnapshotRecord *records = safe_malloc(sizeof (SnapshotRecord) *
+	    num_hosts, "write_snapshot");
+	int idx = 0;
+
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		records[idx].host = h->cp->name_hash;
+		records[idx].digest = host_digest(h);
+		idx++;
+	}
+	assert(idx == num_hosts);
+
+	if (snapshot_write(path, records, num_hosts) == -1) {
+		err(3, "write snapshot %s", path);
+	}
+
+	free(records);
+}
+
+/*
+ * Split a hostname for `--ranges` into the text before its last number, the
+ * number and the text after it.
+ */
+static void
+range_name_parse(RangeName *rn, const char *name)
+{
+	assert(rn != NULL);
+	assert(name != NULL);
+
+	size_t len = strlen(name);
+	size_t end = len;
+	size_t start;
+
+	rn->name = name;
+	rn->prefix_len = len;
+	rn->suffix = name + len;
+	rn->num = 0;
+	rn->width = 0;
+	rn->pad = 0;
+
+	// find the last run of digits
+	while (end > 0 && !isdigit((unsigned char)name[end - 1])) {
+		end--;
+	}
+	start = end;
+	while (start > 0 && isdigit((unsigned char)name[start - 1])) {
+		start--;
+	}
+
+	// no number (or too long to be one)
+	if (start == end || end - start > 18) {
+		return;
+	}
+
+	rn->prefix_len = start;
+	rn->suffix = name + end;
+	rn->width = end - start;
+	if (name[start] == '0' && rn->width > 1) {
+		rn->pad = rn->width;
+	}
+	for (size_t i = start; i < end; i++) {
+		rn->num = rn->num * 10 + (name[i] - '0');
+	}
+}
+
+/*
+ * Compare the parts of 2 hostnames that have to match for them to be put in
+ * the same range (other than the padding): the prefix and the suffix.
+ */
+static int
+range_name_compare_key(const RangeName *a, const RangeName *b)
+{
+	size_t len = a->prefix_len < b->prefix_len ?
+	    a->prefix_len : b->prefix_len;
+	int ret;
+
+	ret = memcmp(a->name, b->name, len);
+	if (ret != 0) {
+		return ret;
+	}
+	if (a->prefix_len != b->prefix_len) {
+		return a->prefix_len < b->prefix_len ? -1 : 1;
+	}
+	if ((a->width > 0) != (b->width > 0)) {
+		return a->width > 0 ? 1 : -1;
+	}
+	return strcmp(a->suffix, b->suffix);
+}
+
+/*
+ * Compare 2 hostnames for sorting by range, padding and then number.
+ */
+static int
+range_name_compare(const void *a, const void *b)
+{
+	const RangeName *ra = a;
+	const RangeName *rb = b;
+	int ret = range_name_compare_key(ra, rb);
+
+	if (ret != 0) {
+		return ret;
+	}
+	if (ra->pad != rb->pad) {
+		return ra->pad < rb->pad ? -1 : 1;
+	}
+	if (ra->num != rb->num) {
+		return ra->num < rb->num ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Print a number of a range with the padding of its hostname.
+ */
+static void
+range_print_num(const RangeName *rn, unsigned long num)
+{
+	printf("%0*lu", rn->pad, num);
+}
+
+/*
+ * Print the names of the given hosts compressed into ranges (`--ranges`):
+ * hostnames that only differ by their last number are sorted and printed
+ * once, with runs of consecutive numbers printed as a range, ie.
+ * "web[001-480,482-500].example.com".  Zero-padded numbers are only put in a
+ * range with numbers of the same width (like "web100" with "web099").
+ */
+static void
+print_host_ranges(Host **list, int num)
+{
+	assert(list != NULL);
+	assert(num > 0);
+
+	RangeName *names = safe_malloc(sizeof (RangeName) * num,
+	    "print_host_ranges");
+
+	for (int i = 0; i < num; i++) {
+		range_name_parse(&names[i], list[i]->name);
+	}
+	qsort(names, num, sizeof (RangeName), range_name_compare);
+
+	// pad numbers as wide as padded ones with the same prefix and suffix
+	for (int i = 0; i < num; ) {
+		uint32_t pads = 0;
+		int end = i;
+
+		while (end < num &&
+		    range_name_compare_key(&names[i], &names[end]) == 0) {
+			pads |= (uint32_t)1 << names[end].pad;
+			end++;
+		}
+		if (pads > 1) {
+			for (int j = i; j < end; j++) {
+				if (pads & ((uint32_t)1 << names[j].width)) {
+					names[j].pad = names[j].width;
+				}
+			}
+			qsort(names + i, end - i, sizeof (RangeName),
+			    range_name_compare);
+		}
+		i = end;
+	}
+
+	for (int i = 0; i < num; ) {
+		RangeName *first = &names[i];
+		int end = i + 1;
+
+		// find every name in the same range
+		while (end < num &&
+		    range_name_compare_key(first, &names[end]) == 0 &&
+		    first->pad == names[end].pad) {
+			end++;
+		}
+
+		// a lone name (or one without a number) is printed as is
+		if (end - i == 1 || first->width == 0) {
+			for (int j = i; j < end; j++) {
+				printf(" %s", names[j].name);
+			}
+			i = end;
+			continue;
+		}
+
+		printf(" %.*s[", (int)first->prefix_len, first->name);
+		for (int j = i; j < end; ) {
+			unsigned long lo = names[j].num;
+			unsigned long hi = lo;
+
+			// extend the run (skipping duplicate names)
+			while (j < end && names[j].num <= hi + 1) {
+				hi = names[j].num;
+				j++;
+			}
+
+			range_print_num(first, lo);
+			if (hi != lo) {
+				printf("-");
+				range_print_num(first, hi);
+			}
+			if (j < end) {
+				printf(",");
+			}
+		}
+		printf("]%s", first->suffix);
+
+		i = end;
+	}
+
+	free(names);
+}
+
+/*
+ * Finish analysis for join mode.
+ *
+ * In join mode, all of the stdout and stderr has been buffered and is
+ * processed in this function.  The way it works is:
+ *
+ * 1. Loop all hosts, looking up the output of each in an open-addressing hash
+ *    table of the unique results (JoinGroup) seen so far, and adding a new
+ *    result if it isn't found.  Each host's result is stored as
+ *    cp->output_idx and each result counts its hosts.
+ * 2. Give each result its slice of a single array of hosts, and loop all hosts
+ *    again to fill in the slices (so each is in the order of the hosts).
+ * 3. Print the number of unique results seen, then each unique output with
+ *    the hostnames (compressed into ranges with `--ranges`).
+ *
+ * This is linear in the number of hosts (and the size of the output).
+ *
+ * With `--changed-since`, hosts whose result matches the previous snapshot are
+ * marked (in a single pass over the hosts) before step 1 and skipped entirely.
+ */
+static void
+finish_join_mode(int num_hosts)
+{
+	int num_groups = 0;
+	int num_results = 0;
+	int num_unchanged = 0;
+	int num_missing = 0;
+	size_t num_slots = 16;
+	JoinGroup *groups;
+	Host **members;
+	int *slots;
+	int offset = 0;
+
+	// hide hosts with the same result as the last snapshot
+	if (previous_snapshot != NULL) {
+		num_unchanged = mark_unchanged_hosts(previous_snapshot,
+		    &num_missing);
+	}
+
+	/*
+	 * count the hosts with a result (not hidden by --changed-since, and
+	 * with a result for this step of a session)
+	 */
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		if (!h->cp->unchanged && h->cp->output.data != NULL) {
+			num_results++;
+		}
+	}
+
+	// keep the table at most half full
+	while (num_slots < (size_t)num_results * 2) {
+		num_slots *= 2;
+	}
+	slots = calloc(num_slots, sizeof (int));
+	if (slots == NULL) {
+		err(3, "calloc join slots");
+	}
+	groups = safe_malloc(sizeof (JoinGroup) * (num_results + 1),
+	    "finish_join_mode groups");
+	members = safe_malloc(sizeof (Host *) * (num_results + 1),
+	    "finish_join_mode members");
+
+	// find the unique result of every host
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		const Span *output = &h->cp->output;
+		uint64_t hash;
+		size_t idx;
+
+		if (h->cp->unchanged || output->data == NULL) {
+			continue;
+		}
+
+		hash = hash_bytes(output->data, output->len);
+		idx = hash & (num_slots - 1);
+		while (slots[idx] != 0) {
+			JoinGroup *g = &groups[slots[idx] - 1];
+
+			if (g->hash == hash && g->output.len == output->len &&
+			    memcmp(g->output.data, output->data,
+			    output->len) == 0) {
+				break;
+			}
+			idx = (idx + 1) & (num_slots - 1);
+		}
+
+		// a new result
+		if (slots[idx] == 0) {
+			groups[num_groups].output = *output;
+			groups[num_groups].hash = hash;
+			groups[num_groups].num_hosts = 0;
+			slots[idx] = ++num_groups;
+		}
+
+		h->cp->output_idx = slots[idx] - 1;
+		groups[h->cp->output_idx].num_hosts++;
+	}
+
+	// give each result its slice of the members
+	for (int i = 0; i < num_groups; i++) {
+		groups[i].hosts = members + offset;
+		offset += groups[i].num_hosts;
+		groups[i].num_hosts = 0;
+	}
+	assert(offset == num_results);
+
+	for (Host *h = hosts; h != NULL; h = h->next) {
+		JoinGroup *g;
+
+		if (h->cp->unchanged || h->cp->output.data == NULL) {
+			continue;
+		}
+
+		g = &groups[h->cp->output_idx];
+		g->hosts[g->num_hosts++] = h;
+	}
+
+	printf("finished with %s%d%s unique result%s",
+	    colors.magenta, num_groups, colors.reset, pluralize(num_groups));
+	if (opts.changed_since != NULL) {
+		printf(" (%s%d%s unchanged host%s hidden",
+		    colors.magenta, num_unchanged, colors.reset,
+		    pluralize(num_unchanged));
+		if (num_missing > 0) {
+			printf(", %s%d%s host%s gone since the snapshot",
+			    colors.magenta, num_missing, colors.reset,
+			    pluralize(num_missing));
+		}
+		printf(")");
+	}
+	printf("\n\n");
+
+	// loop the unique results
+	for (int i = 0; i < num_groups; i++) {
+		JoinGroup *g = &groups[i];
+
+		printf("hosts (%s%d%s/%s%d%s):%s",
+		    colors.magenta, g->num_hosts, colors.reset,
+		    colors.magenta, num_hosts, colors.reset,
+		    colors.cyan);
+
+		if (opts.ranges) {
+			print_host_ranges(g->hosts, g->num_hosts);
+		} else {
+			for (int j = 0; j < g->num_hosts; j++) {
+				printf(" %s", g->hosts[j]->name);
+			}
+		}
+
+		// print the output
+		printf("%s\n", colors.reset);
+		print_span(&g->output);
+
+		// alert if the output is empty
+		if (g->output.len == 0) {
+			printf("%s- no output -%s",
+			    colors.magenta, colors.reset);
+		}
+
+		// print a newline if there isn't one
+		if (!ends_in_newline(&g->output)) {
+			printf("\n");
+		}
+
+		printf("\n");
+	}
+
+	free(slots);
+	free(groups);
+	free(members);
+}
+
+/*
+ * Print the progress line as hosts finish in join mode.
+ */
+static void
+print_progress_line(int done, int num_hosts)
+{
+	printf("[%s%s%s] finished %s%d%s/%s%d%s\r",
+	    colors.cyan, PROG_NAME, colors.reset,
+	    colors.magenta, done, colors.reset,
+	    colors.magenta, num_hosts, colors.reset);
+	fflush(stdout);
+}
+
+/*
+ * Update the progress line (if applicable) after a host has finished.
+ */
+static void
+update_progress(int done, int num_hosts)
+{
+	if (opts.mode != MODE_JOIN || !stdout_isatty || dashboard != NULL) {
+		return;
+	}
+
+	print_progress_line(done, num_hosts);
+	if (done == num_hosts) {
+		printf("\n\n");
+	}
+}
+
+/*
+ * Get the next Host that should have its child process spawned, or NULL if
+ * there isn't one ready.
+ */
+static Host *
+next_host_to_spawn(Host **cur_host)
+{
+	Host *host;
+
+	assert(cur_host != NULL);
+
+	// probed hosts come from the queue of hosts that passed their probe
+	if (opts.probe) {
+		return probe_queue_pop();
+	}
+
+	host = *cur_host;
+	if (host != NULL) {
+		*cur_host = host->next;
+		return host;
+	}
+
+	// hosts that are due to run again in watch mode
+	if (opts.watch > 0) {
+		return watch_queue_pop(monotonic_time_ms());
+	}
+
+	return NULL;
+}
+
+/*
+ * The main program loop that should be called from main().
+ */
+static void
+main_loop(int num_hosts)
+{
+	Host *cur_host = hosts;
+	Host *host;
+	JumpHost *jump = NULL;
+	int done = 0;
+	int outstanding = 0;
+	void *fdevs[FDW_MAX_EVENTS];
+
+	if (dashboard != NULL) {
+		dashboard_draw(monotonic_time_ms());
+	} else if (opts.mode == MODE_JOIN && stdout_isatty) {
+		print_progress_line(done, num_hosts);
+	}
+
+	/*
+	 * loop while there are still hosts to probe, child processes or hosts
+	 * waiting to run again
+	 */
+	while (cur_host != NULL || outstanding > 0 || probe_window_size() > 0 ||
+	    watch_queue_len > 0) {
+		assert(outstanding <= opts.max_jobs);
+
+		int num_events;
+
+		// start probing upcoming hosts
+		while (opts.probe && cur_host != NULL &&
+		    probe_window_size() < opts.max_jobs) {
+			host = cur_host;
+			cur_host = cur_host->next;
+
+			if ((cache != NULL && cache_replay(host)) ||
+			    probe_start(host)) {
+				done++;
+				update_progress(done, num_hosts);
+			}
+		}
+
+		// create child processes (while a jump host has room)
+		while (outstanding < opts.max_jobs &&
+		    (num_jumps == 0 ||
+		    (jump = jump_pick(monotonic_time_ms())) != NULL) &&
+		    (host = next_host_to_spawn(&cur_host)) != NULL) {
+			// use a cached result instead if there is one
+			if (cache != NULL && cache_replay(host)) {
+				done++;
+				update_progress(done, num_hosts);
+				continue;
+			}
+
+			if (jump != NULL) {
+				jump_start(host, jump);
+			}
+
+			spawn_child_process(host);
+
+			// chop off the domain portion of the name if -t
+			host_trim(host);
+
+			register_child_process_fds(host);
+			if (dashboard != NULL) {
+				dashboard_push(host);
+			}
+			if (opts.timeout > 0) {
+				run_queue_push(&timeout_queue, host);
+			}
+
+			outstanding++;
+		}
+
+		// nothing left to wait on (all hosts failed their probes)
+		if (outstanding == 0 && probe_slots_used == 0 &&
+		    watch_queue_len == 0) {
+			continue;
+		}
+
+		// wait for fd events
+		num_events = fdwatcher_wait(fdw, fdevs, FDW_MAX_EVENTS,
+		    loop_timeout(monotonic_time_ms(),
+		    outstanding < opts.max_jobs));
+		if (num_events == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(3, "fdwatcher_wait");
+		}
+		if (opts.timestamps != TIMESTAMP_NONE) {
+			timestamp_update();
+		}
+
+		// loop fd events
+		for (int i = 0; i < num_events; i++) {
+			FdEvent *fdev = fdevs[i];
+			host = fdev->host;
+
+			assert(host != NULL);
+
+			// a probe connection has finished
+			if (fdev->type == PIPE_PROBE) {
+				if (probe_check(fdev)) {
+					done++;
+					update_progress(done, num_hosts);
+				}
+				continue;
+			}
+
+			// read the active fd until it would block or is done
+			bool fd_closed = read_active_fd(fdev);
+
+			// check if the childs stdio is done and reap it
+			if (fd_closed && child_process_stdio_done(host->cp)) {
+				wait_for_child(host);
+				if (cache != NULL) {
+					cache_save(host);
+				}
+				if (opts.watch > 0) {
+					watch_finish(host);
+				}
+				outstanding--;
+				done++;
+				update_progress(done, num_hosts);
+			}
+		}
+
+		// fail any probes that have timed out
+		if (probe_slots_used > 0) {
+			int failed = probe_expire(monotonic_time_ms());
+			while (failed-- > 0) {
+				done++;
+				update_progress(done, num_hosts);
+			}
+		}
+
+		// kill the hosts that have run for too long
+		if (opts.timeout > 0) {
+			timeout_expire(monotonic_time_ms());
+		}
+
+		// print the collapsed lines at the end of the window
+		if (collapse != NULL && collapse->deadline >= 0 &&
+		    monotonic_time_ms() >= collapse->deadline) {
+			collapse_flush(collapse);
+		}
+
+		// print the output of hosts that are next in order
+		if (opts.ordered) {
+			ordered_advance();
+		}
+
+		// print the lines held back until the streamed line ended
+		if (paused_head != NULL && stream_fdev == NULL) {
+			stream_resume();
+		}
+
+		// redraw the dashboard at most every DASHBOARD_INTERVAL
+		if (dashboard != NULL &&
+		    monotonic_time_ms() >= dashboard->next_draw) {
+			dashboard_draw(monotonic_time_ms());
+		}
+	}
+
+	// draw the final state of the run
+	if (dashboard != NULL) {
+		dashboard_draw(monotonic_time_ms());
+		printf("\n");
+	}
+
+	// print any lines left in the last window
+	if (collapse != NULL) {
+		collapse_flush(collapse);
+	}
+
+	// print the output of the last hosts (ie. unreachable ones)
+	if (opts.ordered) {
+		ordered_advance();
+		assert(ordered_head == NULL);
+	}
+}
+
+/*
+ * Wrap a command to be run as the given step of a session.  The command runs
+ * in a group with stdin from /dev/null (so it can't read the commands that
+ * follow it) and is followed by a step marker with its exit code on stdout and
+ * stderr (only stdout if they are the same pipe).  With `stop`, the remote
+ * shell exits if the command fails so no more steps are run.
+ */
+static char *
+session_wrap(int step, const char *command, bool stop, size_t *len)
+{
+	assert(command != NULL);
+	assert(len != NULL);
+
+	const char *fmt = "{ %s\n} </dev/null; __sshp_rc=$?; %s\n%s";
+	const char *exit_line = stop ?
+	    "[ \"$__sshp_rc\" -eq 0 ] || exit \"$__sshp_rc\"\n" : "";
+	char marker[SESSION_MARKER_MAX * 2];
+	char markers[sizeof (marker) * 2 + 8];
+	char *input;
+	int size;
+
+	snprintf(marker, sizeof (marker),
+	    "printf '\\n\\036%s:%s:%d:%%d\\n' \"$__sshp_rc\"",
+	    PROG_NAME, session_token, step);
+	if (single_output_pipe()) {
+		snprintf(markers, sizeof (markers), "%s", marker);
+	} else {
+		snprintf(markers, sizeof (markers), "%s; %s >&2",
+		    marker, marker);
+	}
+
+	size = snprintf(NULL, 0, fmt, command, markers, exit_line);
+	if (size < 0) {
+		err(3, "snprintf session input");
+	}
+	input = safe_malloc(size + 1, "session input");
+	snprintf(input, size + 1, fmt, command, markers, exit_line);
+
+	*len = size;
+	return input;
+}
+
+/*
+ * Close the stdin of a session, which ends the remote shell once it has run
+ * all of the input it was given.
+ */
+static void
+session_close_input(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(host->cp->stdin_fd >= 0);
+
+	ChildProcess *cp = host->cp;
+
+	if (cp->input_watched) {
+		fdwatcher_remove_writable(fdw, cp->stdin_fd);
+		cp->input_watched = false;
+	}
+	close(cp->stdin_fd);
+	cp->stdin_fd = -2;
+}
+
+/*
+ * Write as much of the current step's input to a session's stdin as possible,
+ * watching for the pipe to become writable if it fills up.
+ */
+static void
+session_write(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+	ssize_t n;
+
+	// the session has already gone away
+	if (cp->stdin_fd < 0) {
+		return;
+	}
+
+	while (cp->input_off < cp->input_len) {
+		n = write(cp->stdin_fd, cp->input + cp->input_off,
+		    cp->input_len - cp->input_off);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if (errno == EPIPE) {
+				// its output pipes will close soon
+				session_close_input(host);
+				return;
+			}
+			err(3, "write session input");
+		}
+		cp->input_off += n;
+	}
+
+	if (cp->input_off < cp->input_len && !cp->input_watched) {
+		// the pipe is full, wait for it to drain
+		if (fdwatcher_add_writable(fdw, cp->stdin_fd,
+		    cp->stdin_fdev) == -1) {
+			err(3, "fdwatcher_add_writable");
+		}
+		cp->input_watched = true;
+	} else if (cp->input_off == cp->input_len && cp->input_watched) {
+		// all written
+		fdwatcher_remove_writable(fdw, cp->stdin_fd);
+		cp->input_watched = false;
+	}
+
+	// a script is sent all at once, the shell exits after the last step
+	if (cp->input_off == cp->input_len && opts.script != NULL) {
+		session_close_input(host);
+	}
+}
+
+/*
+ * Send the given (wrapped) input to a session to run as its next steps, from
+ * `step` to `last_step`.
+ */
+static void
+session_send(Host *host, int step, int last_step, const char *input,
+	size_t len)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+	assert(input != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	assert(!cp->busy);
+	assert(cp->stdin_fd >= 0);
+	assert(step <= last_step);
+
+	cp->step = step;
+	cp->last_step = last_step;
+	cp->input = input;
+	cp->input_len = len;
+	cp->input_off = 0;
+	cp->busy = true;
+	cp->exit_code = -1;
+	cp->started_time = monotonic_time_ms();
+	cp->finished_time = -1;
+	session_pending++;
+
+	session_write(host);
+}
+
+/*
+ * Start a session on the given host.
+ */
+static void
+session_start(Host *host)
+{
+	assert(host != NULL);
+
+	spawn_child_process(host);
+
+	// chop off the domain portion of the name if -t
+	host_trim(host);
+
+	register_child_process_fds(host);
+	host->cp->stdin_fdev = fdev_create(host, PIPE_STDIN);
+	session_alive++;
+}
+
+/*
+ * Reap a session whose output pipes have closed.
+ */
+static void
+session_exited(Host *host)
+{
+	assert(host != NULL);
+	assert(host->cp != NULL);
+
+	ChildProcess *cp = host->cp;
+
+	if (cp->stdin_fd >= 0) {
+		session_close_input(host);
+	}
+
+	wait_for_child(host);
+	session_alive--;
+
+	// the session ended in the middle of a step
+	if (cp->busy) {
+		session_save_output(host);
+		cp->busy = false;
+		if (cp->exit_code != 0) {
+			cp->failed_steps++;
+		}
+		session_pending--;
+	}
+}
+
+/*
+ * Wait for and handle a single round of session fd events.
+ */
+static void
+session_poll(void)
+{
+	void *fdevs[FDW_MAX_EVENTS];
+	int num_events;
+
+	num_events = fdwatcher_wait(fdw, fdevs, FDW_MAX_EVENTS,
+	    FDW_WAIT_TIMEOUT);
+	if (num_events == -1) {
+		if (errno == EINTR) {
+			return;
+		}
+		err(3, "fdwatcher_wait");
+	}
+	if (opts.timestamps != TIMESTAMP_NONE) {
+		timestamp_update();
+	}
+
+	for (int i = 0; i < num_events; i++) {
+		FdEvent *fdev = fdevs[i];
+		Host *host = fdev->host;
+
+		assert(host != NULL);
+
+		// a session has room for more input
+		if (fdev->type == PIPE_STDIN) {
+			session_write(host);
+			continue;
+		}
+
+		bool fd_closed = read_active_fd(fdev);
+
+		if (fd_closed && child_process_stdio_done(host->cp)) {
+			session_exited(host);
+		}
+	}
+}
+
+/*
+ * Run the event loop until every session has finished its current step, or
+ * until every session has exited if `all` is set.
+ */
+static void
+session_wait(bool all)
+{
+	while (all ? session_alive > 0 : session_pending > 0) {
+		session_poll();
+	}
+}
+
+/*
+ * End all of the sessions (letting them finish any input they were given) and
+ * free their stdin FdEvents.
+ */
+static void
+session_finish(void)
+{
+	for (Host *host = hosts; host != NULL; host = host->next) {
+		if (host->cp->stdin_fd >= 0) {
+			session_close_input(host);
+		}
+	}
+
+	session_wait(true);
+
+	for (Host *host = hosts; host != NULL; host = host->next) {
+		fdev_destroy(host->cp->stdin_fdev);
+		host->cp->stdin_fdev = NULL;
+	}
+}
+
+/*
+ * The program loop for `--shell`: read commands from stdin and run each one
+ * as a step on every live session.
+ */
+static void
+shell_loop(void)
+{
+	bool prompt = isatty(STDIN_FILENO) == 1;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	int step = 0;
+
+	// every session is started up front since they stay around
+	for (Host *host = hosts; host != NULL; host = host->next) {
+		session_start(host);
+	}
+
+	while (session_alive > 0) {
+		char *input;
+		size_t input_len;
+		int num_running = 0;
+
+		if (prompt) {
+			printf("%s%s>%s ", colors.cyan, PROG_NAME,
+			    colors.reset);
+			fflush(stdout);
+		}
+
+		// read the next command
+		errno = 0;
+		len = getline(&line, &line_size, stdin);
+		if (len == -1) {
+			if (errno == EINTR) {
+				clearerr(stdin);
+				continue;
+			}
+			if (prompt) {
+				printf("\n");
+			}
+			break;
+		}
+
+		// strip the newline and skip blank lines
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if (strspn(line, " \t") == (size_t)len) {
+			continue;
+		}
+		if (strcmp(line, "exit") == 0) {
+			break;
+		}
+
+		// run the command on every live session
+		step++;
+		input = session_wrap(step, line, false, &input_len);
+		for (Host *host = hosts; host != NULL; host = host->next) {
+			if (opts.mode == MODE_JOIN) {
+				free(host->cp->output.data);
+				host->cp->output.data = NULL;
+				host->cp->output.len = 0;
+				host->cp->output_idx = -1;
+			}
+			if (host->cp->stdin_fd < 0) {
+				continue;
+			}
+			session_send(host, step, step, input, input_len);
+			num_running++;
+		}
+
+		session_wait(false);
+
+		if (opts.mode == MODE_JOIN && num_running > 0) {
+			finish_join_mode(num_running);
+		}
+		free(input);
+	}
+
+	session_finish();
+	free(line);
 }
 
 /*
- * Create a pipe with both ends set to non-blocking and cloexec.
+ * Print the joined results of each step of a script (`--script` in join
+ * mode).  Hosts that didn't get to a step are left out of its results.
  */
 static void
-make_pipe(int *fd)
+finish_script_join_mode(void)
 {
-	assert(fd != NULL);
+	for (int i = 0; i < num_script_steps; i++) {
+		int num_results = 0;
 
-	if (pipe(fd) == -1) {
-		err(3, "pipe");
-	}
-	if (fcntl(fd[PIPE_READ_END], F_SETFL, O_NONBLOCK) == -1) {
-		err(3, "set read end nonblocking");
-	}
-	if (fcntl(fd[PIPE_WRITE_END], F_SETFL, O_NONBLOCK) == -1) {
-		err(3, "set write end nonblocking");
-	}
-	if (fcntl(fd[PIPE_READ_END], F_SETFD, FD_CLOEXEC) == -1) {
-		err(3, "set read end cloexec");
-	}
-	if (fcntl(fd[PIPE_WRITE_END], F_SETFD, FD_CLOEXEC) == -1) {
-		err(3, "set write end cloexec");
+		// use the output of this step as the result of each host
+		for (Host *h = hosts; h != NULL; h = h->next) {
+			h->cp->output = h->cp->step_outputs[i];
+			h->cp->output_idx = -1;
+			h->cp->step_outputs[i].data = NULL;
+			if (h->cp->output.data != NULL) {
+				num_results++;
+			}
+		}
+
+		printf("step %s%d%s/%s%d%s: %s%s%s\n",
+		    colors.magenta, i + 1, colors.reset,
+		    colors.magenta, num_script_steps, colors.reset,
+		    colors.green, script_steps[i], colors.reset);
+
+		if (num_results > 0) {
+			finish_join_mode(num_results);
+		} else {
+			printf("%s- no results -%s\n\n",
+			    colors.magenta, colors.reset);
+		}
+
+		for (Host *h = hosts; h != NULL; h = h->next) {
+			free(h->cp->output.data);
+			h->cp->output.data = NULL;
+			h->cp->output.len = 0;
+		}
 	}
 }
 
 /*
- * Push an argument to the ssh base command and bounds check it.
- * The strings passed to this function need to be allocated or constantly
- * defined.
+ * The program loop for `--script`: send every step of the script to each
+ * session at once, starting up to `max_jobs` sessions at a time.  Each session
+ * ends on its own after the last step (or the first one to fail).
  */
 static void
-push_arguments(char *s, ...)
+script_loop(void)
 {
-	assert(s != NULL);
+	Host *cur_host = hosts;
+	char *input = NULL;
+	size_t input_len = 0;
 
-	static int idx = 0;
-	va_list args;
+	// wrap every step into a single input for all hosts
+	for (int i = 0; i < num_script_steps; i++) {
+		size_t len;
+		char *step = session_wrap(i + 1, script_steps[i], true, &len);
 
-	va_start(args, s);
-	while (s != NULL) {
-		if (idx >= MAX_ARGS - 2) {
-			errx(2, "too many command arguments");
+		input = realloc(input, input_len + len + 1);
+		if (input == NULL) {
+			err(3, "realloc script input");
 		}
-		base_ssh_command[idx] = s;
-		idx++;
-		s = va_arg(args, char *);
+		memcpy(input + input_len, step, len + 1);
+		input_len += len;
+		free(step);
 	}
-	va_end(args);
-}
 
-/*
- * Replace the first occurrence of char c with '\0' in a string.
- * Returns true if a replacement was made and false otherwise.
- */
-static bool
-lsplit_str(char *s, char c)
-{
-	assert(s != NULL);
+	while (cur_host != NULL || session_alive > 0) {
+		// start sessions
+		while (cur_host != NULL && session_alive < opts.max_jobs) {
+			Host *host = cur_host;
+			cur_host = cur_host->next;
 
-	for (int i = 0; s[i] != '\0'; i++) {
-		if (s[i] == c) {
-			s[i] = '\0';
-			return true;
+			if (opts.mode == MODE_JOIN) {
+				host->cp->step_outputs = safe_malloc(
+				    sizeof (Span) * num_script_steps,
+				    "step_outputs");
+				for (int i = 0; i < num_script_steps; i++) {
+					host->cp->step_outputs[i].data = NULL;
+					host->cp->step_outputs[i].len = 0;
+				}
+			}
+
+			session_start(host);
+			session_send(host, 1, num_script_steps, input,
+			    input_len);
 		}
+
+		session_poll();
 	}
 
-	return false;
+	if (opts.mode == MODE_JOIN) {
+		finish_script_join_mode();
+	}
+
+	session_finish();
+	free(input);
 }
 
 /*
- * Given a null terminated stream return whether it ends in a newline
- * character.
+ * Read the commands of a `--script` file, one per line (skipping blank lines
+ * and comments), into `script_steps`.
  */
-static bool
-ends_in_newline(const char *s)
+static void
+load_script(const char *path)
 {
-	assert(s != NULL);
+	assert(path != NULL);
 
-	int idx = strlen(s);
+	FILE *f;
+	char *line = NULL;
+	size_t line_size = 0;
+	int steps_size = 0;
+	ssize_t len;
 
-	if (idx == 0) {
-		return false;
+	f = fopen(path, "r");
+	if (f == NULL) {
+		err(2, "open script %s", path);
 	}
 
-	return s[idx - 1] == '\n';
-}
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		char *step;
 
-/*
- * Get the current monotonic time in ms.
- */
-static long
-monotonic_time_ms(void)
-{
-	struct timespec t;
+		// strip the newline and skip blank lines and comments
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		step = line + strspn(line, " \t");
+		if (*step == '\0' || *step == '#') {
+			continue;
+		}
 
-	if (clock_gettime(CLOCK_MONOTONIC, &t) == -1) {
-		err(3, "clock_gettime");
+		// grow the list
+		if (num_script_steps == steps_size) {
+			steps_size = steps_size > 0 ? steps_size * 2 : 8;
+			script_steps = realloc(script_steps,
+			    sizeof (char *) * steps_size);
+			if (script_steps == NULL) {
+				err(3, "realloc script steps");
+			}
+		}
+
+		step = strdup(line);
+		if (step == NULL) {
+			err(3, "strdup script step");
+		}
+		script_steps[num_script_steps++] = step;
+	}
+	if (ferror(f)) {
+		err(2, "read script %s", path);
 	}
 
-	return (t.tv_sec * 1e3) + (t.tv_nsec / 1e6);
+	fclose(f);
+	free(line);
+
+	if (num_script_steps == 0) {
+		errx(2, "no commands in script %s", path);
+	}
 }
 
 /*
- * Print the header for a given host.
+ * Create an empty HostSet.
  */
-static void
-print_host_header(Host *host)
+static HostSet *
+host_set_create(void)
 {
-	assert(host != NULL);
+	HostSet *set = safe_malloc(sizeof (HostSet), "host_set_create");
+
+	set->arena_size = 4 * 1024;
+	set->arena_len = 0;
+	set->arena = safe_malloc(set->arena_size, "host_set arena");
+	set->num_slots = 1024;
+	set->num_names = 0;
+	set->slots = calloc(set->num_slots, sizeof (HostSetSlot));
+	if (set->slots == NULL) {
+		err(3, "calloc host_set slots");
+	}
 
-	printf("[%s%s%s]", colors.cyan, host->name, colors.reset);
+	return set;
 }
 
 /*
- * Given a Host object and a buffer of a suitable size, fill the buffer with
- * the required arguments to exec a child process.
+ * Double the size of the HostSet table and reinsert all of the names.  The
+ * names themselves don't move as the table only holds offsets to them.
  */
 static void
-build_ssh_command(Host *host, char **command, int size)
+host_set_grow(HostSet *set)
 {
-	assert(host != NULL);
-	assert(command != NULL);
-	assert(size > 0);
+	assert(set != NULL);
 
-	char *name_array[] = {host->name, NULL};
-	int idx = 0;
+	HostSetSlot *old_slots = set->slots;
+	size_t old_num_slots = set->num_slots;
 
-	/*
-	 * construct SSH command like:
-	 * base_ssh_command + host name + remote_command
-	 * as a null terminated array called "command"
-	 */
-	char **items_arr[] = {
-		base_ssh_command,
-		name_array,
-		remote_command,
-		NULL
-	};
-	char ***items = items_arr;
-	while (*items != NULL) {
-		char **item = *items;
-		while (*item != NULL) {
-			char *arg = *item;
-			command[idx++] = arg;
-			if (idx >= size) {
-				errx(2, "too many arguments (<= %d)", size);
-			}
+	set->num_slots *= 2;
+	set->slots = calloc(set->num_slots, sizeof (HostSetSlot));
+	if (set->slots == NULL) {
+		err(3, "calloc host_set slots");
+	}
 
-			item++;
+	for (size_t i = 0; i < old_num_slots; i++) {
+		size_t idx;
+
+		if (old_slots[i].offset == 0) {
+			continue;
 		}
 
-		items++;
+		idx = old_slots[i].hash & (set->num_slots - 1);
+		while (set->slots[idx].offset != 0) {
+			idx = (idx + 1) & (set->num_slots - 1);
+		}
+		set->slots[idx] = old_slots[i];
 	}
 
-	assert(idx < size);
-	assert(command[size - 1] == NULL);
+	free(old_slots);
 }
 
 /*
- * Fork and exec a subprocess.  This function is responsible for creating and
- * initializing the stdio pipes and attaching them to the given Host object.
+ * Add a name to the HostSet.  Returns true if the name was added and false if
+ * it was already in the set.
  */
-static void
-spawn_child_process(Host *host)
+static bool
+host_set_add(HostSet *set, const char *name, size_t len)
 {
-	assert(host != NULL);
-	assert(host->name != NULL);
-	assert(host->cp != NULL);
+	assert(set != NULL);
+	assert(name != NULL);
 
-	char *command[MAX_ARGS] = {NULL};
-	int stderr_fd[2];
-	int stdio_fd[2];
-	int stdout_fd[2];
-	pid_t pid;
+	uint64_t hash = hash_bytes(name, len);
+	size_t idx = hash & (set->num_slots - 1);
 
-	// build the ssh command
-	build_ssh_command(host, command, MAX_ARGS);
+	// look for the name
+	while (set->slots[idx].offset != 0) {
+		HostSetSlot *slot = &set->slots[idx];
+		char *s = set->arena + slot->offset - 1;
 
-	// create the stdio pipes
-	switch (opts.mode) {
-	case MODE_JOIN:
-		// join mode uses a sharded stdout/stderr pipe
-		make_pipe(stdio_fd);
-		break;
-	default:
-		// all other modes use a pipe per stream
-		make_pipe(stdout_fd);
-		make_pipe(stderr_fd);
-	}
+		if (slot->hash == hash && strncmp(s, name, len) == 0 &&
+		    s[len] == '\0') {
+			return false;
+		}
 
-	// fork the process
-	pid = fork();
-	if (pid == -1) {
-		err(3, "fork");
+		idx = (idx + 1) & (set->num_slots - 1);
 	}
 
-	// in child
-	if (pid == 0) {
-		int *err_fd;
-		int *out_fd;
-		switch (opts.mode) {
-		case MODE_JOIN:
-			out_fd = stdio_fd;
-			err_fd = stdio_fd;
-			break;
-		default:
-			out_fd = stdout_fd;
-			err_fd = stderr_fd;
-			break;
-		}
-
-		if (dup2(out_fd[PIPE_WRITE_END], STDOUT_FILENO) == -1) {
-			err(3, "dup2 stdout");
-		}
-		if (dup2(err_fd[PIPE_WRITE_END], STDERR_FILENO) == -1) {
-			err(3, "dup2 stderr");
+	// copy the name into the arena
+	while (set->arena_len + len + 1 > set->arena_size) {
+		set->arena_size *= 2;
+		set->arena = realloc(set->arena, set->arena_size);
+		if (set->arena == NULL) {
+			err(3, "realloc host_set arena");
 		}
-
-		execvp(command[0], command);
-		err(3, "exec");
 	}
+	memcpy(set->arena + set->arena_len, name, len);
+	set->arena[set->arena_len + len] = '\0';
 
-	// in parent
+	set->slots[idx].hash = hash;
+	set->slots[idx].offset = set->arena_len + 1;
+	set->arena_len += len + 1;
+	set->num_names++;
 
-	// close write ends and save read ends
-	switch (opts.mode) {
-	case MODE_JOIN:
-		close(stdio_fd[PIPE_WRITE_END]);
-		host->cp->stdio_fd = stdio_fd[PIPE_READ_END];
-		break;
-	default:
-		close(stdout_fd[PIPE_WRITE_END]);
-		close(stderr_fd[PIPE_WRITE_END]);
-		host->cp->stdout_fd = stdout_fd[PIPE_READ_END];
-		host->cp->stderr_fd = stderr_fd[PIPE_READ_END];
-		break;
+	// keep the load factor under 1/2
+	if (set->num_names * 2 > set->num_slots) {
+		host_set_grow(set);
 	}
 
-	// save data
-	host->cp->pid = pid;
-	host->cp->started_time = monotonic_time_ms();
-	host->cp->state = CP_STATE_RUNNING;
-
-	DEBUG("%s%d%s %s%s%s spawned\n",
-	    colors.magenta, host->cp->pid, colors.reset,
-	    colors.cyan, host->name, colors.reset);
+	return true;
 }
 
 /*
- * Register a specific fd to the fdwatcher..
+ * Free a HostSet.
  */
 static void
-register_child_process_fd(Host *host, enum PipeType type)
+host_set_destroy(HostSet *set)
 {
-	FdEvent *fdev = fdev_create(host, type);
+	if (set == NULL) {
+		return;
+	}
 
-	fdwatcher_add(fdw, fdev->fd, fdev);
+	free(set->arena);
+	free(set->slots);
+	free(set);
 }
 
 /*
- * Given a Host object that has had its child process spawned add both of its
- * pipes fds to the fdwatcher for events.
+ * Check if the given Host has been seen before (for `--dedupe`).  Hostnames
+ * are compared case-insensitively, and after trimming the domain if `-t` is
+ * set.
  */
-static void
-register_child_process_fds(Host *host)
+static bool
+host_is_duplicate(HostSet *set, Host *host)
 {
+	assert(set != NULL);
 	assert(host != NULL);
 
-	switch (opts.mode) {
-	case MODE_JOIN:
-		register_child_process_fd(host, PIPE_STDIO);
-		break;
-	default:
-		register_child_process_fd(host, PIPE_STDOUT);
-		register_child_process_fd(host, PIPE_STDERR);
-		break;
+	char name[_POSIX_HOST_NAME_MAX];
+	size_t len;
+
+	for (len = 0; host->name[len] != '\0'; len++) {
+		if (opts.trim && host->name[len] == '.') {
+			break;
+		}
+		if (len == sizeof (name) - 1) {
+			errx(2, "hostname too long (>= %d chars)\n%s",
+			    _POSIX_HOST_NAME_MAX, host->name);
+		}
+		name[len] = tolower((unsigned char)host->name[len]);
 	}
+
+	return !host_set_add(set, name, len);
 }
 
 /*
- * Call waitpid on the subprocess associated with the given Host object.  This
- * function will reap the process, set the exit code and remove the pid from
- * the Host object, and optionally print the exited message if opts.exit_codes
- * or opts.debug is set.
+ * Get a pseudo-random number in the range [0, n) (splitmix64).
  */
-static void
-wait_for_child(Host *host)
+static long
+random_below(long n)
 {
-	assert(host != NULL);
-	assert(host->cp != NULL);
-
-	ChildProcess *cp = host->cp;
-	int status;
-	pid_t pid;
-
-	// reap the child
-	pid = waitpid(cp->pid, &status, 0);
-
-	if (pid < 0) {
-		err(3, "waitpid");
-	}
-
-	// set the host as closed
-	cp->exit_code = WEXITSTATUS(status);
-	cp->pid = -2;
-	cp->finished_time = monotonic_time_ms();
-	cp->state = CP_STATE_DONE;
-
-	// print the exit message
-	if (opts.exit_codes || opts.debug) {
-		char *code_color = cp->exit_code == 0 ?
-		    colors.green : colors.red;
-		long delta = cp->finished_time - cp->started_time;
-
-		// check if a newline is needed
-		if (!newline_printed) {
-			printf("\n");
-			newline_printed = true;
-		}
+	assert(n > 0);
 
-		// print the exit status
-		if (opts.debug) {
-			printf("[%s%s%s] %s%d%s %s%s%s exited: %s%d%s ",
-			    colors.cyan, PROG_NAME, colors.reset,
-			    colors.magenta, pid, colors.reset,
-			    colors.cyan, host->name, colors.reset,
-			    code_color, cp->exit_code, colors.reset);
-		} else {
-			assert(opts.exit_codes);
-			printf("[%s%s%s] exited: %s%d%s ",
-			    colors.cyan, host->name, colors.reset,
-			    code_color, cp->exit_code, colors.reset);
-		}
-		printf("(%s%ld%s ms)\n", colors.magenta, delta, colors.reset);
-	}
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	z = z ^ (z >> 31);
+
+	return (long)(z % (uint64_t)n);
 }
 
 /*
- * Prints the given linebuf with the given color as well as the host header.
- *
- * (used for line mode).
+ * Given a space-separated list of tags, return the length of the first tag.
  */
-static void
-print_line_buffer(FdEvent *fdev)
+static int
+first_tag_length(const char *tags)
 {
-	assert(fdev != NULL);
-	assert(fdev->host != NULL);
-	assert(fdev->buffer != NULL);
+	assert(tags != NULL);
 
-	char *color = fdev_get_color(fdev);
+	int len = 0;
 
-	if (!opts.anonymous) {
-		print_host_header(fdev->host);
-		printf(" ");
+	while (tags[len] != '\0' && tags[len] != ' ') {
+		len++;
 	}
 
-	printf("%s%s%s", color, fdev->buffer, colors.reset);
+	return len;
 }
 
 /*
- * Called by read_active_fd when processing read bytes in line mode.
+ * Check if the given Host has the given tag.
  */
-static void
-process_data_line(FdEvent *fdev, char *buf, int bytes)
+static bool
+host_has_tag(Host *host, const char *tag)
 {
-	assert(fdev != NULL);
-	assert(fdev->host != NULL);
-	assert(fdev->buffer != NULL);
-	assert(buf != NULL);
-	assert(bytes > 0);
+	assert(host != NULL);
+	assert(tag != NULL);
 
-	// loop data character-by-character
-	for (int i = 0; i < bytes; i++) {
-		char c = buf[i];
+	int tag_len = strlen(tag);
+	char *s = host->tags;
 
-		if (fdev->offset < opts.max_line_length) {
-			// buffer has room for character
-			fdev->buffer[fdev->offset] = c;
-			fdev->offset++;
-		} else if (fdev->offset == opts.max_line_length) {
-			// no more room, call it a newline
-			fdev->buffer[fdev->offset] = '\n';
-			fdev->offset++;
-		}
+	while (s != NULL && *s != '\0') {
+		int len = first_tag_length(s);
 
-		// got a newline! print it
-		if (c == '\n') {
-			assert(fdev->offset > 0);
-			assert(fdev->offset < opts.max_line_length + 2);
+		if (len == tag_len && strncmp(s, tag, len) == 0) {
+			return true;
+		}
 
-			fdev->buffer[fdev->offset] = '\0';
-			print_line_buffer(fdev);
-			fdev->offset = 0;
+		s += len;
+		if (*s == ' ') {
+			s++;
 		}
 	}
+
+	return false;
 }
 
 /*
- * Called by read_active_fd when processing read bytes in group mode.
+ * Find (or create) the sample reservoir for the stratum of the given Host.
+ * When sampling with `--sample` there is a single stratum for all hosts, and
+ * with `--sample-per-tag` the stratum is the first tag of the host.
  */
-static void
-process_data_group(FdEvent *fdev, char *buf, int bytes)
+static Sample *
+sample_find(Host *host)
 {
-	assert(fdev != NULL);
-	assert(fdev->host != NULL);
-	assert(buf != NULL);
-	assert(bytes > 0);
+	assert(host != NULL);
 
-	static Host *last_host = NULL;
+	char *tag = NULL;
+	int tag_len = 0;
+	int size = opts.sample > 0 ? opts.sample : opts.sample_per_tag;
+	Sample *smp;
 
-	// processing a new host from last time
-	if (last_host != fdev->host) {
-		// print a newline if needed
-		if (!newline_printed) {
-			printf("\n");
-		}
+	if (opts.sample_per_tag > 0 && host->tags != NULL) {
+		tag = host->tags;
+		tag_len = first_tag_length(tag);
+	}
 
-		// print the host name
-		if (!opts.anonymous) {
-			print_host_header(fdev->host);
-			printf("\n");
+	for (smp = samples; smp != NULL; smp = smp->next) {
+		if (tag == NULL && smp->tag == NULL) {
+			return smp;
+		}
+		if (tag != NULL && smp->tag != NULL &&
+		    strncmp(smp->tag, tag, tag_len) == 0 &&
+		    smp->tag[tag_len] == '\0') {
+			return smp;
 		}
 	}
 
-	// write the fd data to stdout
-	printf("%s", fdev_get_color(fdev));
-	fflush(stdout);
-	if (write(STDOUT_FILENO, buf, bytes) < bytes) {
-		err(3, "write failed");
+	smp = safe_malloc(sizeof (Sample), "sample_find");
+	smp->tag = NULL;
+	if (tag != NULL && (smp->tag = strndup(tag, tag_len)) == NULL) {
+		err(3, "strndup sample tag");
 	}
-	printf("%s", colors.reset);
+	smp->hosts = safe_malloc(sizeof (Host *) * size, "sample hosts");
+	smp->num_hosts = 0;
+	smp->seen = 0;
+	smp->next = samples;
+	samples = smp;
 
-	// check if a newline was printed, save the last host
-	newline_printed = buf[bytes - 1] == '\n';
-	last_host = fdev->host;
+	return smp;
 }
 
 /*
- * Called by read_active_fd when processing read bytes in join mode.
+ * Offer a Host to its sample reservoir (Algorithm R).  The Host will either be
+ * kept (possibly replacing a previously sampled host) or destroyed.
  */
 static void
-process_data_join(FdEvent *fdev, char *buf, int bytes)
+sample_add(Host *host)
 {
-	assert(fdev != NULL);
-	assert(fdev->host != NULL);
-	assert(fdev->buffer != NULL);
-	assert(buf != NULL);
-	assert(bytes > 0);
+	assert(host != NULL);
 
-	// loop data character-by-character
-	for (int i = 0; i < bytes; i++) {
-		char c = buf[i];
+	Sample *smp = sample_find(host);
+	int size = opts.sample > 0 ? opts.sample : opts.sample_per_tag;
+	long idx;
 
-		// line is too long
-		if (fdev->offset < opts.max_output_length) {
-			// room for the character
-			fdev->buffer[fdev->offset] = c;
-			fdev->offset++;
-		} else if (fdev->offset == opts.max_line_length) {
-			// no more room, pad it with a nul byte
-			fdev->buffer[fdev->offset] = '\0';
-			fdev->offset++;
-		} else {
-			// we are overbook, just break
-			break;
-		}
+	smp->seen++;
+
+	// reservoir isn't full yet
+	if (smp->num_hosts < size) {
+		smp->hosts[smp->num_hosts++] = host;
+		return;
+	}
+
+	// replace a random host with a probability of size/seen
+	idx = random_below(smp->seen);
+	if (idx < size) {
+		host_destroy(smp->hosts[idx]);
+		smp->hosts[idx] = host;
+	} else {
+		host_destroy(host);
 	}
 }
 
 /*
- * Called by read_active_fd when finishing an fd in line mode.
+ * qsort comparison function to sort Host pointers by their input position.
  */
-static void
-fd_done_line(FdEvent *fdev)
+static int
+host_id_compare(const void *a, const void *b)
 {
-	// check for a remaining line
-	if (fdev->offset == 0) {
-		return;
+	const Host *h1 = *(Host * const *)a;
+	const Host *h2 = *(Host * const *)b;
+
+	return (h1->id > h2->id) - (h1->id < h2->id);
+}
+
+/*
+ * Empty the sample reservoirs into the hosts linked-list (sorted back into
+ * input order).  Returns the number of hosts sampled.
+ */
+static int
+sample_finish(void)
+{
+	Host **sampled;
+	int num_hosts = 0;
+	int idx = 0;
+
+	for (Sample *smp = samples; smp != NULL; smp = smp->next) {
+		num_hosts += smp->num_hosts;
 	}
 
-	// data remaining! put a newline if it didn't have one
-	if (fdev->buffer[fdev->offset - 1] != '\n') {
-		fdev->buffer[fdev->offset] = '\n';
-		fdev->offset++;
+	if (num_hosts == 0) {
+		goto done;
 	}
-	assert(fdev->offset < opts.max_line_length + 2);
 
-	fdev->buffer[fdev->offset] = '\0';
-	print_line_buffer(fdev);
-	fdev->offset = 0;
+	// gather all of the sampled hosts and sort them
+	sampled = safe_malloc(sizeof (Host *) * num_hosts, "sample_finish");
+	for (Sample *smp = samples; smp != NULL; smp = smp->next) {
+		for (int i = 0; i < smp->num_hosts; i++) {
+			sampled[idx++] = smp->hosts[i];
+		}
+	}
+	assert(idx == num_hosts);
+	qsort(sampled, num_hosts, sizeof (Host *), host_id_compare);
+
+	// link them together
+	for (int i = 0; i < num_hosts - 1; i++) {
+		sampled[i]->next = sampled[i + 1];
+	}
+	sampled[num_hosts - 1]->next = NULL;
+	hosts = sampled[0];
+
+	free(sampled);
+
+done:
+	while (samples != NULL) {
+		Sample *smp = samples;
+		samples = smp->next;
+		free(smp->tag);
+		free(smp->hosts);
+		free(smp);
+	}
+
+	return num_hosts;
 }
 
 /*
- * Called by read_active_fd when finishing an fd in group mode.
+ * Squeeze all runs of whitespace in the given tags string to a single space and
+ * remove any trailing whitespace.  Returns NULL if there are no tags.
  */
-static void
-fd_done_group(FdEvent *fdev)
+static char *
+normalize_tags(char *tags)
 {
-	assert(fdev != NULL);
+	assert(tags != NULL);
 
-	// do nothing
+	char *out = tags;
+	char *in = tags;
+
+	while (*in != '\0') {
+		if (*in == ' ' || *in == '\t') {
+			while (*in == ' ' || *in == '\t') {
+				in++;
+			}
+			if (*in != '\0' && out != tags) {
+				*out++ = ' ';
+			}
+			continue;
+		}
+		*out++ = *in++;
+	}
+	*out = '\0';
+
+	return out == tags ? NULL : tags;
 }
 
 /*
- * Called by read_active_fd when finishing an fd in join mode.
+ * Initialize a HostReader.
  */
 static void
-fd_done_join(FdEvent *fdev)
+host_reader_init(HostReader *r)
 {
-	assert(fdev != NULL);
-	assert(fdev->host != NULL);
-	assert(fdev->host->cp != NULL);
+	assert(r != NULL);
 
-	// copy fdev buffer to host object for later analysis
-	if (fdev->offset <= opts.max_output_length) {
-		fdev->buffer[fdev->offset] = '\0';
-		fdev->offset++;
-	}
-	fdev->host->cp->output = fdev->buffer;
-	fdev->buffer = NULL;
+	r->tail = NULL;
+	r->seen = opts.dedupe ? host_set_create() : NULL;
+	r->num_hosts = 0;
+	r->num_dupes = 0;
 }
 
 /*
- * Read data from FdEvent until end or would-block
+ * Add a Host to the hosts list, taking `--tag`, `--dedupe` and sampling into
+ * account.  The Host will be destroyed if it isn't used.
  */
-static bool
-read_active_fd(FdEvent *fdev)
+static void
+host_reader_add(HostReader *r, Host *host)
 {
-	Host *host;
-	char buf[BUFSIZ];
-	int *fd;
-	int bytes;
-
-	assert(fdev != NULL);
-	assert(fdev->host != NULL);
+	assert(r != NULL);
+	assert(host != NULL);
 
-	host = fdev->host;
+	// check tag filters
+	for (int i = 0; i < num_tag_filters; i++) {
+		if (!host_has_tag(host, tag_filters[i])) {
+			host_destroy(host);
+			return;
+		}
+	}
 
-	switch (fdev->type) {
-	case PIPE_STDOUT: fd = &host->cp->stdout_fd; break;
-	case PIPE_STDERR: fd = &host->cp->stderr_fd; break;
-	case PIPE_STDIO: fd = &host->cp->stdio_fd; break;
-	default: errx(3, "unknown type %d", fdev->type);
+	// skip duplicate hosts
+	if (r->seen != NULL && host_is_duplicate(r->seen, host)) {
+		host_destroy(host);
+		r->num_dupes++;
+		return;
 	}
 
-	// loop while bytes available
-	while ((bytes = read(*fd, buf, BUFSIZ)) > -1) {
-		// done reading!
-		if (bytes == 0) {
-			// remove the fd and close it
-			fdwatcher_remove(fdw, *fd);
-			close(*fd);
-			*fd = -2;
-
-			switch (opts.mode) {
-			case MODE_LINE: fd_done_line(fdev); break;
-			case MODE_GROUP: fd_done_group(fdev); break;
-			case MODE_JOIN: fd_done_join(fdev); break;
-			default: errx(3, "unknown mode: %d", opts.mode);
-			}
+	// sampled hosts are linked together once the input is read
+	if (opts.sample > 0 || opts.sample_per_tag > 0) {
+		sample_add(host);
+		return;
+	}
 
-			fdev_destroy(fdev);
+	// set head of list
+	if (hosts == NULL) {
+		hosts = host;
+	}
 
-			return true;
-		}
+	// set tail of list
+	if (r->tail != NULL) {
+		r->tail->next = host;
+	}
 
-		// do nothing if in silent mode
-		if (opts.silent) {
-			continue;
-		}
+	r->tail = host;
+	r->num_hosts++;
+}
 
-		// handle bytes in different modes
-		switch (opts.mode) {
-		case MODE_JOIN: process_data_join(fdev, buf, bytes); break;
-		case MODE_LINE: process_data_line(fdev, buf, bytes); break;
-		case MODE_GROUP: process_data_group(fdev, buf, bytes); break;
-		default: errx(3, "unknown mode: %d", opts.mode); break;
-		}
+/*
+ * Finish reading hosts in.  Returns the number of hosts in the list.
+ */
+static int
+host_reader_finish(HostReader *r)
+{
+	assert(r != NULL);
+
+	if (r->seen != NULL) {
+		DEBUG("skipped %s%d%s duplicate host%s\n",
+		    colors.magenta, r->num_dupes, colors.reset,
+		    pluralize(r->num_dupes));
+		host_set_destroy(r->seen);
+		r->seen = NULL;
 	}
 
-	assert(bytes < 0);
-
-	// handle read error
-	if (errno == EWOULDBLOCK) {
-		return false;
+	if (opts.sample > 0 || opts.sample_per_tag > 0) {
+		assert(hosts == NULL);
+		r->num_hosts = sample_finish();
 	}
 
-	err(3, "read failed");
+	return r->num_hosts;
 }
 
 /*
- * Finish analysis for join mode.
- *
- * In join mode, all of the stdout and stderr has been buffered and is
- * processed in this function.
- *
- * This function could possibly be made simpler with hash tables, but for now
- * it seems to work just fine.  The way it works is:
- *
- * 1. Loop all hosts.
- *   a. Assign each "output" an index (stored as cp->output_idx), the first
- *      host encountered is index 0.
- *   b. For each host looped, do *another* loop of the hosts starting at our
- *      current host and strcmp the output.  If the output is the same, assign
- *      it the same index.  If the output is different, skip it for now.
- *   c. Move onto the next host without an index and assign it idx + 1.
- * 2. Print the number of unique results seen (how many indices were created).
- * 3. Loop the indices and print the unique output + the hostnames.
+ * Parse the hosts file and create the Host structs
  */
-static void
-finish_join_mode(int num_hosts)
+static int
+parse_hosts(FILE *f)
 {
-	int idx = 0;
-	int *count = safe_malloc(sizeof (int) * num_hosts,
-	    "finish_join_mode count");
+	HostReader r;
+	char line[MAX_HOSTS_LINE_LENGTH];
+	int lineno = 1;
 
-	// loop the hosts to check and categorize their output
-	for (Host *h1 = hosts; h1 != NULL; h1 = h1->next) {
-		int num_same = 1;
+	assert(f != NULL);
 
-		// this host already processed
-		if (h1->cp->output_idx >= 0) {
-			continue;
-		}
+	host_reader_init(&r);
 
-		h1->cp->output_idx = idx;
+	while (fgets(line, MAX_HOSTS_LINE_LENGTH, f) != NULL) {
+		char *tags = NULL;
+		char prefix = line[0];
 
-		for (Host *h2 = h1->next; h2 != NULL; h2 = h2->next) {
-			// skip already processed host
-			if (h2->cp->output_idx >= 0) {
-				continue;
-			}
+		// skip comments and blank lines
+		switch (prefix) {
+		case '#':
+		case ' ':
+		case '\n':
+		case '\0':
+			goto next;
+		}
 
-			// check if output is the same
-			if (strcmp(h1->cp->output, h2->cp->output) == 0) {
-				h2->cp->output_idx = idx;
-				num_same++;
+		/*
+		 * remove the ending newline - if a newline is not present the
+		 * line is too long
+		 */
+		if (!lsplit_str(line, '\n')) {
+			errx(2, "hosts file line %d too long (>= %d chars)\n%s",
+			    lineno, MAX_HOSTS_LINE_LENGTH, line);
+		}
+
+		// split off the tags (if any) from the hostname
+		for (char *c = line; *c != '\0'; c++) {
+			if (*c == ' ' || *c == '\t') {
+				*c = '\0';
+				tags = normalize_tags(c + 1);
+				break;
 			}
+		}
 
+		if (strlen(line) >= _POSIX_HOST_NAME_MAX) {
+			errx(2, "hosts file line %d hostname too long "
+			    "(>= %d chars)\n%s",
+			    lineno, _POSIX_HOST_NAME_MAX, line);
 		}
 
-		count[idx] = num_same;
-		idx++;
+		// create Host
+		host_reader_add(&r, host_create(line, tags, lineno));
+
+next:
+		lineno++;
 	}
 
-	printf("finished with %s%d%s unique result%s\n\n",
-	    colors.magenta, idx, colors.reset, pluralize(idx));
+	if (ferror(f)) {
+		errx(2, "failed to read hosts file");
+	}
+	assert(feof(f));
 
-	// loop the unique results
-	for (int i = 0; i < idx; i++) {
-		char *output = NULL;
+	return host_reader_finish(&r);
+}
 
-		printf("hosts (%s%d%s/%s%d%s):%s",
-		    colors.magenta, count[i], colors.reset,
-		    colors.magenta, num_hosts, colors.reset,
-		    colors.cyan);
+/*
+ * Create the Host structs from a compiled HostDb.  If any `--tag` filters are
+ * given, only the hosts for the most selective tag (found in the tag index)
+ * are looked at.
+ */
+static int
+load_hostdb(HostDb *db)
+{
+	assert(db != NULL);
 
-		for (Host *h = hosts; h != NULL; h = h->next) {
-			if (h->cp->output_idx != i) {
-				continue;
-			}
+	HostReader r;
+	const uint32_t *idx = NULL;
+	bool indexed = false;
+	uint32_t num_hosts = hostdb_num_hosts(db);
+	int count = num_hosts;
 
-			output = h->cp->output;
-			printf(" %s", h->name);
-		}
-		assert(output != NULL);
+	if (num_hosts > INT_MAX) {
+		errx(2, "too many hosts in compiled hosts file");
+	}
 
-		// print the output
-		printf("%s\n%s", colors.reset, output);
+	// find the smallest list of hosts from the tag index
+	for (int i = 0; i < num_tag_filters; i++) {
+		const uint32_t *tag_idx;
+		int n = hostdb_tag_hosts(db, tag_filters[i], &tag_idx);
 
-		// alert if the output is empty
-		if (output[0] == '\0') {
-			printf("%s- no output -%s",
-			    colors.magenta, colors.reset);
+		if (n == -1) {
+			errx(2, "corrupt compiled hosts file (tag index)");
+		}
+		if (!indexed || n < count) {
+			idx = tag_idx;
+			count = n;
+			indexed = true;
 		}
+	}
 
-		// print a newline if there isn't one
-		if (!ends_in_newline(output)) {
-			printf("\n");
+	host_reader_init(&r);
+
+	for (int i = 0; i < count; i++) {
+		uint32_t h = indexed ? idx[i] : (uint32_t)i;
+		char *name;
+
+		// names are validated like parse_hosts does for text files
+		if (h >= num_hosts ||
+		    (name = hostdb_name(db, h)) == NULL ||
+		    name[0] == '\0' ||
+		    strlen(name) >= _POSIX_HOST_NAME_MAX) {
+			errx(2, "corrupt compiled hosts file (host %u)", h);
 		}
 
-		printf("\n");
+		host_reader_add(&r, host_create_borrowed(name,
+		    hostdb_tags(db, h), hostdb_id(db, h)));
 	}
 
-	free(count);
+	return host_reader_finish(&r);
 }
 
 /*
- * Print the progress line as hosts finish in join mode.
+ * Compile a hosts file (`--compile-hosts`) into a HostDb.
  */
 static void
-print_progress_line(int done, int num_hosts)
+compile_hosts(const char *input, const char *output)
 {
-	printf("[%s%s%s] finished %s%d%s/%s%d%s\r",
-	    colors.cyan, PROG_NAME, colors.reset,
-	    colors.magenta, done, colors.reset,
-	    colors.magenta, num_hosts, colors.reset);
-	fflush(stdout);
-}
+	assert(input != NULL);
+	assert(output != NULL);
 
-/*
- * The main program loop that should be called from main().
- */
-static void
-main_loop(int num_hosts)
-{
-	Host *cur_host = hosts;
-	int done = 0;
-	int outstanding = 0;
-	void *fdevs[FDW_MAX_EVENTS];
+	FILE *f = stdin;
+	HostDbWriter *w;
+	int num_hosts;
 
-	if (opts.mode == MODE_JOIN && stdout_isatty) {
-		print_progress_line(done, num_hosts);
+	if (strcmp(input, "-") != 0) {
+		f = fopen(input, "r");
+		if (f == NULL) {
+			err(2, "open %s", input);
+		}
 	}
 
-	// loop while there are still child processes
-	while (cur_host != NULL || outstanding > 0) {
-		assert(outstanding <= opts.max_jobs);
-
-		int num_events;
+	num_hosts = parse_hosts(f);
 
-		// create child processes
-		while (cur_host != NULL && outstanding < opts.max_jobs) {
-			spawn_child_process(cur_host);
+	if (f != stdin) {
+		fclose(f);
+	}
 
-			// chop off the domain portion of the name if -t
-			if (opts.trim) {
-				lsplit_str(cur_host->name, '.');
-			}
+	w = hostdb_writer_create();
+	if (w == NULL) {
+		err(3, "hostdb_writer_create");
+	}
 
-			register_child_process_fds(cur_host);
+	while (hosts != NULL) {
+		Host *host = hosts;
 
-			outstanding++;
-			cur_host = cur_host->next;
+		if (hostdb_writer_add(w, host->name, host->tags,
+		    host->id) == -1) {
+			err(3, "hostdb_writer_add");
 		}
 
-		// wait for fd events
-		num_events = fdwatcher_wait(fdw, fdevs, FDW_MAX_EVENTS,
-		    FDW_WAIT_TIMEOUT);
-		if (num_events == -1) {
-			if (errno == EINTR) {
-				continue;
-			}
-			err(3, "fdwatcher_wait");
-		}
+		hosts = host->next;
+		host_destroy(host);
+	}
 
-		// loop fd events
-		for (int i = 0; i < num_events; i++) {
-			FdEvent *fdev = fdevs[i];
-			Host *host = fdev->host;
+	if (hostdb_writer_write(w, output) == -1) {
+		err(3, "write %s", output);
+	}
+	hostdb_writer_destroy(w);
 
-			assert(host != NULL);
+	printf("compiled %s%d%s host%s to %s%s%s\n",
+	    colors.magenta, num_hosts, colors.reset, pluralize(num_hosts),
+	    colors.green, output, colors.reset);
+}
 
-			// read the active fd until it would block or is done
-			bool fd_closed = read_active_fd(fdev);
+#ifdef __linux__
+/*
+ * Parse a list of cpus like "0-3,8" into a cpu set.  Returns false if the list
+ * is invalid or empty.
+ */
+static bool
+parse_cpu_list(const char *s, cpu_set_t *set)
+{
+	assert(s != NULL);
+	assert(set != NULL);
 
-			// check if the childs stdio is done and reap it
-			if (fd_closed && child_process_stdio_done(host->cp)) {
-				wait_for_child(host);
-				outstanding--;
-				done++;
+	CPU_ZERO(set);
 
-				if (opts.mode == MODE_JOIN && stdout_isatty) {
-					print_progress_line(done, num_hosts);
-					if (done == num_hosts) {
-						printf("\n\n");
-					}
-				}
+	while (*s != '\0') {
+		char *end;
+		long lo;
+		long hi;
+
+		if (!isdigit((unsigned char)*s)) {
+			return false;
+		}
+		lo = hi = strtol(s, &end, 10);
+
+		// a range of cpus
+		if (*end == '-') {
+			s = end + 1;
+			if (!isdigit((unsigned char)*s)) {
+				return false;
 			}
+			hi = strtol(s, &end, 10);
+		}
+		if (hi < lo || hi >= CPU_SETSIZE) {
+			return false;
+		}
+
+		for (long cpu = lo; cpu <= hi; cpu++) {
+			CPU_SET(cpu, set);
+		}
+
+		s = end;
+		if (*s == ',' && s[1] != '\0') {
+			s++;
+		} else if (*s != '\0') {
+			return false;
 		}
 	}
+
+	return CPU_COUNT(set) > 0;
 }
+#endif
 
 /*
- * Parse the hosts file and create the Host structs
+ * Set up the scheduling options (`--ioprio`, `--child-cpus` and
+ * `--loop-cpus`), pinning sshp to its cpus now.  Exits on invalid values, or
+ * if the options aren't supported on this system.
  */
-static int
-parse_hosts(FILE *f)
+static void
+setup_scheduling(void)
 {
-	Host *tail = NULL;
-	char hostname[_POSIX_HOST_NAME_MAX];
-	int lineno = 1;
-	int num_hosts = 0;
-
-	assert(f != NULL);
-
-	while (fgets(hostname, _POSIX_HOST_NAME_MAX, f) != NULL) {
-		Host *host;
-		char prefix = hostname[0];
+	if (opts.nice < -20 || opts.nice > 19) {
+		errx(2, "invalid value for `--nice`: %d", opts.nice);
+	}
 
-		// skip comments and blank lines
-		switch (prefix) {
-		case '#':
-		case ' ':
-		case '\n':
-		case '\0':
-			goto next;
+#ifdef __linux__
+	cpu_set_t loop_cpus;
+
+	// io priority: idle, or a best-effort level (0 is the highest)
+	if (opts.ioprio != NULL && strcmp(opts.ioprio, "idle") == 0) {
+		child_ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+	} else if (opts.ioprio != NULL) {
+		if (opts.ioprio[0] < '0' || opts.ioprio[0] > '7' ||
+		    opts.ioprio[1] != '\0') {
+			errx(2, "invalid value for `--ioprio`: '%s'",
+			    opts.ioprio);
 		}
+		child_ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT |
+		    (opts.ioprio[0] - '0');
+	}
 
-		/*
-		 * remove the ending newline - if a newline is not present the
-		 * line is too long
-		 */
-		if (!lsplit_str(hostname, '\n')) {
-			errx(2, "hosts file line %d too long (>= %d chars)\n%s",
-			    lineno, _POSIX_HOST_NAME_MAX, hostname);
+	if (opts.child_cpus != NULL) {
+		if (!parse_cpu_list(opts.child_cpus, &child_cpus)) {
+			errx(2, "invalid value for `--child-cpus`: '%s'",
+			    opts.child_cpus);
 		}
+		child_cpus_set = true;
+	}
 
-		// create Host
-		host = host_create(hostname);
+	if (opts.loop_cpus != NULL) {
+		if (!parse_cpu_list(opts.loop_cpus, &loop_cpus)) {
+			errx(2, "invalid value for `--loop-cpus`: '%s'",
+			    opts.loop_cpus);
+		}
 
-		// set head of list
-		if (hosts == NULL) {
-			hosts = host;
+		// children keep the cpus sshp had unless told otherwise
+		if (!child_cpus_set) {
+			if (sched_getaffinity(0, sizeof (child_cpus),
+			    &child_cpus) == -1) {
+				err(3, "sched_getaffinity");
+			}
+			child_cpus_set = true;
 		}
 
-		// set tail of list
-		if (tail != NULL) {
-			tail->next = host;
+		if (sched_setaffinity(0, sizeof (loop_cpus), &loop_cpus) ==
+		    -1) {
+			err(3, "pin to `--loop-cpus` %s", opts.loop_cpus);
 		}
+	}
+#else
+	if (opts.ioprio != NULL || opts.child_cpus != NULL ||
+	    opts.loop_cpus != NULL) {
+		errx(2, "`%s` is only supported on Linux",
+		    opts.ioprio != NULL ? "--ioprio" :
+		    opts.child_cpus != NULL ? "--child-cpus" : "--loop-cpus");
+	}
+#endif
+}
 
-		tail = host;
-		num_hosts++;
+/*
+ * Check if an ssh `-o` option (like "Port=22" or "port 22") sets one of the
+ * given keys (a NULL terminated list, matched ignoring case as ssh does).
+ */
+static bool
+ssh_option_sets(const char *opt, const char * const *keys)
+{
+	assert(opt != NULL);
+	assert(keys != NULL);
 
-next:
-		lineno++;
+	size_t len = strcspn(opt, "= \t");
+
+	for (const char * const *key = keys; *key != NULL; key++) {
+		if (strlen(*key) == len && strncasecmp(opt, *key, len) == 0) {
+			return true;
+		}
 	}
 
-	if (ferror(f)) {
-		errx(2, "failed to read hosts file");
+	return false;
+}
+
+/*
+ * Check if the ~/.ssh directory exists (where `--watch` keeps the control
+ * sockets of its ssh connections).
+ */
+static bool
+ssh_dir_exists(void)
+{
+	char path[PATH_MAX];
+	const char *home = getenv("HOME");
+	struct stat st;
+
+	if (home == NULL || home[0] == '\0') {
+		return false;
+	}
+	if (snprintf(path, sizeof (path), "%s/.ssh", home) >=
+	    (int)sizeof (path)) {
+		return false;
 	}
-	assert(feof(f));
 
-	return num_hosts;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
 /*
@@ -1677,8 +7427,16 @@ next:
 static void
 parse_arguments(int argc, char **argv)
 {
+	// -o options that change where ssh connects to, or how it multiplexes
+	const char * const reroute_keys[] = {"HostName", "Port",
+	    "ProxyCommand", "ProxyJump", NULL};
+	const char * const control_keys[] = {"ControlMaster", "ControlPath",
+	    "ControlPersist", NULL};
 	bool help_option = false;
 	bool unknown_option = false;
+	bool control_opt = false;
+	const char *reroute_opt = NULL;
+	const char *session_opt;
 	int opt;
 
 	// get options
@@ -1687,6 +7445,65 @@ parse_arguments(int argc, char **argv)
 		switch (opt) {
 		case 1000: opts.max_line_length = atoi(optarg); break;
 		case 1001: opts.max_output_length = atoi(optarg); break;
+		case 1002: opts.probe = true; break;
+		case 1003: opts.probe_timeout = atoi(optarg); break;
+		case 1004: opts.sample = atoi(optarg); break;
+		case 1005: opts.sample_per_tag = atoi(optarg); break;
+		case 1007: opts.dedupe = true; break;
+		case 1008: opts.compile_hosts = optarg; break;
+		case 1009: opts.cache_ttl = atoi(optarg); break;
+		case 1010: opts.cache_dir = optarg; break;
+		case 1011: opts.snapshot = optarg; break;
+		case 1012: opts.changed_since = optarg; break;
+		case 1013: opts.watch = atoi(optarg); break;
+		case 1014: opts.shell = true; break;
+		case 1015: opts.script = optarg; break;
+		case 1016: opts.collapse = atoi(optarg); break;
+		case 1017: opts.top = atoi(optarg); break;
+		case 1018:
+			if (num_aggs >= MAX_AGGS) {
+				errx(2, "too many `--agg` metrics (<= %d)",
+				    MAX_AGGS);
+			}
+			agg_metric_init(&aggs[num_aggs++], optarg);
+			break;
+		case 1019: opts.ordered = true; break;
+		case 1020: opts.block = true; break;
+		case 1021: opts.merge_stderr = true; break;
+		case 1022: opts.ranges = true; break;
+		case 1023: opts.dashboard = true; break;
+		case 1024:
+			if (strcmp(optarg, "wall") == 0) {
+				opts.timestamps = TIMESTAMP_WALL;
+			} else if (strcmp(optarg, "relative") == 0) {
+				opts.timestamps = TIMESTAMP_RELATIVE;
+			} else {
+				errx(2, "invalid value for `--timestamps`: "
+				    "'%s'", optarg);
+			}
+			break;
+		case 1025: opts.stream_lines = true; break;
+		case 1026: opts.timeout = atoi(optarg); break;
+		case 1027: opts.stats = true; break;
+		case 1028: opts.nice = atoi(optarg); break;
+		case 1029: opts.ioprio = optarg; break;
+		case 1030: opts.child_cpus = optarg; break;
+		case 1031: opts.loop_cpus = optarg; break;
+		case 1032:
+			if (num_jumps >= MAX_JUMPS) {
+				errx(2, "too many `--jump` hosts (<= %d)",
+				    MAX_JUMPS);
+			}
+			jumps[num_jumps++].spec = optarg;
+			break;
+		case 1033: opts.jump_max = atoi(optarg); break;
+		case 1006:
+			if (num_tag_filters >= MAX_TAG_FILTERS) {
+				errx(2, "too many `--tag` filters (<= %d)",
+				    MAX_TAG_FILTERS);
+			}
+			tag_filters[num_tag_filters++] = optarg;
+			break;
 		case 'a': opts.anonymous = true; break;
 		case 'c': opts.color = optarg; break;
 		case 'd': opts.debug = true; break;
@@ -1699,7 +7516,15 @@ parse_arguments(int argc, char **argv)
 		case 'l': opts.login = optarg; break;
 		case 'm': opts.max_jobs = atoi(optarg); break;
 		case 'n': opts.dry_run = true; break;
-		case 'o': push_arguments("-o", optarg, NULL); break;
+		case 'o':
+			if (ssh_option_sets(optarg, reroute_keys)) {
+				reroute_opt = optarg;
+			}
+			if (ssh_option_sets(optarg, control_keys)) {
+				control_opt = true;
+			}
+			push_arguments("-o", optarg, NULL);
+			break;
 		case 'p': opts.port = optarg; break;
 		case 'q': opts.quiet = true; break;
 		case 's': opts.silent = true; break;
@@ -1725,6 +7550,22 @@ parse_arguments(int argc, char **argv)
 	if (opts.join && opts.anonymous) {
 		errx(2, "`-j` and `-a` are mutually exclusive");
 	}
+	if (opts.ordered && opts.join) {
+		errx(2, "`--ordered` and `-j` are mutually exclusive");
+	}
+	if (opts.ordered && opts.watch > 0) {
+		errx(2, "`--ordered` and `--watch` are mutually exclusive");
+	}
+	if (opts.block && opts.join) {
+		errx(2, "`--block` and `-j` are mutually exclusive");
+	}
+	if (opts.block && opts.ordered) {
+		errx(2, "`--block` and `--ordered` are mutually exclusive");
+	}
+	if (opts.ordered || opts.block) {
+		// output is printed a host at a time like group mode
+		opts.group = true;
+	}
 	if (opts.max_line_length <= 0) {
 		errx(2, "invalid value for `--max-line-length`: %d",
 		    opts.max_line_length);
@@ -1733,6 +7574,164 @@ parse_arguments(int argc, char **argv)
 		errx(2, "invalid value for `--max-output-length`: %d",
 		    opts.max_output_length);
 	}
+	if (opts.probe_timeout <= 0) {
+		errx(2, "invalid value for `--probe-timeout`: %d",
+		    opts.probe_timeout);
+	}
+	if (opts.sample < 0) {
+		errx(2, "invalid value for `--sample`: %d", opts.sample);
+	}
+	if (opts.sample_per_tag < 0) {
+		errx(2, "invalid value for `--sample-per-tag`: %d",
+		    opts.sample_per_tag);
+	}
+	if (opts.cache_ttl < 0) {
+		errx(2, "invalid value for `--cache`: %d", opts.cache_ttl);
+	}
+	if (opts.cache_dir != NULL && opts.cache_ttl == 0) {
+		errx(2, "`--cache-dir` requires `--cache`");
+	}
+	if (opts.ranges && !opts.join) {
+		errx(2, "`--ranges` requires `-j`");
+	}
+	if (opts.dashboard && !opts.join) {
+		errx(2, "`--dashboard` requires `-j`");
+	}
+	if ((opts.snapshot != NULL || opts.changed_since != NULL) &&
+	    !opts.join) {
+		errx(2, "`--snapshot` and `--changed-since` require `-j`");
+	}
+	if (opts.watch < 0) {
+		errx(2, "invalid value for `--watch`: %d", opts.watch);
+	}
+	if (opts.watch > 0 && opts.join) {
+		errx(2, "`--watch` and `-j` are mutually exclusive");
+	}
+	if (opts.watch > 0 && opts.probe) {
+		errx(2, "`--watch` and `--probe` are mutually exclusive");
+	}
+	if (opts.watch > 0 && opts.cache_ttl > 0) {
+		errx(2, "`--watch` and `--cache` are mutually exclusive");
+	}
+	if (opts.shell && (opts.file == NULL || strcmp(opts.file, "-") == 0)) {
+		errx(2, "`--shell` reads commands from stdin, use `-f`");
+	}
+	if (opts.shell && opts.script != NULL) {
+		errx(2, "`--shell` and `--script` are mutually exclusive");
+	}
+	opts.session = opts.shell || opts.script != NULL;
+	session_opt = opts.shell ? "--shell" : "--script";
+	if (opts.session && opts.watch > 0) {
+		errx(2, "`%s` and `--watch` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.session && opts.probe) {
+		errx(2, "`%s` and `--probe` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.session && opts.cache_ttl > 0) {
+		errx(2, "`%s` and `--cache` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.session && (opts.snapshot != NULL ||
+	    opts.changed_since != NULL)) {
+		errx(2, "`%s` and `--snapshot` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.session && opts.dashboard) {
+		errx(2, "`%s` and `--dashboard` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.session && (opts.ordered || opts.block)) {
+		errx(2, "`%s` and `%s` are mutually exclusive",
+		    session_opt, opts.ordered ? "--ordered" : "--block");
+	}
+	if (opts.collapse < 0) {
+		errx(2, "invalid value for `--collapse`: %d", opts.collapse);
+	}
+	if (opts.collapse > 0 && (opts.join || opts.group)) {
+		errx(2, "`--collapse` requires line mode");
+	}
+	if (opts.collapse > 0 && opts.session) {
+		errx(2, "`%s` and `--collapse` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.top < 0) {
+		errx(2, "invalid value for `--top`: %d", opts.top);
+	}
+	if (opts.top > 0 && (opts.join || opts.group)) {
+		errx(2, "`--top` requires line mode");
+	}
+	if (opts.top > 0 && opts.collapse > 0) {
+		errx(2, "`--top` and `--collapse` are mutually exclusive");
+	}
+	if (opts.top > 0 && opts.session) {
+		errx(2, "`%s` and `--top` are mutually exclusive",
+		    session_opt);
+	}
+	if (num_aggs > 0 && (opts.join || opts.group)) {
+		errx(2, "`--agg` requires line mode");
+	}
+	if (num_aggs > 0 && (opts.top > 0 || opts.collapse > 0)) {
+		errx(2, "`--agg` and `%s` are mutually exclusive",
+		    opts.top > 0 ? "--top" : "--collapse");
+	}
+	if (num_aggs > 0 && opts.session) {
+		errx(2, "`%s` and `--agg` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.sample > 0 && opts.sample_per_tag > 0) {
+		errx(2, "`--sample` and `--sample-per-tag` are mutually "
+		    "exclusive");
+	}
+	if (opts.timeout < 0) {
+		errx(2, "invalid value for `--timeout`: %d", opts.timeout);
+	}
+	if (opts.timeout > 0 && opts.session) {
+		errx(2, "`%s` and `--timeout` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.jump_max < 0) {
+		errx(2, "invalid value for `--jump-max`: %d", opts.jump_max);
+	}
+	if (opts.jump_max > 0 && num_jumps == 0) {
+		errx(2, "`--jump-max` requires `--jump`");
+	}
+	if (num_jumps > 0 && opts.session) {
+		errx(2, "`%s` and `--jump` are mutually exclusive",
+		    session_opt);
+	}
+	if (num_jumps > 0 && opts.probe) {
+		errx(2, "`--probe` and `--jump` are mutually exclusive");
+	}
+	if (reroute_opt != NULL && opts.probe) {
+		errx(2, "`--probe` can't be used with `-o %s` (hosts are "
+		    "probed directly)", reroute_opt);
+	}
+	if (opts.stream_lines && (opts.join || opts.group)) {
+		errx(2, "`--stream-lines` requires line mode");
+	}
+	if (opts.stream_lines && opts.session) {
+		errx(2, "`%s` and `--stream-lines` are mutually exclusive",
+		    session_opt);
+	}
+	if (opts.stream_lines &&
+	    (opts.top > 0 || opts.collapse > 0 || num_aggs > 0)) {
+		errx(2, "`--stream-lines` and `%s` are mutually exclusive",
+		    opts.top > 0 ? "--top" :
+		    opts.collapse > 0 ? "--collapse" : "--agg");
+	}
+	if (opts.timestamps != TIMESTAMP_NONE && (opts.join || opts.group)) {
+		errx(2, "`--timestamps` requires line mode");
+	}
+	if (opts.timestamps != TIMESTAMP_NONE &&
+	    (opts.top > 0 || opts.collapse > 0)) {
+		errx(2, "`--timestamps` and `%s` are mutually exclusive",
+		    opts.top > 0 ? "--top" : "--collapse");
+	}
+
+	// check and apply the scheduling options
+	setup_scheduling();
 
 	// set current sshp mode
 	assert(!(opts.join && opts.group));
@@ -1771,7 +7770,20 @@ parse_arguments(int argc, char **argv)
 		exit(0);
 	}
 
-	if (argc < 1) {
+	// --compile-hosts takes an output file instead of a command
+	if (opts.compile_hosts != NULL) {
+		if (argc != 1) {
+			errx(2, "`--compile-hosts` requires an output file");
+		}
+		opts.compile_output = argv[0];
+		return;
+	}
+
+	// sessions run a shell by default
+	if (argc < 1 && opts.session) {
+		static char *shell_command[] = {"/bin/sh", NULL};
+		argv = shell_command;
+	} else if (argc < 1) {
 		errx(2, "no command specified");
 	}
 
@@ -1789,6 +7801,27 @@ parse_arguments(int argc, char **argv)
 		push_arguments("-p", opts.port, NULL);
 	}
 
+	// killed children can't prompt on the terminal (see Signals above)
+	if (opts.timeout > 0 && strcmp(base_ssh_command[0], "ssh") == 0) {
+		push_arguments("-o", "BatchMode=yes", NULL);
+	}
+
+	/*
+	 * keep ssh connections open between runs in watch mode, unless the
+	 * user set up multiplexing themselves or there's no ~/.ssh for the
+	 * control sockets
+	 */
+	if (opts.watch > 0 && strcmp(base_ssh_command[0], "ssh") == 0 &&
+	    !control_opt && ssh_dir_exists()) {
+		static char persist[64];
+
+		snprintf(persist, sizeof (persist), "ControlPersist=%d",
+		    opts.watch * 2);
+		push_arguments("-o", "ControlMaster=auto",
+		    "-o", "ControlPath=~/.ssh/sshp-%C",
+		    "-o", persist, NULL);
+	}
+
 	// save the remaining arguments as the command
 	remote_command = argv;
 }
@@ -1817,6 +7850,36 @@ main(int argc, char **argv)
 	// initalize options
 	opts.max_line_length = DEFAULT_MAX_LINE_LENGTH;
 	opts.max_output_length = DEFAULT_MAX_OUTPUT_LENGTH;
+	opts.probe = false;
+	opts.probe_timeout = DEFAULT_PROBE_TIMEOUT;
+	opts.sample = 0;
+	opts.sample_per_tag = 0;
+	opts.dedupe = false;
+	opts.compile_hosts = NULL;
+	opts.compile_output = NULL;
+	opts.cache_ttl = 0;
+	opts.cache_dir = NULL;
+	opts.snapshot = NULL;
+	opts.changed_since = NULL;
+	opts.watch = 0;
+	opts.shell = false;
+	opts.script = NULL;
+	opts.collapse = 0;
+	opts.top = 0;
+	opts.ordered = false;
+	opts.block = false;
+	opts.merge_stderr = false;
+	opts.ranges = false;
+	opts.dashboard = false;
+	opts.timestamps = TIMESTAMP_NONE;
+	opts.stream_lines = false;
+	opts.timeout = 0;
+	opts.stats = false;
+	opts.nice = 0;
+	opts.ioprio = NULL;
+	opts.child_cpus = NULL;
+	opts.loop_cpus = NULL;
+	opts.jump_max = 0;
 	opts.anonymous = false;
 	opts.color = NULL;
 	opts.debug = false;
@@ -1828,6 +7891,7 @@ main(int argc, char **argv)
 	opts.login = NULL;
 	opts.max_jobs = 50;
 	opts.mode = MODE_LINE;
+	opts.session = false;
 	opts.dry_run = false;
 	opts.port = NULL;
 	opts.quiet = false;
@@ -1851,6 +7915,15 @@ main(int argc, char **argv)
 	// handle CLI options
 	parse_arguments(argc, argv);
 
+	// seed the random number generator (used for sampling)
+	rng_state = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+
+	// compile the hosts file and exit
+	if (opts.compile_hosts != NULL) {
+		compile_hosts(opts.compile_hosts, opts.compile_output);
+		return 0;
+	}
+
 	// open /dev/null to overwrite stdin
 	dev_null_fd = open("/dev/null", O_RDONLY);
 	if (dev_null_fd == -1) {
@@ -1866,8 +7939,27 @@ main(int argc, char **argv)
 	}
 	assert(hosts_file != NULL);
 
+	// check if the hosts file is a compiled HostDb
+	if (hosts_file != stdin) {
+		char magic[HOSTDB_MAGIC_LENGTH];
+
+		if (fread(magic, 1, sizeof (magic), hosts_file) ==
+		    sizeof (magic) && hostdb_check_magic(magic)) {
+			hostdb = hostdb_open(opts.file);
+			if (hostdb == NULL) {
+				err(2, "open compiled hosts file %s",
+				    opts.file);
+			}
+		}
+		rewind(hosts_file);
+	}
+
 	// read in hosts and create structure for each one
-	num_hosts = parse_hosts(hosts_file);
+	if (hostdb != NULL) {
+		num_hosts = load_hostdb(hostdb);
+	} else {
+		num_hosts = parse_hosts(hosts_file);
+	}
 
 	// ensure at least 1 host is specified
 	if (num_hosts < 1) {
@@ -1879,18 +7971,99 @@ main(int argc, char **argv)
 		fclose(hosts_file);
 	}
 
-	// copy over stdin with /dev/null
-	if (dup2(dev_null_fd, STDIN_FILENO) == -1) {
+	// copy over stdin with /dev/null (`--shell` reads commands from it)
+	if (!opts.shell && dup2(dev_null_fd, STDIN_FILENO) == -1) {
 		err(3, "dup2 /dev/null stdin");
 	}
 	close(dev_null_fd);
 
+	// every session runs at once
+	if (opts.shell && num_hosts > opts.max_jobs) {
+		errx(2, "`--shell` runs all %d hosts at once, more than `-m` "
+		    "(%d)", num_hosts, opts.max_jobs);
+	}
+
 	// create shared fdwatcher instance
 	fdw = fdwatcher_create();
 	if (fdw == NULL) {
 		err(3, "fdwatcher_create");
 	}
 
+	// open the result cache
+	if (opts.cache_ttl > 0 && !opts.dry_run) {
+		if (opts.cache_dir == NULL) {
+			opts.cache_dir = default_cache_dir();
+		}
+		cache = cache_open(opts.cache_dir);
+		if (cache == NULL) {
+			err(2, "open cache %s", opts.cache_dir);
+		}
+	}
+
+	// load the snapshot to compare against and identify hosts in snapshots
+	if (opts.changed_since != NULL) {
+		previous_snapshot = snapshot_load(opts.changed_since);
+		if (previous_snapshot == NULL) {
+			err(2, "load snapshot %s", opts.changed_since);
+		}
+	}
+	if (opts.snapshot != NULL || opts.changed_since != NULL) {
+		hash_host_names();
+	}
+
+	// read the commands to run
+	if (opts.script != NULL) {
+		load_script(opts.script);
+	}
+
+	// create the table of lines to collapse
+	if (opts.collapse > 0) {
+		collapse = collapse_create();
+	}
+
+	// create the sketch of the most frequent lines
+	if (opts.top > 0) {
+		top_lines = topk_create((size_t)opts.top * TOP_COUNTERS,
+		    opts.max_line_length);
+		if (top_lines == NULL) {
+			err(3, "topk_create");
+		}
+		top_buffer = safe_malloc(opts.max_line_length + 2,
+		    "top_buffer");
+	}
+
+	// create the live status (only drawn on a terminal)
+	if (opts.dashboard && stdout_isatty) {
+		dashboard = dashboard_create(num_hosts);
+	}
+
+	// create the watch queue
+	if (opts.watch > 0) {
+		watch_queue_size = num_hosts;
+		watch_queue = safe_malloc(sizeof (Host *) * num_hosts,
+		    "watch_queue");
+	}
+
+	// create the probe window
+	if (opts.probe) {
+		probe_slots = safe_malloc(sizeof (FdEvent *) * opts.max_jobs,
+		    "probe_slots");
+		probe_queue = safe_malloc(sizeof (Host *) * opts.max_jobs,
+		    "probe_queue");
+		for (int i = 0; i < opts.max_jobs; i++) {
+			probe_slots[i] = NULL;
+		}
+	}
+
+	// pick the functions that handle output
+	output_handlers_init();
+
+	// start the clock for line timestamps
+	if (opts.timestamps != TIMESTAMP_NONE) {
+		timestamp_start = monotonic_time_ms();
+		timestamp_update();
+	}
+
 	// handle signals and exit
 	sig.sa_handler = signal_handler;
 	sigemptyset(&sig.sa_mask);
@@ -1908,6 +8081,22 @@ main(int argc, char **argv)
 		err(3, "register SIGINT");
 	}
 
+	// a session that goes away is noticed when its output pipes close
+	if (opts.session && signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		err(3, "ignore SIGPIPE");
+	}
+
+	// pick a random token for session step markers
+	if (opts.session) {
+		snprintf(session_token, sizeof (session_token),
+		    "%04lx%04lx%04lx%04lx",
+		    random_below(0x10000), random_below(0x10000),
+		    random_below(0x10000), random_below(0x10000));
+		session_prefix_len = snprintf(session_prefix,
+		    sizeof (session_prefix), "\n\036%s:%s:",
+		    PROG_NAME, session_token);
+	}
+
 	// print debug output
 	if (opts.debug) {
 		// print hosts
@@ -1943,26 +8132,83 @@ main(int argc, char **argv)
 		// print max jobs
 		DEBUG("max-jobs: %s%d%s\n",
 		    colors.green, opts.max_jobs, colors.reset);
+
+		// print jump hosts
+		if (num_jumps > 0) {
+			DEBUG("jump hosts: [ ");
+			for (int i = 0; i < num_jumps; i++) {
+				printf("%s'%s'%s ",
+				    colors.green, jumps[i].spec, colors.reset);
+			}
+			printf("]\n");
+		}
+
+		// print result cache
+		if (cache != NULL) {
+			DEBUG("cache: %s%s%s (%s%d%s s)\n",
+			    colors.green, opts.cache_dir, colors.reset,
+			    colors.magenta, opts.cache_ttl, colors.reset);
+		}
+	}
+
+	// start the clock for the resources used
+	if (opts.stats) {
+		agg_init(&stats_user);
+		agg_init(&stats_sys);
+		agg_init(&stats_rss);
+		for (int i = 0; i < STATS_TOP; i++) {
+			stats_top[i] = NULL;
+		}
+		stats_started_time = monotonic_time_ms();
 	}
 
 	// start the main loop!
 	if (opts.dry_run) {
 		printf("(dry run)\n");
+	} else if (opts.shell) {
+		shell_loop();
+	} else if (opts.script != NULL) {
+		script_loop();
 	} else {
+		ordered_head = hosts;
 		main_loop(num_hosts);
 
 		// finish up
+		if (top_lines != NULL) {
+			print_top_lines();
+		}
+		if (num_aggs > 0) {
+			print_aggs();
+		}
 		switch (opts.mode) {
 		case MODE_JOIN:
 			finish_join_mode(num_hosts);
+			if (opts.snapshot != NULL) {
+				write_snapshot(opts.snapshot, num_hosts);
+			}
 			break;
 		default:
 			break;
 		}
 	}
 
+	// print the resources used by the commands
+	if (opts.stats && !opts.dry_run) {
+		print_stats();
+	}
+
 	// tidy up
 	fdwatcher_destroy(fdw);
+	free(probe_slots);
+	free(probe_queue);
+	free(watch_queue);
+	free(timeout_queue.entries);
+	free(kill_queue.entries);
+	while (block_pool != NULL) {
+		BlockChunk *chunk = block_pool;
+		block_pool = chunk->next;
+		free(chunk);
+	}
 
 	// check exit codes and free memory
 	while (hosts != NULL) {
@@ -1971,7 +8217,8 @@ main(int argc, char **argv)
 
 		if (!opts.dry_run) {
 			assert(host->cp->exit_code >= 0);
-			if (host->cp->exit_code != 0) {
+			if (host->cp->exit_code != 0 ||
+			    host->cp->failed_steps > 0) {
 				exit_code = 1;
 			}
 		}
@@ -1979,6 +8226,17 @@ main(int argc, char **argv)
 		hosts = host->next;
 		host_destroy(host);
 	}
+	for (int i = 0; i < num_script_steps; i++) {
+		free(script_steps[i]);
+	}
+	free(script_steps);
+	collapse_destroy(collapse);
+	dashboard_destroy(dashboard);
+	topk_destroy(top_lines);
+	free(top_buffer);
+	hostdb_close(hostdb);
+	cache_close(cache);
+	snapshot_destroy(previous_snapshot);
 
 	// get end time and calculate time taken
 	end_time = monotonic_time_ms();
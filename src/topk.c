@@ -0,0 +1,343 @@
+/*
+ * TopK - Streaming Heavy Hitters.
+ *
+ * See the accompanying header file for more information.
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "topk.h"
+
+/*
+ * Swap two heap positions, keeping the entries' `heap_idx` up to date.
+ */
+static void
+topk_heap_swap(TopK *tk, size_t a, size_t b)
+{
+	size_t tmp = tk->heap[a];
+
+	tk->heap[a] = tk->heap[b];
+	tk->heap[b] = tmp;
+	tk->entries[tk->heap[a]].heap_idx = a;
+	tk->entries[tk->heap[b]].heap_idx = b;
+}
+
+/*
+ * Move the entry at the given heap position down until both of its children
+ * have a count at least as high (counts only ever go up).
+ */
+static void
+topk_heap_down(TopK *tk, size_t i)
+{
+	for (;;) {
+		size_t left = i * 2 + 1;
+		size_t right = left + 1;
+		size_t min = i;
+
+		if (left < tk->num_entries &&
+		    tk->entries[tk->heap[left]].count <
+		    tk->entries[tk->heap[min]].count) {
+			min = left;
+		}
+		if (right < tk->num_entries &&
+		    tk->entries[tk->heap[right]].count <
+		    tk->entries[tk->heap[min]].count) {
+			min = right;
+		}
+		if (min == i) {
+			return;
+		}
+
+		topk_heap_swap(tk, i, min);
+		i = min;
+	}
+}
+
+/*
+ * Remove an entry from its hash bucket.
+ */
+static void
+topk_unlink(TopK *tk, int idx)
+{
+	int *p = &tk->buckets[tk->entries[idx].hash & (tk->num_buckets - 1)];
+
+	while (*p != idx) {
+		assert(*p != -1);
+		p = &tk->entries[*p].next;
+	}
+	*p = tk->entries[idx].next;
+}
+
+/*
+ * Create a TopK.
+ */
+TopK *
+topk_create(size_t capacity, size_t item_max)
+{
+	assert(capacity > 0);
+
+	TopK *tk = calloc(1, sizeof (TopK));
+	if (tk == NULL) {
+		return NULL;
+	}
+
+	tk->capacity = capacity;
+	tk->item_max = item_max;
+
+	// keep the buckets at most half full
+	tk->num_buckets = 16;
+	while (tk->num_buckets < capacity * 2) {
+		tk->num_buckets *= 2;
+	}
+
+	tk->entries = calloc(capacity, sizeof (TopKEntry));
+	tk->heap = calloc(capacity, sizeof (size_t));
+	tk->sorted = calloc(capacity, sizeof (TopKEntry *));
+	tk->buckets = malloc(sizeof (int) * tk->num_buckets);
+	if (tk->entries == NULL || tk->heap == NULL || tk->sorted == NULL ||
+	    tk->buckets == NULL) {
+		goto fail;
+	}
+	for (size_t i = 0; i < tk->num_buckets; i++) {
+		tk->buckets[i] = -1;
+	}
+	for (size_t i = 0; i < capacity; i++) {
+		tk->entries[i].item = malloc(item_max + 1);
+		if (tk->entries[i].item == NULL) {
+			goto fail;
+		}
+	}
+
+	return tk;
+
+fail:
+	topk_destroy(tk);
+	return NULL;
+}
+
+/*
+ * Count an item.
+ */
+void
+topk_add(TopK *tk, const char *item, size_t len, uint64_t source)
+{
+	assert(tk != NULL);
+	assert(item != NULL);
+
+	TopKEntry *e;
+	uint64_t hash;
+	size_t bit;
+	int idx;
+
+	if (len > tk->item_max) {
+		len = tk->item_max;
+	}
+	hash = hash_bytes(item, len);
+	tk->total++;
+
+	// look for the item
+	idx = tk->buckets[hash & (tk->num_buckets - 1)];
+	while (idx != -1) {
+		e = &tk->entries[idx];
+		if (e->hash == hash && e->len == len &&
+		    memcmp(e->item, item, len) == 0) {
+			break;
+		}
+		idx = e->next;
+	}
+
+	if (idx == -1) {
+		uint64_t min_count = 0;
+
+		if (tk->num_entries < tk->capacity) {
+			// use a free counter
+			idx = tk->num_entries;
+			tk->heap[tk->num_entries] = idx;
+			tk->entries[idx].heap_idx = tk->num_entries;
+			tk->num_entries++;
+		} else {
+			// take over the counter with the lowest count
+			idx = tk->heap[0];
+			min_count = tk->entries[idx].count;
+			topk_unlink(tk, idx);
+		}
+
+		e = &tk->entries[idx];
+		memcpy(e->item, item, len);
+		e->item[len] = '\0';
+		e->len = len;
+		e->hash = hash;
+		e->count = min_count;
+		e->error = min_count;
+		memset(e->sources, 0, sizeof (e->sources));
+		e->next = tk->buckets[hash & (tk->num_buckets - 1)];
+		tk->buckets[hash & (tk->num_buckets - 1)] = idx;
+	}
+
+	// mix the source so any unique value spreads over the bitmap
+	source ^= source >> 33;
+	source *= 0xff51afd7ed558ccdULL;
+	source ^= source >> 33;
+	bit = source & (TOPK_SOURCE_BITS - 1);
+
+	e = &tk->entries[idx];
+	e->sources[bit / 64] |= (uint64_t)1 << (bit % 64);
+	e->count++;
+	topk_heap_down(tk, e->heap_idx);
+}
+
+/*
+ * Compare 2 entries for sorting, highest count first.
+ */
+static int
+topk_compare(const void *a, const void *b)
+{
+	const TopKEntry *ea = *(const TopKEntry * const *)a;
+	const TopKEntry *eb = *(const TopKEntry * const *)b;
+
+	if (ea->count != eb->count) {
+		return ea->count > eb->count ? -1 : 1;
+	}
+	if (ea->error != eb->error) {
+		return ea->error < eb->error ? -1 : 1;
+	}
+
+	// items may contain nul bytes
+	int cmp = memcmp(ea->item, eb->item, ea->len < eb->len ? ea->len :
+	    eb->len);
+
+	if (cmp != 0) {
+		return cmp;
+	}
+	return ea->len < eb->len ? -1 : ea->len > eb->len;
+}
+
+/*
+ * Move the entry at the given position down a heap of `n` entries (with the
+ * entry that sorts last at the root).
+ */
+static void
+topk_sort_down(const TopKEntry **a, size_t i, size_t n)
+{
+	for (;;) {
+		size_t left = i * 2 + 1;
+		size_t right = left + 1;
+		size_t max = i;
+		const TopKEntry *tmp;
+
+		if (left < n && topk_compare(&a[left], &a[max]) > 0) {
+			max = left;
+		}
+		if (right < n && topk_compare(&a[right], &a[max]) > 0) {
+			max = right;
+		}
+		if (max == i) {
+			return;
+		}
+
+		tmp = a[i];
+		a[i] = a[max];
+		a[max] = tmp;
+		i = max;
+	}
+}
+
+/*
+ * Get the most frequent items.
+ *
+ * This is called from signal handlers (eg. to print a status report) so it
+ * heapsorts in place rather than using qsort, which may allocate memory.
+ */
+size_t
+topk_sorted(TopK *tk, const TopKEntry ***out, size_t k)
+{
+	assert(tk != NULL);
+	assert(out != NULL);
+
+	const TopKEntry **all = tk->sorted;
+	size_t n = k < tk->num_entries ? k : tk->num_entries;
+
+	*out = all;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	// sort every counter (no more than `capacity` of them)
+	for (size_t i = 0; i < tk->num_entries; i++) {
+		all[i] = &tk->entries[i];
+	}
+	for (size_t i = tk->num_entries / 2; i > 0; i--) {
+		topk_sort_down(all, i - 1, tk->num_entries);
+	}
+	for (size_t i = tk->num_entries - 1; i > 0; i--) {
+		const TopKEntry *tmp = all[0];
+
+		all[0] = all[i];
+		all[i] = tmp;
+		topk_sort_down(all, 0, i);
+	}
+
+	return n;
+}
+
+/*
+ * Estimate the number of sources with linear counting: n = m * ln(m / z) for
+ * an m bit bitmap with z bits unset.
+ */
+uint64_t
+topk_sources(const TopKEntry *e)
+{
+	assert(e != NULL);
+
+	double m = TOPK_SOURCE_BITS;
+	double estimate;
+	int z = 0;
+
+	for (size_t i = 0; i < TOPK_SOURCE_BITS / 64; i++) {
+		for (int j = 0; j < 64; j++) {
+			if (!(e->sources[i] & ((uint64_t)1 << j))) {
+				z++;
+			}
+		}
+	}
+
+	// a full bitmap can only tell there are a lot of sources
+	estimate = m * log(m / (z > 0 ? z : 1));
+
+	// there can't be more sources than times the item was seen
+	if (estimate + 0.5 > (double)e->count) {
+		return e->count;
+	}
+	return (uint64_t)(estimate + 0.5);
+}
+
+/*
+ * Free a TopK.
+ */
+void
+topk_destroy(TopK *tk)
+{
+	if (tk == NULL) {
+		return;
+	}
+
+	if (tk->entries != NULL) {
+		for (size_t i = 0; i < tk->capacity; i++) {
+			free(tk->entries[i].item);
+		}
+	}
+	free(tk->entries);
+	free(tk->heap);
+	free(tk->sorted);
+	free(tk->buckets);
+	free(tk);
+}
@@ -0,0 +1,109 @@
+/*
+ * TopK - Streaming Heavy Hitters.
+ *
+ * A TopK finds the most frequent items in a stream of any length using a
+ * fixed amount of memory, with the Space-Saving algorithm (Metwally et al.).
+ * It keeps `capacity` counters, each monitoring one item:
+ *
+ * - An item that is already monitored has its counter incremented.
+ * - A new item takes over the counter with the lowest count, which it
+ *   inherits (plus one) - the inherited count is remembered as the counter's
+ *   maximum overestimate (`error`).
+ *
+ * Any item seen more than `n / capacity` times out of `n` is guaranteed to be
+ * monitored, and the counts of monitored items are never underestimated.  The
+ * counters are kept in a binary min-heap (so the lowest count is always at the
+ * root) and are indexed by a chained hash table on the item.
+ *
+ * Every counter also estimates the number of distinct sources (eg. hosts) that
+ * added its item with linear counting over a small bitmap, which is accurate
+ * to within a few percent for up to a few thousand sources.
+ *
+ * All memory is allocated up front by `topk_create()`; items longer than
+ * `item_max` bytes are truncated.
+ *
+ * ```
+ * TopK *tk = topk_create(100, 256);
+ * topk_add(tk, "hello", 5, source);
+ * topk_add(tk, "world", 5, source);
+ * topk_add(tk, "hello", 5, source);
+ *
+ * const TopKEntry **top;
+ * size_t n = topk_sorted(tk, &top, 2);
+ * assert(n == 2 && top[0]->count == 2);
+ * topk_destroy(tk);
+ * ```
+ */
+
+/*
+ * License: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// number of bits used to count the distinct sources of an item
+#define TOPK_SOURCE_BITS	1024
+
+/*
+ * A counter monitoring a single item.
+ */
+typedef struct topk_entry {
+	char *item;		// the item (nul-terminated)
+	size_t len;		// length of the item
+	uint64_t hash;		// hash of the item
+	uint64_t count;		// number of times seen (never underestimated)
+	uint64_t error;		// maximum overestimate of count
+	uint64_t sources[TOPK_SOURCE_BITS / 64]; // sources seen (bitmap)
+	size_t heap_idx;	// position in the heap
+	int next;		// next entry in the same bucket, -1 = none
+} TopKEntry;
+
+/*
+ * TopK Opaque object.
+ *
+ * This type should not be created manually, but instead created with
+ * `topk_create()`.
+ */
+typedef struct topk {
+	TopKEntry *entries;	// counters, `capacity` in size
+	size_t num_entries;	// number of counters in use
+	size_t capacity;	// number of counters
+	size_t item_max;	// maximum length of an item
+	size_t *heap;		// entry indexes, min-heap on count
+	const TopKEntry **sorted;	// entries sorted by `topk_sorted()`
+	int *buckets;		// first entry in each bucket, -1 = empty
+	size_t num_buckets;	// number of buckets (always a power of 2)
+	uint64_t total;		// number of items added
+} TopK;
+
+/*
+ * Create a TopK with the given number of counters, storing at most `item_max`
+ * bytes of each item.
+ *
+ * Returns NULL and sets errno on error.
+ */
+TopK *topk_create(size_t capacity, size_t item_max);
+
+/*
+ * Count an item added by the given source (any well-distributed or unique 64
+ * bit value, eg. a hash of a hostname or a pointer).
+ */
+void topk_add(TopK *tk, const char *item, size_t len, uint64_t source);
+
+/*
+ * Sort the monitored items, most frequent first, and point `out` at them
+ * (valid until the next call to `topk_add()`).  Doesn't allocate memory.
+ * Returns the number of items available, at most `k`.
+ */
+size_t topk_sorted(TopK *tk, const TopKEntry ***out, size_t k);
+
+/*
+ * Estimate the number of distinct sources that added an entry's item.
+ */
+uint64_t topk_sources(const TopKEntry *e);
+
+/*
+ * Free a TopK.
+ */
+void topk_destroy(TopK *tk);